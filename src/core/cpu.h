@@ -0,0 +1,16 @@
+#pragma once
+
+#include <intrin.h>
+
+namespace core
+{
+	namespace cpu
+	{
+		inline bool hasSSE2()
+		{
+			int info[4];
+			__cpuid(info, 1);
+			return 0 != (info[3] & (1 << 26));
+		}
+	}
+}
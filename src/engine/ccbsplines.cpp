@@ -1,79 +1,156 @@
 #include "stdafx.h"
 #include "ccbsplines.h"
 #include "../core/err.h"
+#include "../core/fatalexception.h"
 #include "../math/notrand.h"
+#include "../math/counterrand.h"
+#include "../math/bspline.h"
 using engine::CCBSplines;
 using namespace math;
 
 
+CCBSplines::CCBSplines(renderer::Device &device, int loopCount, int lod) :
+	device(device),
+	loopCount(loopCount),
+	lod(lod),
+	spacing(0.0f),
+	draws(0)
+{
+	if (loopCount < 1 || lod < 1) throw core::FatalException("spline loops need at least one loop and one point per knot");
+	ps = ParticleStreamer(device);
+	knots.resize(loopCount*CSNK);
+#pragma omp parallel for
+	for (int i = 0; i < loopCount; ++i)
+		generateKnots(i);
+}
+
 void CCBSplines::draw(engine::Effect &effect, double time) {
 	UINT passes;
 	effect->Begin(&passes, 0);
 	for (UINT pass = 0; pass < passes; ++pass)
 	{
 		effect->BeginPass( pass );
-		drawFrame(effect, time);
+		drawFrame(time);
 		effect->EndPass();
 	}
 	effect->End();
 }
 
-void CCBSplines::drawFrame(engine::Effect &effect, double stime) {
-	int time = int(floor(stime * 8));
-	for (int i = 0; i < CSLOOP; ++i) {
+size_t CCBSplines::drawFrame(double stime) {
+	size_t particles = 0;
+	draws = 0;
+	// all trails share the batches, a batch is only drawn once it is full
+	ps.begin();
+	for (int i = 0; i < loopCount; ++i) {
 		float size =  0.75f + notRandf(i) * 0.25f;
 		size *= 0.25f;
-		ps.begin();
-		for (int c = time; c < time+CSLOD; ++c)
+		getTrail(i, stime, isWindowed(), trail);
+		// the same falloff along the trail whatever its point count
+		int count = int(trail.size());
+		float falloff = 0.125f * lod / count;
+		for (int c = 0; c < count; ++c)
 		{
-			ps.add(loops[i].vectors[c%(CSNK*CSLOD)], size / (1 + ((time + CSLOD) - c) * 0.125f));
+			if (0 == ps.getRoom()) {
+				ps.end();
+				ps.draw();
+				++draws;
+				ps.begin();
+			}
+			ps.add(trail[c], size / (1 + (count - c) * falloff));
 		}
-		ps.end();
+		particles += count;
+	}
+	ps.end();
+	if (ps.getRoom() < PARTICLE_STREAMER_PARTICLE_COUNT) {
 		ps.draw();
+		++draws;
 	}
+	return particles;
 }
 
+void CCBSplines::getTrail(int loop, double stime, bool windowed, std::vector<Vector3>& points) const {
+	int step = int(floor(stime * 8));
+	if (spacing > 0) {
+		// the head moves a lod-th of an average segment every step, the trail is a segment long
+		const math::ArcLengthTable& arc = arcs[loop];
+		float length = arc.getLength() / CSNK;
+		float head = float(step + lod-1) * length / lod;
+		int count = std::max(1, int(length / spacing));
+		points.resize(count);
+		for (int i = 0; i < count; ++i)
+			points[i] = arc.getPoint(arc.getParameter(head - (count-1 - i)*spacing));
+		return;
+	}
 
-
-void CCBSplines::generateSplineLoops() {
-	for (int i = 0; i < CSLOOP; ++i){
-		CCBSplineLoop sl;
-		generateKnots(i, sl);
-		generateSplines(sl);
-		loops[i] = sl;
+	int c = step % (CSNK*lod);
+	points.resize(lod);
+	if (!windowed) {
+		assert(!table.empty());
+		const Vector3* src = &table[size_t(loop)*CSNK*lod];
+		for (int i = 0; i < lod; ++i)
+			points[i] = src[(c+i)%(CSNK*lod)];
+		return;
 	}
-}
 
-void CCBSplines::generateKnots(int mod, CCBSplineLoop& sl) {
-	for (int i = 0; i < CSNK; ++i) {
-		sl.knots[i] = Vector3((rand() * (1.f / RAND_MAX))*5.f-2.5f,(rand() * (1.f / RAND_MAX))*5.f-2.5f,(rand() * (1.f / RAND_MAX))*5.f-2.5f);
-		//sl.knots[i] = Vector3(notRandf(i+mod+1)*5.f-2.5f,notRandf(i+mod+2)*5.f-2.5f,notRandf(i+mod+3)*5.f-2.5f);
+	// the window spans at most two segments, the stepper is restarted on each
+	const Vector3* k = &knots[loop*CSNK];
+	int seg = c / lod, i = c % lod;
+	BSplineStepper stepper;
+	stepper.start(k[seg], k[(seg+1)%CSNK], k[(seg+2)%CSNK], k[(seg+3)%CSNK], lod, i);
+	for (int n = 0; n < lod; ++n) {
+		points[n] = stepper.getPoint();
+		if (++i < lod) {
+			stepper.step();
+		} else {
+			i = 0;
+			seg = (seg+1)%CSNK;
+			stepper.start(k[seg], k[(seg+1)%CSNK], k[(seg+2)%CSNK], k[(seg+3)%CSNK], lod, 0);
+		}
 	}
 }
 
-Vector3 evalSpline(const Vector3 &v0, const Vector3 &v1, const Vector3 &v2, const Vector3 &v3, float t)
-{
-	float it= (float)1.0-t;
+void CCBSplines::setSpacing(float spacing) {
+	if (spacing < 0) throw core::FatalException("negative spline trail spacing");
+	this->spacing = spacing;
+	if (0 == spacing || !arcs.empty())
+		return;
+	arcs.resize(loopCount);
+#pragma omp parallel for
+	for (int i = 0; i < loopCount; ++i)
+		arcs[i].build(&knots[i*CSNK], CSNK);
+}
 
-	float b0 = it*it*it/6.f;
-	float b1 = (3.f*t*t*t-6.f*t*t+4.f)/6.f;
-	float b2 = (-3.f*t*t*t+3.f*t*t+3.f*t+1)/6.f;
-	float b3 = t*t*t/6.f;
+void CCBSplines::setWindowed(bool windowed) {
+	if (windowed == isWindowed()) return;
+	if (windowed) {
+		std::vector<Vector3>().swap(table);
+		return;
+	}
+	generateSplines();
+}
 
-	float x = b0*v0.x + b1*v1.x + b2*v2.x + b3*v3.x;
-	float y = b0*v0.y + b1*v1.y + b2*v2.y + b3*v3.y;
-	float z = b0*v0.z + b1*v1.z + b2*v2.z + b3*v3.z;
-	return Vector3(x, y, z);
+void CCBSplines::generateKnots(int loop) {
+	float r[3*CSNK];
+	counterRandFill(CSSEED, loop, 0, 3*CSNK, r);
+	for (int i = 0; i < CSNK; ++i) {
+		knots[loop*CSNK + i] = Vector3(r[3*i]*5.f-2.5f, r[3*i+1]*5.f-2.5f, r[3*i+2]*5.f-2.5f);
+		//knots[loop*CSNK + i] = Vector3(notRandf(i+loop+1)*5.f-2.5f,notRandf(i+loop+2)*5.f-2.5f,notRandf(i+loop+3)*5.f-2.5f);
+	}
 }
 
-void CCBSplines::generateSplines(CCBSplineLoop& sl) {
-	for (int c = 0; c < CSNK; ++c){
-		for (int i = 0; i < CSLOD; ++i) {
-			float t = (float)i / (float)CSLOD;
-			sl.vectors[c*CSLOD+i] = evalSpline(sl.knots[(c-0)%CSNK], sl.knots[(c+1)%CSNK], sl.knots[(c+2)%CSNK], sl.knots[(c+3)%CSNK], t);
+void CCBSplines::generateSplines() {
+	const UniformBSpline spline(lod);
+	float k[CSNK];
+	std::vector<float> points(CSNK*lod);
+	table.resize(size_t(loopCount)*CSNK*lod);
+	for (int loop = 0; loop < loopCount; ++loop) {
+		Vector3* dst = &table[size_t(loop)*CSNK*lod];
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int i = 0; i < CSNK; ++i)
+				k[i] = knots[loop*CSNK + i][axis];
+			spline.evalLoop(k, CSNK, &points[0]);
+			for (int i = 0; i < CSNK*lod; ++i)
+				dst[i][axis] = points[i];
 		}
 	}
 }
-
-
-
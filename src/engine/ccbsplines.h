@@ -3,6 +3,7 @@
 #include "effect.h"
 #include "particlestreamer.h"
 #include "../math/vector3.h"
+#include "../math/arclength.h"
 #include "../renderer/device.h"
 using math::Vector3;
 
@@ -11,30 +12,53 @@ namespace engine
 	class CCBSplines {
 	public:
 		#define CSNK 40		//num of knots per spline loop
-		#define CSLOD 128	//level of detail per knot
-		#define	CSLOOP 20	//num of spline loops
+		#define CSLOD 128	//default level of detail per knot
+		#define	CSLOOP 20	//default num of spline loops
+		#define CSSEED 0x5b1e	//seed of the knots, a stream per loop
 
-		struct CCBSplineLoop {
-			Vector3 knots[CSNK];
-			Vector3 vectors[CSNK*CSLOD];
-		};
-
-		CCBSplines(renderer::Device &device) : device(device) {
-			ps = ParticleStreamer(device);
-			generateSplineLoops();
-		}
+		// loopCount trails of lod points each, lod also being the points per knot
+		CCBSplines(renderer::Device &device, int loopCount = CSLOOP, int lod = CSLOD);
 
 		void draw(engine::Effect &effect, double time);
-	private:
-		void drawFrame(engine::Effect &effect, double time);
 
-		void generateSplineLoops();
-		void generateKnots(int mod, CCBSplineLoop& sl);
-		void generateSplines(CCBSplineLoop& sl);
+		// streams the trails of all loops into as few particle batches as fit, returns the particle count
+		size_t drawFrame(double time);
+		// the draw calls of the last drawFrame
+		size_t getDrawCount() const { return draws; }
+
+		// windowed (the default) evaluates just the visible lod points of each trail per frame,
+		// forward differencing from the knots. otherwise all CSNK*lod points of every loop are
+		// tabled up front, which is loops*CSNK*lod*12 bytes.
+		void setWindowed(bool windowed);
+		bool isWindowed() const { return table.empty(); }
+
+		// a spacing of 0 (the default) puts the lod points of a trail evenly in t, so they bunch up
+		// where the knots are close. otherwise they are spacing apart along the curve, using arc
+		// length tables of the loops, and the trails move at the same speed everywhere. a trail is
+		// as long as a segment of its loop on average either way, so a larger spacing is fewer particles.
+		void setSpacing(float spacing);
+		float getSpacing() const { return spacing; }
+
+		// the points of a loop's trail at time, oldest first. tabled needs setWindowed(false),
+		// and is only for a spacing of 0
+		void getTrail(int loop, double time, bool windowed, std::vector<Vector3>& points) const;
+
+		int getLoopCount() const { return loopCount; }
+		int getLod() const { return lod; }
+		const Vector3& getKnot(int loop, int i) const { return knots[loop*CSNK + i%CSNK]; }
+	private:
+		void generateKnots(int loop);
+		void generateSplines();
 
 		renderer::Device &device;
 		ParticleStreamer ps;
-		CCBSplineLoop loops[CSLOOP];
+		int loopCount, lod;
+		float spacing;
+		std::vector<Vector3> knots;
+		std::vector<math::ArcLengthTable> arcs;
+		std::vector<Vector3> table;
+		std::vector<Vector3> trail;
+		size_t draws;
 
 	};
 }
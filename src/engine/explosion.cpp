@@ -3,23 +3,112 @@
 #include "../core/err.h"
 #include "../math/notrand.h"
 #include <algorithm>
+#include <emmintrin.h>
 
 using namespace math;
 using namespace std;
 using engine::Explosion;
 
+namespace
+{
+	/* sine and cosine of 4 angles: reduced by quarter turns to [-pi/4, pi/4]
+	 * (pi/2 in three parts, exact up to 2^16 quarter turns) and the cephes
+	 * single precision polynomials from there */
+	void sincos4(__m128 x, __m128 &s, __m128 &c)
+	{
+		__m128i q = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.636619772f)));
+		__m128 fq = _mm_cvtepi32_ps(q);
+		__m128 r = _mm_sub_ps(x, _mm_mul_ps(fq, _mm_set1_ps(1.5703125f)));
+		r = _mm_sub_ps(r, _mm_mul_ps(fq, _mm_set1_ps(4.837512969970703125e-4f)));
+		r = _mm_sub_ps(r, _mm_mul_ps(fq, _mm_set1_ps(7.549789948768648e-8f)));
+		__m128 r2 = _mm_mul_ps(r, r);
+
+		__m128 ps = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-1.9515295891e-4f), r2), _mm_set1_ps(8.3321608736e-3f));
+		ps = _mm_add_ps(_mm_mul_ps(ps, r2), _mm_set1_ps(-1.6666654611e-1f));
+		ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps, r2), r), r);
+
+		__m128 pc = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.443315711809948e-5f), r2), _mm_set1_ps(-1.388731625493765e-3f));
+		pc = _mm_add_ps(_mm_mul_ps(pc, r2), _mm_set1_ps(4.166664568298827e-2f));
+		pc = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(pc, r2), r2), _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(r2, _mm_set1_ps(0.5f))));
+
+		/* odd quarters swap the two, sine flips in quarters 2 and 3, cosine in 1 and 2 */
+		__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+		__m128 signS = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, _mm_set1_epi32(2)), 30));
+		__m128 signC = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+		s = _mm_xor_ps(_mm_or_ps(_mm_and_ps(swap, pc), _mm_andnot_ps(swap, ps)), signS);
+		c = _mm_xor_ps(_mm_or_ps(_mm_and_ps(swap, ps), _mm_andnot_ps(swap, pc)), signC);
+	}
+
+	/* the angles wrapped to [-pi, pi] for sincos4(), whole turns taken off
+	 * in double so the float angle stays as it was however long the animation
+	 * runs. past 2^31 turns a float has no fraction of a turn left, those and
+	 * nans end up clamped */
+	__m128 wrapAngle4(__m128 x)
+	{
+		const __m128d turn = _mm_set1_pd(6.283185307179586);
+		const __m128d inv_turn = _mm_set1_pd(0.15915494309189535);
+		__m128d lo = _mm_cvtps_pd(x), hi = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+		lo = _mm_sub_pd(lo, _mm_mul_pd(_mm_cvtepi32_pd(_mm_cvtpd_epi32(_mm_mul_pd(lo, inv_turn))), turn));
+		hi = _mm_sub_pd(hi, _mm_mul_pd(_mm_cvtepi32_pd(_mm_cvtpd_epi32(_mm_mul_pd(hi, inv_turn))), turn));
+		__m128 r = _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+		return _mm_max_ps(_mm_min_ps(r, _mm_set1_ps(3.14159274f)), _mm_set1_ps(-3.14159274f));
+	}
+
+	/* rodrigues: v cos + (k x v) sin + k (k . v)(1 - cos), what
+	 * D3DXMatrixRotationAxis() does to a row vector */
+	void rotate4(const __m128 k[3], __m128 s, __m128 c, __m128 &x, __m128 &y, __m128 &z)
+	{
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(k[0], x), _mm_mul_ps(k[1], y)), _mm_mul_ps(k[2], z)), _mm_sub_ps(_mm_set1_ps(1.0f), c));
+		__m128 rx = _mm_sub_ps(_mm_mul_ps(k[1], z), _mm_mul_ps(k[2], y));
+		__m128 ry = _mm_sub_ps(_mm_mul_ps(k[2], x), _mm_mul_ps(k[0], z));
+		__m128 rz = _mm_sub_ps(_mm_mul_ps(k[0], y), _mm_mul_ps(k[1], x));
+		x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, c), _mm_mul_ps(rx, s)), _mm_mul_ps(k[0], t));
+		y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, c), _mm_mul_ps(ry, s)), _mm_mul_ps(k[1], t));
+		z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(z, c), _mm_mul_ps(rz, s)), _mm_mul_ps(k[2], t));
+	}
+}
+
+Explosion::Explosion(renderer::Device &device, Vector3 begin, Vector3 end, int triangles) :
+	device(device),
+	count(triangles),
+	stride((triangles + 3) & ~3),
+	fragments(EXPLOSION_PLANES * ((triangles + 3) & ~3), 0.0f)
+{
+	if (count < 1) throw core::FatalException("an explosion needs at least one fragment");
+
+	dynamicVb = device.createVertexBuffer(sizeof(MovingVertex) * 3 * count, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, 0);
+	staticVb = device.createVertexBuffer(sizeof(FixedVertex) * 3 * count, D3DUSAGE_WRITEONLY, 0);
+
+	/* the same usages the fvf it used to be had */
+	const D3DVERTEXELEMENT9 vertex_elements[] =
+	{
+		{ 0, 0 * sizeof(float),  D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0 },
+		{ 0, 3 * sizeof(float),  D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0 },
+		{ 1, 0 * sizeof(float),  D3DDECLTYPE_FLOAT2, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0 },
+		{ 1, 2 * sizeof(float),  D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1 },
+		{ 1, 5 * sizeof(float),  D3DDECLTYPE_FLOAT3, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 2 },
+		{ 1, 8 * sizeof(float),  D3DDECLTYPE_FLOAT1, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 3 },
+		{ 1, 9 * sizeof(float),  D3DDECLTYPE_FLOAT1, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 4 },
+		{ 1, 10 * sizeof(float), D3DDECLTYPE_FLOAT1, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 5 },
+		D3DDECL_END()
+	};
+	decl = device.createVertexDeclaration(vertex_elements);
+
+	setupParameters(begin, end);
+	generateGraphics();
+}
+
 void Explosion::setupParameters(Vector3 &begin, Vector3 &end) {
 	dStep = length(begin+end)/(EXPLOSION_ANIMATION_LENGTH*4);
 	this->begin = begin;
 	this->end = end;
 	mworld.makeTranslation(begin);
 	rotCounter = 0;
-	lastTime = 0;
 }
 
 void Explosion::draw(engine::Effect &effect, int time) {
 	if (time > 0) {
-	updateGraphics(time);
+	updateGraphics();
 
 		effect->SetMatrix("worldpos", &mworld);
 		effect->SetFloat("dstep", dStep);
@@ -30,8 +119,10 @@ void Explosion::draw(engine::Effect &effect, int time) {
 		for (UINT pass = 0; pass < passes; ++pass) {
 			effect->BeginPass(pass);
 
-			device->SetStreamSource(0, vb, 0, sizeof(ExplosionVertex));
-			device->SetFVF(EXPLOSIONFVF);
+			core::d3dErr(device->SetFVF(0));
+			core::d3dErr(device->SetVertexDeclaration(decl));
+			device->SetStreamSource(0, dynamicVb, 0, sizeof(MovingVertex));
+			device->SetStreamSource(1, staticVb, 0, sizeof(FixedVertex));
 			device->DrawPrimitive(D3DPT_TRIANGLELIST, 0, count);
 
 			effect->EndPass();
@@ -41,105 +132,68 @@ void Explosion::draw(engine::Effect &effect, int time) {
 }
 
 
-void Explosion::updateGraphics(int time) {
-	ExplosionVertex* data = NULL;
-	data = (ExplosionVertex*) vb.lock(0, sizeof(ExplosionVertex) * EXPLOSION_BUFFER_SIZE, 0);
+void Explosion::updateGraphics() {
+	MovingVertex* data = (MovingVertex*) dynamicVb.lock(0, sizeof(MovingVertex) * 3 * count, D3DLOCK_DISCARD);
 	assert(NULL != data);
-
-	//transformation
-	Matrix4x4 mrot;
-	Matrix4x4 mtrans;
-	for (int i = 0; i < count; ++i) {
-		if (i <EXPLOSION_INIT_TRIANGLE_COUNT ) {
-			Vector3 axis = cross(end-begin, data->dir);
-			D3DXMatrixRotationAxis(&mrot, &axis, rotCounter/data->weight*0.1f);
-			for (int j = 0; j < 3; ++j) data[j].pos      = mul(mrot, data[j].initPos);
-			Vector3 norm = normalize(cross(data[1].pos - data[0].pos, data[2].pos - data[0].pos));
-			for (int j = 0; j < 3; ++j) data[j].norm = norm;
-			data += 3;
-		} else {
-			D3DXMatrixRotationAxis(&mrot, &data->dir, rotCounter/data->weight*0.02f);
-			
-			if (lastTime-time != 0) data->pos      = mul(mrot, data->initPos);
-			data++;
-
-			if (lastTime-time != 0) data->pos      = mul(mrot, data->initPos);
-			data++;
-
-			if (lastTime-time != 0) data->pos      = mul(mrot, data->initPos);
-			data++;
-		}
-	}
+	writeVertices(rotCounter, data);
+	dynamicVb.unlock();
 	rotCounter++;
-/*
-	//create additional fragments
-	int countStop = min(count+(unsigned)time,(unsigned)(EXPLOSION_ANIMATION_LENGTH+EXPLOSION_INIT_TRIANGLE_COUNT));
-	for (int i = count; i < countStop; ++i) {
-		float s = 0;
-		s			   = notRandf(time+i+1);
-		Vector2 uv1	   = Vector2(0,0);
-		Vector3 pos1   = Vector3(-s,-s,0);
-
-		s			   = notRandf(time+i+1);
-		Vector2 uv2	   = Vector2(0,1);
-		Vector3 pos2   = Vector3(-s,s,0);
-
-		s			   = notRandf(time+i+2);
-		Vector2 uv3	   = Vector2(1,1);
-		Vector3 pos3   = Vector3(s,s,0);
+}
 
-		Vector3 avg = (pos1 + pos2 + pos3)/3;
-		pos1 -= avg;
-		pos2 -= avg;
-		pos3 -= avg;
+void Explosion::writeVertices(int step, MovingVertex *dst) const {
+	const float *axis = getPlane(EXPLOSION_AXIS);
+	const float *normal = getPlane(EXPLOSION_NORMAL);
+	const float *corners = getPlane(EXPLOSION_CORNERS);
+	const float *weight = getPlane(EXPLOSION_WEIGHT);
+	const __m128 vstep = _mm_set1_ps(float(step));
+
+	const int groups = stride / 4;
+	#pragma omp parallel for
+	for (int g = 0; g < groups; ++g) {
+		const int i = g * 4;
+		__m128 k[3];
+		for (int a = 0; a < 3; ++a) k[a] = _mm_loadu_ps(axis + a*stride + i);
+		__m128 s, c;
+		sincos4(wrapAngle4(_mm_mul_ps(_mm_div_ps(vstep, _mm_loadu_ps(weight + i)), _mm_set1_ps(0.1f))), s, c);
+
+		// the triangle turns as a whole, so its normal just turns along
+		__m128 nx = _mm_loadu_ps(normal + i), ny = _mm_loadu_ps(normal + stride + i), nz = _mm_loadu_ps(normal + 2*stride + i);
+		rotate4(k, s, c, nx, ny, nz);
+		__m128 nlo = _mm_unpacklo_ps(ny, nz), nhi = _mm_unpackhi_ps(ny, nz);
+
+		// back to a vertex per row: pos and normal x, then normal y and z
+		__m128 rows[3][4];
+		for (int j = 0; j < 3; ++j) {
+			const float *corner = corners + 3*j*stride + i;
+			__m128 x = _mm_loadu_ps(corner), y = _mm_loadu_ps(corner + stride), z = _mm_loadu_ps(corner + 2*stride);
+			rotate4(k, s, c, x, y, z);
+			__m128 n = nx;
+			_MM_TRANSPOSE4_PS(x, y, z, n);
+			rows[j][0] = x; rows[j][1] = y; rows[j][2] = z; rows[j][3] = n;
+		}
 
-		float weight   = 0.5 * math::length(cross(pos3 - pos1, pos2 - pos1)); 
-		float size	   = notRandf(time+3);
-
-		Matrix4x4 minitrot;
-		minitrot.makeRotation(Vector3(D3DXToRadian(360*notRandf(time+i+5)),D3DXToRadian(360*notRandf(time+i+6)),D3DXToRadian(360*notRandf(time+i+7))));
-
-		data->uv       = uv1;
-		data->pos      = mul(minitrot,pos1);
-		data->initPos  = mul(minitrot,pos1);
-		data->dir	   = end-begin;
-		data->index    = (float) (i-EXPLOSION_INIT_TRIANGLE_COUNT);
-		data->size     = size;
-		data->weight   = weight;
-		data++;
-
-		data->uv       = uv2;
-		data->pos      = mul(minitrot,pos2);
-		data->initPos  = mul(minitrot,pos2);
-		data->dir	   = end-begin;
-		data->index    = (float) (i-EXPLOSION_INIT_TRIANGLE_COUNT);
-		data->size     = size;
-		data->weight   = weight;
-		data++;
-
-		data->uv       = uv3;
-		data->pos      = mul(minitrot,pos3);
-		data->initPos  = mul(minitrot,pos3);
-		data->dir	   = end-begin;
-		data->index    = (float) (i-EXPLOSION_INIT_TRIANGLE_COUNT);
-		data->size     = size;
-		data->weight   = weight;
-		data++;
+		// in vertex order, the vertex buffer is write combined
+		MovingVertex tail[12];
+		float *out = (float*)(i + 4 <= count ? dst + 3*i : tail);
+		for (int f = 0; f < 4; ++f) {
+			for (int j = 0; j < 3; ++j) {
+				_mm_storeu_ps(out, rows[j][f]);
+				if (f & 1) _mm_storeh_pi((__m64*)(out + 4), f < 2 ? nlo : nhi);
+				else       _mm_storel_pi((__m64*)(out + 4), f < 2 ? nlo : nhi);
+				out += 6;
+			}
+		}
+		if (i + 4 > count) memcpy(dst + 3*i, tail, sizeof(MovingVertex) * 3 * (count - i));
 	}
-	count = countStop;
-*/
-
-	vb.unlock();
-	data = NULL;
-	lastTime = time;
 }
 
 void Explosion::generateGraphics() {
-	count = EXPLOSION_INIT_TRIANGLE_COUNT;
-	ExplosionVertex* data = NULL;
-	data = (ExplosionVertex*) vb.lock(0, sizeof(ExplosionVertex) * EXPLOSION_BUFFER_SIZE, D3DLOCK_DISCARD);
+	FixedVertex* data = (FixedVertex*) staticVb.lock(0, sizeof(FixedVertex) * 3 * count, 0);
 	assert(NULL != data);
 
+	// the padding fragments don't turn
+	fill(&fragments[EXPLOSION_WEIGHT*stride], &fragments[EXPLOSION_WEIGHT*stride] + stride, FLT_MAX);
+
 	for (int i = 0; i < count; ++i) {
 		float s = 0;
 		s			   = notRandf(i)*EXPLISION_FRAGMENT_FACTOR;
@@ -175,34 +229,29 @@ void Explosion::generateGraphics() {
 		Matrix4x4 mrotz;
 		mrotz.makeRotation(Vector3(D3DXToRadian(360*notRandf(i+5)),D3DXToRadian(360*notRandf(i+6)),D3DXToRadian(360*notRandf(i+7))));
 
-		data->uv       = uv1;
-		data->pos      = mul(mrotz,pos1);
-		data->initPos  = mul(mrotz,pos1);
-		data->dir	   = newend-begin;
-		data->index    = (float) 0;
-		data->size     = size;
-		data->weight   = weight;
-		data++;
-
-		data->uv       = uv2;
-		data->pos      = mul(mrotz,pos2);
-		data->initPos  = mul(mrotz,pos2);
-		data->dir	   = newend-begin;
-		data->index    = (float) 0;
-		data->size     = size;
-		data->weight   = weight;
-		data++;
-
-		data->uv       = uv3;
-		data->pos      = mul(mrotz,pos3);
-		data->initPos  = mul(mrotz,pos3);
-		data->dir	   = newend-begin;
-		data->index    = (float) 0;
-		data->size     = size;
-		data->weight   = weight;
-		data++;
+		Vector3 corners[3] = { mul(mrotz,pos1), mul(mrotz,pos2), mul(mrotz,pos3) };
+		Vector2 uvs[3] = { uv1, uv2, uv3 };
+		for (int j = 0; j < 3; ++j) {
+			data->uv       = uvs[j];
+			data->initPos  = corners[j];
+			data->dir	   = newend-begin;
+			data->index    = (float) 0;
+			data->size     = size;
+			data->weight   = weight;
+			data++;
+		}
+
+		// what updateGraphics turns: a fragment flying straight out has no axis, it doesn't turn
+		Vector3 axis = normalize(cross(end-begin, newend-begin));
+		Vector3 norm = normalize(cross(corners[1] - corners[0], corners[2] - corners[0]));
+		for (int a = 0; a < 3; ++a) {
+			fragments[(EXPLOSION_AXIS + a)*stride + i] = axis[a];
+			fragments[(EXPLOSION_NORMAL + a)*stride + i] = norm[a];
+			for (int j = 0; j < 3; ++j) fragments[(EXPLOSION_CORNERS + 3*j + a)*stride + i] = corners[j][a];
+		}
+		fragments[EXPLOSION_WEIGHT*stride + i] = axis == Vector3(0, 0, 0) ? FLT_MAX : weight;
 	}
 
-	vb.unlock();
+	staticVb.unlock();
 	data = NULL;
 }
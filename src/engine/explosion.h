@@ -3,9 +3,11 @@
 #include "effect.h"
 #include "../renderer/device.h"
 #include "../renderer/vertexbuffer.h"
+#include "../renderer/vertexdeclaration.h"
 #include "../math/vector3.h"
 #include "../math/vector2.h"
 #include "../math/matrix4x4.h"
+#include <vector>
 using math::Vector2;
 using math::Vector3;
 using math::Matrix4x4;
@@ -23,13 +25,21 @@ namespace engine
 		#define SIZE_PERCENTAGE_RND_MIN 25
 		#define SIZE_PERCENTAGE_RND_MAX 50
 
-		#define EXPLOSION_BUFFER_SIZE (3*(EXPLOSION_INIT_TRIANGLE_COUNT))
-		#define EXPLOSIONFVF (D3DFVF_XYZ | D3DFVF_NORMAL | D3DFVF_TEX6 | D3DFVF_TEXCOORDSIZE2(0) | D3DFVF_TEXCOORDSIZE3(1) | \
-			D3DFVF_TEXCOORDSIZE3(2) | D3DFVF_TEXCOORDSIZE1(3) | D3DFVF_TEXCOORDSIZE1(4) | D3DFVF_TEXCOORDSIZE1(5))
+		#define EXPLOSION_AXIS 0		//planes of the fragment block: unit rotation axis x, y, z
+		#define EXPLOSION_NORMAL 3		//the normal before any rotation, x, y, z
+		#define EXPLOSION_CORNERS 6		//corner 0 x, y, z, corner 1 x, y, z, corner 2 x, y, z
+		#define EXPLOSION_WEIGHT 15		//the rotation of a step is 0.1 / weight
+		#define EXPLOSION_PLANES 16
 
-		struct ExplosionVertex {
+	public:
+		// stream 0, what the fragments rotate into every frame
+		struct MovingVertex {
 			D3DXVECTOR3 pos;
 			D3DXVECTOR3 norm;
+		};
+
+		// stream 1, written once: the rest the effect gets
+		struct FixedVertex {
 			D3DXVECTOR2 uv;
 			D3DXVECTOR3 dir;
 			D3DXVECTOR3 initPos;
@@ -38,29 +48,41 @@ namespace engine
 			float       weight;
 		};
 
+		Explosion(renderer::Device &device, Vector3 begin, Vector3 end, int triangles = EXPLOSION_INIT_TRIANGLE_COUNT);
 
-	public:
-		Explosion(renderer::Device &device, Vector3 begin, Vector3 end) : device(device), count(0) {
-			vb = device.createVertexBuffer(sizeof(ExplosionVertex) * EXPLOSION_BUFFER_SIZE, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, EXPLOSIONFVF);
+		void draw(engine::Effect &effect, int time);
 
-			setupParameters(begin, end);
-			generateGraphics();
-		};
+		// rotates the fragments a step further, into the dynamic vertex buffer
+		void updateGraphics();
 
-		void draw(engine::Effect &effect, int time);
+		// the 3 vertices of every fragment after step rotations, 4 fragments at a time
+		void writeVertices(int step, MovingVertex *dst) const;
+
+		int getTriangleCount() const { return count; }
+		int getStep() const { return rotCounter; }
+
+		// fragment i of a plane, see EXPLOSION_PLANES
+		float getFragment(int plane, int i) const { return fragments[plane*stride + i]; }
 
 	private:
 		void setupParameters(Vector3 &begin, Vector3 &end);
-		void updateGraphics(int time);
 		void generateGraphics();
 
+		const float *getPlane(int plane) const { return &fragments[plane*stride]; }
+
 		renderer::Device &device;
-		renderer::VertexBuffer vb;
+		renderer::VertexBuffer dynamicVb;
+		renderer::VertexBuffer staticVb;
+		renderer::VertexDeclaration decl;
 
 		int count;
-		int lastTime;
+		int stride;
 		int rotCounter;
 
+		// the fragments in one block, a plane of stride floats (count rounded
+		// up to 4) each, so the kernel loads the same of 4 fragments at once
+		std::vector<float> fragments;
+
 		Vector3 begin;
 		Vector3 end;
 
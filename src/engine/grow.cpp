@@ -1,7 +1,11 @@
 #include "stdafx.h"
 #include "Grow.h"
 #include "../core/err.h"
+#include "../core/fatalexception.h"
 #include "../math/notrand.h"
+#include "../math/bspline.h"
+#include "../math/arclength.h"
+#include "../math/counterrand.h"
 using engine::Grow;
 using namespace math;
 #include <algorithm>
@@ -12,219 +16,353 @@ void Grow::draw(engine::Effect &effect, float time, int part) {
 	if (part == 0)
 		return;
 /*
-	else if (part >= 1 && st0 == 0) st0 = time;
-	else if (part >= 3 && st2 == 0) st2 = time;
-	else if (part >= 4 && st3 == 0) st3 = time;
-	else if (part >= 5 && st4 == 0) st4 = time;
-	else if (part >= 6 && st5 == 0) st5 = time;
-	else if (part >= 7 && st6 == 0) st6 = time;
+	else if (part >= 1 && clusters[0].start == 0) clusters[0].start = time;
+	else if (part >= 3 && clusters[1].start == 0) clusters[1].start = time;
+	else if (part >= 4 && clusters[2].start == 0) clusters[2].start = time;
+	else if (part >= 5 && clusters[3].start == 0) clusters[3].start = time;
+	else if (part >= 6 && clusters[4].start == 0) clusters[4].start = time;
+	else if (part >= 7 && clusters[5].start == 0) clusters[5].start = time;
 */
 	UINT passes;
 	effect->Begin(&passes, 0);
 	for (UINT pass = 0; pass < passes; ++pass)
 	{
 		effect->BeginPass( pass );
-		drawFrame(effect,time,part);
+		drawFrame(time,part);
 		effect->EndPass();
 	}
 	effect->End();
 }
 
-void Grow::drawFrame(engine::Effect &effect, float time, int part) {
-	if (st0 != 0) {
-		float c0 = min(time-st0,(float)SSYNCMAX) / (float)SSYNCMAX;
-		int it0 = (int)(((SNK-3)*SLOD)*c0);
+std::vector<Grow::Cluster> Grow::getDefaultClusters() {
+	static const Cluster defaults[] = {
+		{ 0x400, 0,          SCLUSTER*2-1, SSYNCMAX },
+		{ 0x43e, SCLUSTER*2, SCLUSTER*3-1, SSYNCMAX },
+		{ 0x43e, SCLUSTER*3, SCLUSTER*4-1, SSYNCMAX },
+		{ 0x43e, SCLUSTER*4, SCLUSTER*5-1, SSYNCMAX },
+		{ 0x440, SCLUSTER*5, SCLUSTER*6-1, SSYNCMAX },
+		{ 0x442, SCLUSTER*6, SCLUSTER*7-1, SSYNCMAX },
+	};
+	return std::vector<Cluster>(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+}
 
-		for (int i = 0; i < SCLUSTER*2-1; ++i) {
-			vs.begin(D3DPT_LINELIST);
-			for (int c = 0; c < it0-1; ++c) {
-				vs.vertex(*loops[i]->vectors[c%(SNK*SLOD)]);
-				vs.vertex(*loops[i]->vectors[(c+1)%(SNK*SLOD)]);
-			}
-			vs.end();
-		}
+void Grow::setClusters(const std::vector<Cluster>& clusters) {
+	for (size_t i = 0; i < clusters.size(); ++i) {
+		const Cluster& c = clusters[i];
+		if (c.first < 0 || c.first > c.last || c.last > SLOOP || !(c.duration > 0))
+			throw core::FatalException("invalid grow cluster");
 	}
-	if (st2 != 0) {
-		float c2 = min(time-st2,(float)SSYNCMAX) / (float)SSYNCMAX;
-		int it2 = (int)(((SNK-3)*SLOD)*c2);
-		for (int i = SCLUSTER*2; i < SCLUSTER*3-1; ++i) {
-			vs.begin(D3DPT_LINELIST);
-			for (int c = 0; c < it2-1; ++c) {
-				vs.vertex(*loops[i]->vectors[c%(SNK*SLOD)]);
-				vs.vertex(*loops[i]->vectors[(c+1)%(SNK*SLOD)]);
+	this->clusters = clusters;
+
+	batches.clear();
+	lineStarts.clear();
+	lineGrowth.clear();
+	for (size_t i = 0; i < clusters.size(); ++i) {
+		for (int first = clusters[i].first; first < clusters[i].last; first += SBATCHLOOPS) {
+			Batch batch;
+			batch.cluster = int(i);
+			batch.first = first;
+			batch.count = min(clusters[i].last - first, SBATCHLOOPS);
+			batch.index = int(lineStarts.size())*2;
+			if (0 == tolerance) {
+				// segment by segment, all of the loops each
+				for (int c = 0; c < SSEGMENTS; ++c)
+					for (int loop = first; loop < first+batch.count; ++loop)
+						lineStarts.push_back(loopVertices[loop] + c);
+			} else {
+				// by how much of its loop is grown at the end of the line
+				std::vector<std::pair<float, int> > lines;
+				for (int loop = first; loop < first+batch.count; ++loop)
+					for (int v = loopVertices[loop]; v < loopVertices[loop+1]-1; ++v)
+						lines.push_back(std::make_pair(sampleGrowth[v+1], v));
+				std::stable_sort(lines.begin(), lines.end());
+				for (size_t j = 0; j < lines.size(); ++j) {
+					lineGrowth.push_back(lines[j].first);
+					lineStarts.push_back(lines[j].second);
+				}
 			}
-			vs.end();
+			batch.lines = int(lineStarts.size()) - batch.index/2;
+			batches.push_back(batch);
 		}
 	}
-	if (st3 != 0) {
-		float c3 = min(time-st3,(float)SSYNCMAX) / (float)SSYNCMAX;
-		int it3 = (int)(((SNK-3)*SLOD)*c3);
-		for (int i = SCLUSTER*3; i < SCLUSTER*4-1; ++i) {
-			vs.begin(D3DPT_LINELIST);
-			for (int c = 0; c < it3-1; ++c) {
-				vs.vertex(*loops[i]->vectors[c%(SNK*SLOD)]);
-				vs.vertex(*loops[i]->vectors[(c+1)%(SNK*SLOD)]);
-			}
-			vs.end();
+	indexCount = int(lineStarts.size())*2;
+	createIndexBuffer();
+}
+
+void Grow::loadClusters(const std::string& fileName) {
+	FILE *fp = fopen(fileName.c_str(), "r");
+	if (NULL == fp)
+		throw core::FatalException("failed to open " + fileName);
+
+	std::vector<Cluster> clusters;
+	char line[256];
+	while (NULL != fgets(line, sizeof(line), fp)) {
+		char *comment = strchr(line, '#');
+		if (NULL != comment) *comment = '\0';
+		if ('\0' == line[strspn(line, " \t\r\n")])
+			continue;
+
+		Cluster c;
+		if (4 != sscanf(line, "%f %d %d %f", &c.start, &c.first, &c.last, &c.duration)) {
+			fclose(fp);
+			throw core::FatalException("malformed cluster in " + fileName);
 		}
+		clusters.push_back(c);
 	}
-	if (st4 != 0) {
-		float c4 = min(time-st4,(float)SSYNCMAX) / (float)SSYNCMAX;
-		int it4 = (int)(((SNK-3)*SLOD)*c4);
-		for (int i = SCLUSTER*4; i < SCLUSTER*5-1; ++i) {
-			vs.begin(D3DPT_LINELIST);
-			for (int c = 0; c < it4-1; ++c) {
-				vs.vertex(*loops[i]->vectors[c%(SNK*SLOD)]);
-				vs.vertex(*loops[i]->vectors[(c+1)%(SNK*SLOD)]);
+	fclose(fp);
+	setClusters(clusters);
+}
+
+// the line segments of every loop of the cluster that have grown at time
+int Grow::getGrownSegments(const Cluster& cluster, float time) const {
+	if (cluster.start == 0)
+		return 0;
+	float c = min(time-cluster.start, cluster.duration) / cluster.duration;
+	int it = (int)(((SNK-3)*SLOD)*c);
+	return max(it-1, 0);
+}
+
+// the lines of the batch that have grown at time, the first ones of it
+int Grow::getGrownLines(const Batch& batch, float time) const {
+	const Cluster& cluster = clusters[batch.cluster];
+	if (0 == tolerance)
+		return getGrownSegments(cluster, time)*batch.count;
+	if (cluster.start == 0)
+		return 0;
+	float c = min(time-cluster.start, cluster.duration) / cluster.duration;
+	const float *growth = &lineGrowth[0] + batch.index/2;
+	return int(upper_bound(growth, growth + batch.lines, c) - growth);
+}
+
+Vector3 Grow::getVertex(int v) const {
+	if (0 != tolerance)
+		return samples[v];
+	size_t p = 3*SKNOTS + v;
+	return Vector3(arena[p], arena[SPOINTS + p], arena[2*SPOINTS + p]);
+}
+
+size_t Grow::drawFrame(float time, int part) {
+	size_t vertices = 0;
+	draws = 0;
+
+	if (streamed) {
+		vs.begin(D3DPT_LINELIST);
+		for (size_t i = 0; i < batches.size(); ++i) {
+			const Batch& batch = batches[i];
+			int lines = getGrownLines(batch, time);
+			for (int j = 0; j < lines; ++j) {
+				int v = lineStarts[batch.index/2 + j];
+				vs.vertex(getVertex(v));
+				vs.vertex(getVertex(v+1));
 			}
-			vs.end();
+			vertices += 2*lines;
 		}
+		vs.end();
+		// the streamer draws every time its buffer fills up
+		draws = (vertices + VERTEX_STREAMER_VERTEX_BUFFER_SIZE-3) / (VERTEX_STREAMER_VERTEX_BUFFER_SIZE-2);
+		return vertices;
+	}
+
+	device->SetStreamSource(0, vb, 0, sizeof(Vertex));
+	device->SetFVF(Vertex::fvf);
+	device->SetIndices(ib);
+	for (size_t i = 0; i < batches.size(); ++i) {
+		const Batch& batch = batches[i];
+		int lines = getGrownLines(batch, time);
+		if (0 == lines)
+			continue;
+		int first = loopVertices[batch.first];
+		device->DrawIndexedPrimitive(D3DPT_LINELIST, first, 0, loopVertices[batch.first+batch.count] - first, batch.index, lines);
+		vertices += 2*lines;
+		draws++;
+	}
+	return vertices;
+}
+
+void Grow::getFrameLines(float time, bool streamed, std::vector<Vector3>& lines) const {
+	// the static path goes by what the buffers were filled with
+	std::vector<Vertex> baked;
+	std::vector<WORD> indices;
+	if (!streamed) {
+		baked.resize(getVertexCount());
+		writeVertices(&baked[0]);
+		indices.resize(indexCount);
+		if (0 != indexCount) writeIndices(&indices[0]);
 	}
-	if (st5 != 0) {
-		float c5 = min(time-st5,(float)SSYNCMAX) / (float)SSYNCMAX;
-		int it5 = (int)(((SNK-3)*SLOD)*c5);
-		for (int i = SCLUSTER*5; i < SCLUSTER*6-1; ++i) {
-			vs.begin(D3DPT_LINELIST);
-			for (int c = 0; c < it5-1; ++c) {
-				vs.vertex(*loops[i]->vectors[c%(SNK*SLOD)]);
-				vs.vertex(*loops[i]->vectors[(c+1)%(SNK*SLOD)]);
+
+	lines.clear();
+	for (size_t i = 0; i < batches.size(); ++i) {
+		const Batch& batch = batches[i];
+		int grown = getGrownLines(batch, time);
+		if (streamed) {
+			for (int j = 0; j < grown; ++j) {
+				int v = lineStarts[batch.index/2 + j];
+				lines.push_back(getVertex(v));
+				lines.push_back(getVertex(v+1));
 			}
-			vs.end();
+		} else {
+			for (int j = 0; j < 2*grown; ++j)
+				lines.push_back(baked[loopVertices[batch.first] + indices[batch.index + j]].pos);
 		}
 	}
-	if (st6 != 0) {
-		float c6 = min(time-st6,(float)SSYNCMAX) / (float)SSYNCMAX;
-		int it6 = (int)(((SNK-3)*SLOD)*c6);
-		for (int i = SCLUSTER*6; i < SCLUSTER*7-1; ++i) {
-			vs.begin(D3DPT_LINELIST);
-			for (int c = 0; c < it6-1; ++c) {
-				vs.vertex(*loops[i]->vectors[c%(SNK*SLOD)]);
-				vs.vertex(*loops[i]->vectors[(c+1)%(SNK*SLOD)]);
-			}
-			vs.end();
+}
+
+void Grow::writeVertices(Vertex* dst) const {
+	for (int i = 0; i < getVertexCount(); ++i) {
+		dst[i].pos = getVertex(i);
+		dst[i].norm = D3DXVECTOR3(0, 0, 0);
+		dst[i].diff = 0xffffffff;
+		dst[i].uv = D3DXVECTOR2(0, 0);
+	}
+}
+
+// the vertices of every loop, loop after loop
+void Grow::createVertexBuffer() {
+	vb = device.createVertexBuffer(sizeof(Vertex) * getVertexCount(), D3DUSAGE_WRITEONLY, Vertex::fvf, D3DPOOL_MANAGED);
+	Vertex *dst = (Vertex*)vb.lock(0, sizeof(Vertex) * getVertexCount(), 0);
+	writeVertices(dst);
+	vb.unlock();
+}
+
+// the lines of a batch in the order they grow, relative to the first
+// vertex of the batch
+void Grow::writeIndices(WORD* dst) const {
+	for (size_t i = 0; i < batches.size(); ++i) {
+		const Batch& batch = batches[i];
+		for (int j = 0; j < batch.lines; ++j) {
+			int v = lineStarts[batch.index/2 + j] - loopVertices[batch.first];
+			*dst++ = WORD(v);
+			*dst++ = WORD(v+1);
 		}
 	}
-	
-	
-	
-/*
-		int frame = (int)(((SNK)*SLOD*SLERPFACTOR)*completeness);
-		int step = (int)(frame/it);
-		Vector3 v1 = *loops[i]->vectors[it-1%(SNK*SLOD)];
-		Vector3 v2 = *loops[i]->vectors[it%(SNK*SLOD)];
-		Vector3 newend;
-		float factor = (1/SLERPFACTOR)*(step%SLERPFACTOR+1);
-		D3DXVec3Lerp(&newend, &v1, &v2, factor);
-
-		vs.vertex(v1);
-		vs.vertex(newend);
-*/
+}
+
+void Grow::createIndexBuffer() {
+	ib = renderer::IndexBuffer();
+	if (0 == indexCount)
+		return;
+	ib = device.createIndexBuffer(sizeof(WORD) * indexCount, D3DUSAGE_WRITEONLY, D3DFMT_INDEX16, D3DPOOL_MANAGED);
+	WORD *dst = (WORD*)ib.lock(0, sizeof(WORD) * indexCount, 0);
+	writeIndices(dst);
+	ib.unlock();
 }
 
 
 
 void Grow::generateSplineLoops() {
-	st0 = 0x400;
-	st2 = 0x43e;
-	st3 = 0x43e;
-	st4 = 0x43e;
-	st5 = 0x440;
-	st6 = 0x442;
 /*
 	Vector3(-3.8f,-2.f,0.f) 
 	Vector3(3.8f,-2.f,-1.0.f)
 */
-	int c = 0;
+	arena.assign(3*SKNOTS + 3*SPOINTS, 0.f);
 
+	// a loop draws from its own stream of SSEED, so they can go in any order
+#pragma omp parallel for
 	for (int i = 0; i < SLOOP; ++i){
-		CCBSplineLoop* sl = new CCBSplineLoop();
 
- 		float lerpmod = (1.f/(SLOOP))*c;
-		if (i%SCLUSTER == SCLUSTER-1) c += SCLUSTER;
+		// SCLUSTER more after the last loop of every cluster
+		int c = (i+1)/SCLUSTER*SCLUSTER;
 
 
 
 		Vector3 root;
 		Vector3 heading;
+		float r = counterRandf(SSEED, i, 0);
 		if (c == 0) {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x+3.f, start.y-3.f, start.z-1.f);
 			heading = Vector3(start.x+4.f, start.y+5.f, start.z-3.f);
 		} else if (c == 1*SCLUSTER) {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x+2.f, start.y, start.z+3.f);
 			heading = Vector3(start.x+4.f, start.y+6.f, start.z-8.f);
 		} else if (c == 2*SCLUSTER) {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x-r    , start.y-r, start.z);
 			heading = Vector3(start.x+3.f+r, start.y+7.f, start.z-r*5);
 		} else if (c == 3*SCLUSTER) {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x+6.f+r, start.y-r    , start.z);
 			heading = Vector3(start.x+5.f-r, start.y+7.f, start.z-r*5);
 		} else if (c == 4*SCLUSTER) {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x+1.f, start.y-3*r, start.z-1.f);
 			heading = Vector3(start.x+4.f, start.y+10.f, start.z+4.f);
 		} else if (c == 5*SCLUSTER) {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x+4.f, start.y    , start.z+3.f);
 			heading = Vector3(start.x+4.f, start.y+6.f+r, start.z-4.f);
 		} else {
-			float r = (rand() * (1.f / RAND_MAX));
 			root    = Vector3(start.x+3.f, start.y-1.f    , start.z+1.f);
 			heading = Vector3(start.x+6.5f, start.y+7.f, start.z+3.f);
 		}
 
-		root.x += cos (rand() * (1.f / RAND_MAX));
-		root.z += sin (rand() * (1.f / RAND_MAX));
+		root.x += cos (counterRandf(SSEED, i, 1));
+		root.z += sin (counterRandf(SSEED, i, 2));
 		root.y -= root.z;
-		generateKnots(root, heading, *sl);
-		loops[i] = sl;
+		generateKnots(root, heading, i);
 	}
 
 
 	for (int i = 0; i < SLOOP; ++i)
-		generateSplines(*loops[i]);
+		generateSplines(i);
 }
 
-void Grow::generateKnots(Vector3& root, Vector3& heading,CCBSplineLoop& sl) {
+// the knots draw from index 3 of the loop's stream on, after the root
+void Grow::generateKnots(Vector3& root, Vector3& heading, int loop) {
+	float *kx = getKnots(0) + loop*SNK;
+	float *ky = getKnots(1) + loop*SNK;
+	float *kz = getKnots(2) + loop*SNK;
+	float r[2*SNK];
+	counterRandFill(SSEED, loop, 3, 2*SNK, r);
 	for (int i = 0; i < SNK; ++i) {
 		Vector3 vec;
 		D3DXVec3Lerp(&vec, &root, &heading, ((float)i/(float)SNK));
-		sl.knots[i] = new Vector3(vec.x+(rand() * (1.f / RAND_MAX))*0.1f, vec.y, vec.z+(rand() * (1.f / RAND_MAX)));
-
+		kz[i] = vec.z+r[2*i];
+		kx[i] = vec.x+r[2*i+1]*0.1f;
+		ky[i] = vec.y;
 	}
 }
 
-void Grow::generateSplines(CCBSplineLoop& sl) {
-	for (int c = 0; c < SNK; ++c){
-		for (int i = 0; i < SLOD; ++i) {
-			float t = (float)i / (float)SLOD;
-			float it= (float)1.0-t;
-
-			float b0 = it*it*it/6.f;
-			float b1 = (3.f*t*t*t-6.f*t*t+4.f)/6.f;
-			float b2 = (-3.f*t*t*t+3.f*t*t+3.f*t+1)/6.f;
-			float b3 = t*t*t/6.f;
-	
-			float x = b0*sl.knots[(c+0)%SNK]->x+ 
-					  b1*sl.knots[(c+1)%SNK]->x+
-					  b2*sl.knots[(c+2)%SNK]->x+ 
-					  b3*sl.knots[(c+3)%SNK]->x;
-			float y = b0*sl.knots[(c+0)%SNK]->y+
-				      b1*sl.knots[(c+1)%SNK]->y+ 
-					  b2*sl.knots[(c+2)%SNK]->y+
-					  b3*sl.knots[(c+3)%SNK]->y;
-			float z = b0*sl.knots[(c+0)%SNK]->z+
-				      b1*sl.knots[(c+1)%SNK]->z+
-					  b2*sl.knots[(c+2)%SNK]->z+ 
-					  b3*sl.knots[(c+3)%SNK]->z;
-
-			sl.vectors[c*SLOD+i] = new Vector3(x,y,z);
-		}
-	}
+void Grow::generateSplines(int loop) {
+	static const UniformBSpline spline(SLOD);
+	for (int axis = 0; axis < 3; ++axis)
+		spline.evalLoop(getKnots(axis) + loop*SNK, SNK, getPoints(axis) + loop*(SNK*SLOD));
 }
 
+// resampling the part of every loop that grows, the first SNK-3 segments, by
+// tolerance, with how far along that part each point is
+void Grow::generateSamples() {
+	loopVertices.resize(SLOOP+1);
+	samples.clear();
+	sampleGrowth.clear();
+	if (0 == tolerance) {
+		for (int i = 0; i <= SLOOP; ++i)
+			loopVertices[i] = i*(SNK*SLOD);
+		return;
+	}
+
+	std::vector<std::vector<float> > params(SLOOP);
+	std::vector<ArcLengthTable> arcs(SLOOP);
+#pragma omp parallel for
+	for (int i = 0; i < SLOOP; ++i) {
+		Vector3 knots[SNK];
+		for (int k = 0; k < SNK; ++k)
+			knots[k] = getKnot(i, k);
+		arcs[i].build(knots, SNK);
+		sampleByTolerance(arcs[i], 0, SNK-3, tolerance, SDEPTH, params[i]);
+	}
 
+	loopVertices[0] = 0;
+	for (int i = 0; i < SLOOP; ++i) {
+		float length = arcs[i].getLength(float(SNK-3));
+		for (size_t j = 0; j < params[i].size(); ++j) {
+			samples.push_back(arcs[i].getPoint(params[i][j]));
+			sampleGrowth.push_back(arcs[i].getLength(params[i][j]) / length);
+		}
+		loopVertices[i+1] = int(samples.size());
+	}
+}
 
+void Grow::setTolerance(float tolerance) {
+	if (tolerance < 0)
+		throw core::FatalException("negative grow tolerance");
+	this->tolerance = tolerance;
+	generateSamples();
+	createVertexBuffer();
+	setClusters(std::vector<Cluster>(clusters));
+}
@@ -4,6 +4,10 @@
 #include "vertexstreamer.h"
 #include "../math/vector3.h"
 #include "../renderer/device.h"
+#include "../renderer/vertexbuffer.h"
+#include "../renderer/indexbuffer.h"
+#include <string>
+#include <vector>
 using math::Vector3;
 
 namespace engine
@@ -17,6 +21,7 @@ namespace engine
 		
 
 		#define SLERPFACTOR	50	//num of lerps between each lod
+		#define SSEED 0x6e07	//seed of the loops, a stream per loop
 
 		#if defined(SYNC)
 		//because of crappy code we need to shorten the anim lenght while using the sync_editor to see stuff :(
@@ -25,32 +30,131 @@ namespace engine
 			#define SSYNCMAX 0xaa	// animationlength
 		#endif
 
-		struct CCBSplineLoop {
-			Vector3* knots[SNK];
-			Vector3* vectors[SNK*SLOD];
+		#define SKNOTS (SLOOP*SNK)		//knots of all loops
+		#define SPOINTS (SLOOP*SNK*SLOD)	//points of all loops
+		#define SSEGMENTS ((SNK-3)*SLOD-1)	//most line segments a loop grows
+		#define SBATCHLOOPS (65536/(SNK*SLOD))	//most loops a batch can index with 16 bits
+		#define SDEPTH 4			//most halvings of a segment sampled by tolerance, 1<<SDEPTH <= SLOD
+
+		// a cluster starts growing its loops [first, last) at start, and
+		// they are fully grown duration later. a start of 0 never does.
+		struct Cluster {
+			float start;
+			int first, last;
+			float duration;
+		};
+
+		// the layout VertexStreamer uses, so the effect gets the same input
+		struct Vertex {
+			D3DXVECTOR3 pos;
+			D3DXVECTOR3 norm;
+			unsigned diff;
+			D3DXVECTOR2 uv;
+			static const int fvf = D3DFVF_XYZ | D3DFVF_NORMAL | D3DFVF_DIFFUSE | D3DFVF_TEX1;
 		};
 
-		Grow(VertexStreamer& vs, Vector3& start) : vs(vs), start(start) {
+		Grow(renderer::Device& device, VertexStreamer& vs, Vector3& start) : device(device), vs(vs), start(start), streamed(false), draws(0), tolerance(0) {
 			generateSplineLoops();
+			generateSamples();
+			createVertexBuffer();
+			setClusters(getDefaultClusters());
 		}
 
+		void setClusters(const std::vector<Cluster>& clusters);
+		const std::vector<Cluster>& getClusters() const { return clusters; }
+		static std::vector<Cluster> getDefaultClusters();
+
+		// reads the clusters from a text file, a cluster per line: start,
+		// first loop, last loop (exclusive) and duration. # starts a comment.
+		void loadClusters(const std::string& fileName);
+
 		void draw(engine::Effect &effect, float time, int part);
+
+		// the lines without the effect passes, returns the number of vertices
+		size_t drawFrame(float time, int part);
+
+		// the loops are baked into a static vertex buffer, and the index
+		// buffer has the line segments of every cluster in the order they
+		// grow, so all its grown segments are a single range: a draw per
+		// cluster (and per SBATCHLOOPS loops). streamed sends the same lines
+		// through the VertexStreamer every frame instead, which only draws
+		// when its buffer is full.
+		void setStreamed(bool streamed) { this->streamed = streamed; }
+		bool isStreamed() const { return streamed; }
+
+		// the draw calls of the last drawFrame
+		size_t getDrawCount() const { return draws; }
+
+		// a tolerance of 0 (the default) draws SLOD points per knot, evenly in t. otherwise a loop
+		// only gets the points that keep the curve within tolerance of its lines, at most
+		// 1<<SDEPTH per knot, and the loops grow by arc length, so at the same speed everywhere.
+		void setTolerance(float tolerance);
+		float getTolerance() const { return tolerance; }
+
+		// the vertices of all loops, what the static vertex buffer holds
+		int getVertexCount() const { return loopVertices.back(); }
+
+		// the vertices drawFrame would draw, as the pairs of a line list
+		void getFrameLines(float time, bool streamed, std::vector<Vector3>& lines) const;
+
+		Vector3 getKnot(int loop, int i) const {
+			size_t k = loop*SNK + i;
+			return Vector3(arena[k], arena[SKNOTS + k], arena[2*SKNOTS + k]);
+		}
+		Vector3 getPoint(int loop, int i) const {
+			size_t p = 3*SKNOTS + loop*(SNK*SLOD) + i;
+			return Vector3(arena[p], arena[SPOINTS + p], arena[2*SPOINTS + p]);
+		}
 	private:
-		void drawFrame(engine::Effect &effect, float time, int part);
+		// loops [first, first+count) of a cluster, their lines from index
+		struct Batch {
+			int cluster;
+			int first, count;
+			int index, lines;
+		};
+
+		int getGrownSegments(const Cluster& cluster, float time) const;
+		int getGrownLines(const Batch& batch, float time) const;
+		Vector3 getVertex(int v) const;
+		void writeVertices(Vertex* dst) const;
+		void writeIndices(WORD* dst) const;
+		void createVertexBuffer();
+		void createIndexBuffer();
 
 		void generateSplineLoops();
-		void generateKnots(Vector3& root, Vector3& heading, CCBSplineLoop& sl);
-		void generateSplines(CCBSplineLoop& sl);
+		void generateKnots(Vector3& root, Vector3& heading, int loop);
+		void generateSplines(int loop);
+		void generateSamples();
+
+		float *getKnots(int axis) { return &arena[axis*SKNOTS]; }
+		float *getPoints(int axis) { return &arena[3*SKNOTS + axis*SPOINTS]; }
 
+		renderer::Device& device;
 		VertexStreamer& vs;
-		CCBSplineLoop* loops[SLOOP];
 		Vector3& start;
+		renderer::VertexBuffer vb;
+		renderer::IndexBuffer ib;
+		bool streamed;
+		size_t draws;
+		float tolerance;
+
+		std::vector<Cluster> clusters;
+		std::vector<Batch> batches;
+		int indexCount;
+
+		// all knots and points in one block, a plane per axis: knot x, y, z,
+		// then point x, y, z, each loop after loop
+		std::vector<float> arena;
+
+		// the first vertex of every loop, and the end. with a tolerance the
+		// vertices are samples, and how much of its loop is grown at each
+		std::vector<int> loopVertices;
+		std::vector<Vector3> samples;
+		std::vector<float> sampleGrowth;
 
-		float st0;
-		float st2;
-		float st3;
-		float st4;
-		float st5;
-		float st6;
+		// the first vertex of every line, batch after batch in the order they grow,
+		// and with a tolerance how much of its loop is grown at its end
+		std::vector<int> lineStarts;
+		std::vector<float> lineGrowth;
 	};
 }
@@ -3,6 +3,7 @@
 #include "../core/err.h"
 #include "../math/matrix4x4.h"
 #include "../math/vector3.h"
+#include "../math/counterrand.h"
 
 using engine::TriangleEffect;
 using math::Vector3;
@@ -37,6 +38,13 @@ void TriangleEffect::draw(engine::Effect &effect, engine::VertexStreamer &stream
 
 		effect->SetFloatArray("dir", dir_vec, 2);
 
+		// the same triangles in every pass
+		unsigned circle_tris = (unsigned)(numOfTris/(double)circle_count+0.5f);
+		randoms.resize(2*circle_count*circle_tris);
+		if (!randoms.empty())
+			math::counterRandFill(TRIANGLE_SEED, frame, 0, int(randoms.size()), &randoms[0]);
+		frame++;
+
 
 		UINT passes;
 		effect->Begin(&passes, 0);
@@ -53,8 +61,9 @@ void TriangleEffect::draw(engine::Effect &effect, engine::VertexStreamer &stream
 				float c_cos = cosf(c_rad)*(2*space*circle_count);
 				float c_sin = sinf(c_rad)*(2*space*circle_count);
 
-				for (unsigned j = 0; j < (unsigned)(numOfTris/(double)circle_count+0.5f); ++j) {
-					float doff = (rand() * (1.f / RAND_MAX) + 0.5f)*dist;
+				for (unsigned j = 0; j < circle_tris; ++j) {
+					const float *r = &randoms[2*(i*circle_tris + j)];
+					float doff = (r[0] + 0.5f)*dist;
 					float s_rad = D3DXToRadian(spiral_steps*j);
 					float s_cos = (s_rad*opening)*cosf(6*s_rad+c_rad)*space;
 					float s_sin = (s_rad*opening)*sinf(6*s_rad+c_rad)*space;
@@ -65,7 +74,7 @@ void TriangleEffect::draw(engine::Effect &effect, engine::VertexStreamer &stream
 					Matrix4x4 mrot;
 //					mrot.make_rotation(Vector3(doff+((unsigned)(beat/60)%360)*M_PI/180, 0, ((unsigned)(beat/60)%360)*M_PI/180));
 //					mrot.make_rotation(Vector3(float(-M_PI / 2), float(M_PI - ( beat / 3)), s_rad));
-					mrot.rotation(Vector3(-D3DXToRadian(beat+s_rad), s_rad+c_rad, D3DXToRadian((rand() * (1.f / RAND_MAX) + 0.5f)+beat)));
+					mrot.rotation(Vector3(-D3DXToRadian(beat+s_rad), s_rad+c_rad, D3DXToRadian((r[1] + 0.5f)+beat)));
 
 
 					streamer.uv(    D3DXVECTOR2(-size, -size));
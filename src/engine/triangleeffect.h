@@ -3,12 +3,21 @@
 #include "effect.h"
 #include "vertexstreamer.h"
 
+#include <vector>
+
 namespace engine
 {
 	class TriangleEffect {
 	public:
-		TriangleEffect() {};
+		#define TRIANGLE_SEED 0x7a1e	//seed of the triangles, a stream per draw
+
+		TriangleEffect() : frame(0) {};
 
 		void draw(engine::Effect &effect, engine::VertexStreamer &streamer, double beat, unsigned numOfTris, float size, float dist, float shaper, float opening);
+
+	private:
+		// two numbers a triangle, from the stream of the draw
+		unsigned frame;
+		std::vector<float> randoms;
 	};
 }
@@ -0,0 +1,98 @@
+#include "stdafx.h"
+#include "voxelbricks.h"
+
+using namespace engine;
+
+signed char VoxelBrickPlane::constant_bricks[256][VOXEL_BRICK_CELLS];
+
+namespace
+{
+	/* filled by the first call rather than a static constructor, so planes
+	 * made during static initialization don't depend on the order of it */
+	inline signed char *getConstantBrick(signed char value)
+	{
+		static volatile bool filled = false;
+		if (!filled)
+		{
+			for (int i = 0; i < 256; ++i)
+				memset(VoxelBrickPlane::constant_bricks[i], (signed char)i, VOXEL_BRICK_CELLS);
+			filled = true;
+		}
+		return VoxelBrickPlane::constant_bricks[(unsigned char)value];
+	}
+}
+
+void VoxelBrickPlane::init(VoxelBrickPool *pool, size_t cells, signed char value)
+{
+	this->pool = pool;
+	this->cells = cells;
+	size_t brick_count = (cells + VOXEL_BRICK_MASK) >> VOXEL_BRICK_SHIFT;
+	bricks.assign(brick_count, getConstantBrick(value));
+	pooled.assign(brick_count, false);
+}
+
+void VoxelBrickPlane::attach(VoxelBrickPool *pool, size_t cells, signed char *storage)
+{
+	this->pool = pool;
+	this->cells = cells;
+	size_t brick_count = (cells + VOXEL_BRICK_MASK) >> VOXEL_BRICK_SHIFT;
+	bricks.resize(brick_count);
+	pooled.assign(brick_count, false);
+	for (size_t i = 0; i < brick_count; ++i)
+		bricks[i] = storage + (i << VOXEL_BRICK_SHIFT);
+}
+
+void VoxelBrickPlane::copy(VoxelBrickPool *pool, const VoxelBrickPlane &src)
+{
+	this->pool = pool;
+	this->cells = src.cells;
+	bricks = src.bricks;
+	pooled.assign(bricks.size(), false);
+	for (size_t i = 0; i < bricks.size(); ++i)
+	{
+		if (isConstantBrick(bricks[i])) continue;
+		signed char *dst = pool->allocate();
+		memcpy(dst, src.bricks[i], getBrickCellCount());
+		bricks[i] = dst;
+		pooled[i] = true;
+	}
+}
+
+signed char *VoxelBrickPlane::allocateBrick(size_t brick)
+{
+	assert(NULL != pool);
+	assert(isConstantBrick(bricks[brick]));
+	signed char *dst = pool->allocate();
+	memcpy(dst, bricks[brick], VOXEL_BRICK_CELLS);
+	bricks[brick] = dst;
+	pooled[brick] = true;
+	return dst;
+}
+
+void VoxelBrickPlane::compactBrick(size_t brick)
+{
+	const signed char *src = bricks[brick];
+	if (isConstantBrick(src)) return;
+
+	signed char *constant = getConstantBrick(src[0]);
+	if (0 != memcmp(src, constant, getBrickCellCount())) return;
+
+	/* storage that isn't ours (a mapped file) is simply left alone */
+	if (pooled[brick]) pool->release(bricks[brick]);
+	bricks[brick] = constant;
+	pooled[brick] = false;
+}
+
+void VoxelBrickPlane::compact()
+{
+	for (size_t i = 0; i < bricks.size(); ++i)
+		compactBrick(i);
+}
+
+size_t VoxelBrickPlane::getMemoryUsage() const
+{
+	size_t usage = bricks.size() * sizeof(signed char *);
+	for (size_t i = 0; i < bricks.size(); ++i)
+		if (!isConstantBrick(bricks[i])) usage += VOXEL_BRICK_CELLS;
+	return usage;
+}
@@ -0,0 +1,126 @@
+#ifndef VOXELBRICKS_H
+#define VOXELBRICKS_H
+
+#include <vector>
+
+/* a brick is 8^3 cells. since the planes are morton-ordered, a brick is simply
+ * a run of 512 consecutive indices, and the brick of a cell is index >> 9. */
+#define VOXEL_BRICK_SHIFT 9
+#define VOXEL_BRICK_CELLS (1 << VOXEL_BRICK_SHIFT)
+#define VOXEL_BRICK_MASK (VOXEL_BRICK_CELLS - 1)
+#define VOXEL_BRICK_POOL_CHUNK 64
+
+namespace engine
+{
+	/* hands out bricks in chunks, and keeps released bricks around for reuse */
+	class VoxelBrickPool
+	{
+	public:
+		VoxelBrickPool() : allocated(0) {}
+
+		/* frees every chunk, so the planes using the pool must go first */
+		~VoxelBrickPool()
+		{
+			for (size_t i = 0; i < chunks.size(); ++i)
+				delete[] chunks[i];
+		}
+
+		signed char *allocate()
+		{
+			if (free_bricks.empty())
+			{
+				signed char *chunk = new signed char[VOXEL_BRICK_POOL_CHUNK * VOXEL_BRICK_CELLS];
+				chunks.push_back(chunk);
+				for (int i = VOXEL_BRICK_POOL_CHUNK - 1; i >= 0; --i)
+					free_bricks.push_back(chunk + i * VOXEL_BRICK_CELLS);
+			}
+			signed char *brick = free_bricks.back();
+			free_bricks.pop_back();
+			allocated++;
+			return brick;
+		}
+
+		void release(signed char *brick)
+		{
+			assert(allocated > 0);
+			free_bricks.push_back(brick);
+			allocated--;
+		}
+
+		size_t getAllocatedCount() const { return allocated; }
+
+	private:
+		/* not copyable, the planes point into the chunks */
+		VoxelBrickPool(const VoxelBrickPool &);
+		VoxelBrickPool &operator=(const VoxelBrickPool &);
+
+		std::vector<signed char *> chunks;
+		std::vector<signed char *> free_bricks;
+		size_t allocated;
+	};
+
+	/* a plane of signed chars stored as bricks. the page table points every
+	 * brick either at a pool brick, at externally owned storage, or at one of
+	 * the shared constant bricks - so uniform regions take no memory at all.
+	 * reads are one extra table lookup, writes go through set(), which
+	 * allocates a brick the first time a constant one gets a different value. */
+	class VoxelBrickPlane
+	{
+	public:
+		VoxelBrickPlane() : pool(NULL), cells(0) {}
+
+		/* every cell set to value, nothing allocated */
+		void init(VoxelBrickPool *pool, size_t cells, signed char value);
+
+		/* dense plane on top of cells bytes of storage, owned by the caller */
+		void attach(VoxelBrickPool *pool, size_t cells, signed char *storage);
+
+		/* deep copy of src into bricks from pool. constant bricks stay shared,
+		 * pooled and attached ones get copied */
+		void copy(VoxelBrickPool *pool, const VoxelBrickPlane &src);
+
+		inline signed char operator[](int index) const
+		{
+			assert(size_t(index) < cells);
+			return bricks[index >> VOXEL_BRICK_SHIFT][index & VOXEL_BRICK_MASK];
+		}
+
+		inline void set(int index, signed char value)
+		{
+			assert(size_t(index) < cells);
+			signed char *brick = bricks[index >> VOXEL_BRICK_SHIFT];
+			if (brick[index & VOXEL_BRICK_MASK] == value) return;
+			if (isConstantBrick(brick)) brick = allocateBrick(index >> VOXEL_BRICK_SHIFT);
+			brick[index & VOXEL_BRICK_MASK] = value;
+		}
+
+		/* points the brick back at a constant brick if all its cells are equal */
+		void compactBrick(size_t brick);
+		void compact();
+
+		size_t getCellCount() const { return cells; }
+		size_t getBrickCount() const { return bricks.size(); }
+		size_t getBrickCellCount() const { return cells < VOXEL_BRICK_CELLS ? cells : VOXEL_BRICK_CELLS; }
+		const signed char *getBrick(size_t brick) const { return bricks[brick]; }
+
+		/* bytes of brick storage not shared with constant bricks, plus the page table */
+		size_t getMemoryUsage() const;
+
+		static bool isConstantBrick(const signed char *brick)
+		{
+			return brick >= constant_bricks[0] && brick < constant_bricks[0] + sizeof(constant_bricks);
+		}
+
+		static signed char constant_bricks[256][VOXEL_BRICK_CELLS];
+
+	private:
+		signed char *allocateBrick(size_t brick);
+
+		VoxelBrickPool *pool;
+		size_t cells;
+		std::vector<signed char *> bricks;
+		std::vector<bool> pooled;
+	};
+}
+
+#endif /* VOXELBRICKS_H */
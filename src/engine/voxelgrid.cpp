@@ -3,27 +3,337 @@
 #include "../core/fatalexception.h"
 
 using namespace engine;
-#define VOXEL_DATA_SIZE 32
+#define VOXEL_LEGACY_DATA_SIZE 32
+
+const unsigned int *VoxelGrid::getSwizzleLut()
+{
+	/* both are zero before any code runs. filled twice at worst, with the
+	 * same values, and volatile keeps the flag behind the table */
+	static unsigned int lut[VOXEL_GRID_MAX_SIZE];
+	static volatile bool filled = false;
+	if (!filled)
+	{
+		for (unsigned int i = 0; i < VOXEL_GRID_MAX_SIZE; ++i)
+			lut[i] = spreadBits(i);
+		filled = true;
+	}
+	return lut;
+}
+
+namespace
+{
+	bool isValidGridSize(unsigned int grid_size)
+	{
+		return 0 != grid_size && grid_size <= VOXEL_GRID_MAX_SIZE && 0 == (grid_size & (grid_size - 1));
+	}
+
+	bool writePlane(FILE *fp, const VoxelBrickPlane &plane)
+	{
+		/* bricks are consecutive runs of the morton order, so this is the dense layout */
+		const size_t count = plane.getBrickCellCount();
+		for (size_t i = 0; i < plane.getBrickCount(); ++i)
+			if (count != fwrite(plane.getBrick(i), 1, count, fp)) return false;
+		return true;
+	}
+
+	VoxelGrid mapVoxelGrid(std::string fileName)
+	{
+		HANDLE file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+		if (INVALID_HANDLE_VALUE == file) throw core::FatalException("failed to load voxel");
+
+		DWORD file_size = GetFileSize(file, NULL);
+		if (INVALID_FILE_SIZE == file_size || file_size < sizeof(VoxelFileHeader))
+		{
+			CloseHandle(file);
+			throw core::FatalException("failed to load voxel: truncated header");
+		}
+
+		/* copy-on-write, so the grid can still be modified without touching the file */
+		HANDLE mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		CloseHandle(file);
+		if (NULL == mapping) throw core::FatalException("failed to map voxel");
+
+		void *view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		CloseHandle(mapping); // the view keeps the mapping alive
+		if (NULL == view) throw core::FatalException("failed to map voxel");
+
+		const VoxelFileHeader *header = (const VoxelFileHeader *)view;
+		if (VOXEL_FILE_MAGIC != header->magic || VOXEL_FILE_VERSION_PRECOMPUTED != header->version || !isValidGridSize(header->grid_size))
+		{
+			UnmapViewOfFile(view);
+			throw core::FatalException("failed to load voxel: invalid header");
+		}
+		if (file_size != sizeof(VoxelFileHeader) + VoxelGrid::getStorageSize(header->grid_size))
+		{
+			UnmapViewOfFile(view);
+			throw core::FatalException("failed to load voxel: size mismatch");
+		}
+
+		/* the grid unmaps the view when it goes away */
+		VoxelGrid voxelgrid(header->grid_size, (signed char *)view + sizeof(VoxelFileHeader), view);
+		voxelgrid.max_dist = header->max_dist;
+		return voxelgrid;
+	}
+}
+
+VoxelGrid::VoxelGrid(const VoxelGrid &other) :
+  grid_size(other.grid_size),
+  fixed_shift(other.fixed_shift),
+  swizzle(other.swizzle),
+  pool(new VoxelBrickPool),
+  mapped_view(NULL)
+{
+	copyPlanes(other);
+}
+
+VoxelGrid &VoxelGrid::operator=(const VoxelGrid &other)
+{
+	if (this == &other) return *this;
+
+	release();
+	grid_size = other.grid_size;
+	fixed_shift = other.fixed_shift;
+	swizzle = other.swizzle;
+	pool = new VoxelBrickPool;
+	copyPlanes(other);
+	return *this;
+}
+
+VoxelGrid::~VoxelGrid()
+{
+	release();
+}
+
+void VoxelGrid::copyPlanes(const VoxelGrid &other)
+{
+	distances.copy(pool, other.distances);
+	min_distances.copy(pool, other.min_distances);
+	max_distances.copy(pool, other.max_distances);
+	pyramid_levels = other.pyramid_levels;
+	for (int level = 1; level < VOXEL_GRID_MAX_LEVELS; ++level)
+	{
+		min_levels[level].copy(pool, other.min_levels[level]);
+		max_levels[level].copy(pool, other.max_levels[level]);
+	}
+	max_dist = other.max_dist;
+}
+
+/* the planes may still point into the pool or the view, but they get
+ * reinitialized or go away right after this */
+void VoxelGrid::release()
+{
+	delete pool;
+	pool = NULL;
+	if (NULL != mapped_view) UnmapViewOfFile(mapped_view);
+	mapped_view = NULL;
+}
+
+namespace
+{
+	/* the last partial batch, padded by repeating the last point */
+	template <typename T>
+	void loadTail(T dst[4], const T *src, size_t count)
+	{
+		for (size_t i = 0; i < 4; ++i)
+			dst[i] = src[i < count ? i : count - 1];
+	}
+}
+
+void VoxelGrid::trilinearSampleBatch(const float *x, const float *y, const float *z, float *dst, size_t count) const
+{
+	assert(grid_size >= 2);
+
+	/* clamp into [0, size - 1], and keep the cells inside by letting the
+	 * fraction reach 1 in the last one instead */
+	const __m128 lo = _mm_setzero_ps();
+	const __m128 hi = _mm_set1_ps(float(grid_size - 1));
+	const __m128i last_cell = _mm_set1_epi32(int(grid_size) - 2);
+
+	size_t i = 0;
+	float tail_x[4], tail_y[4], tail_z[4], tail_dst[4];
+	while (i < count)
+	{
+		const float *px = x + i, *py = y + i, *pz = z + i;
+		if (count - i < 4)
+		{
+			loadTail(tail_x, px, count - i);
+			loadTail(tail_y, py, count - i);
+			loadTail(tail_z, pz, count - i);
+			px = tail_x; py = tail_y; pz = tail_z;
+		}
+
+		__m128 fx = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(px), hi), lo);
+		__m128 fy = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(py), hi), lo);
+		__m128 fz = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(pz), hi), lo);
+
+		/* non-negative, so truncation is floor */
+		__m128i ix = clamp4(_mm_cvttps_epi32(fx), _mm_setzero_si128(), last_cell);
+		__m128i iy = clamp4(_mm_cvttps_epi32(fy), _mm_setzero_si128(), last_cell);
+		__m128i iz = clamp4(_mm_cvttps_epi32(fz), _mm_setzero_si128(), last_cell);
+
+		__m128 result = sampleCells4(ix, iy, iz,
+			_mm_sub_ps(fx, _mm_cvtepi32_ps(ix)),
+			_mm_sub_ps(fy, _mm_cvtepi32_ps(iy)),
+			_mm_sub_ps(fz, _mm_cvtepi32_ps(iz)));
+
+		if (count - i < 4)
+		{
+			_mm_storeu_ps(tail_dst, result);
+			memcpy(dst + i, tail_dst, (count - i) * sizeof(float));
+			break;
+		}
+		_mm_storeu_ps(dst + i, result);
+		i += 4;
+	}
+}
+
+void VoxelGrid::trilinearSampleBatch(const int *x, const int *y, const int *z, float *dst, size_t count) const
+{
+	assert(grid_size >= 2);
+
+	const __m128i shift = _mm_cvtsi32_si128(fixed_shift);
+	const __m128i lo = _mm_setzero_si128();
+	const __m128i hi = _mm_set1_epi32(int(grid_size - 1) << fixed_shift);
+	const __m128i last_cell = _mm_set1_epi32(int(grid_size) - 2);
+
+	size_t i = 0;
+	int tail_x[4], tail_y[4], tail_z[4];
+	float tail_dst[4];
+	while (i < count)
+	{
+		const int *px = x + i, *py = y + i, *pz = z + i;
+		if (count - i < 4)
+		{
+			loadTail(tail_x, px, count - i);
+			loadTail(tail_y, py, count - i);
+			loadTail(tail_z, pz, count - i);
+			px = tail_x; py = tail_y; pz = tail_z;
+		}
+
+		__m128i cx = clamp4(_mm_loadu_si128((const __m128i *)px), lo, hi);
+		__m128i cy = clamp4(_mm_loadu_si128((const __m128i *)py), lo, hi);
+		__m128i cz = clamp4(_mm_loadu_si128((const __m128i *)pz), lo, hi);
+
+		__m128i ix = clamp4(_mm_sra_epi32(cx, shift), lo, last_cell);
+		__m128i iy = clamp4(_mm_sra_epi32(cy, shift), lo, last_cell);
+		__m128i iz = clamp4(_mm_sra_epi32(cz, shift), lo, last_cell);
+
+		/* the fraction is only ever a whole one on the far border */
+		__m128 result = sampleCells4(ix, iy, iz,
+			getFraction4(_mm_sub_epi32(cx, _mm_sll_epi32(ix, shift)), fixed_shift),
+			getFraction4(_mm_sub_epi32(cy, _mm_sll_epi32(iy, shift)), fixed_shift),
+			getFraction4(_mm_sub_epi32(cz, _mm_sll_epi32(iz, shift)), fixed_shift));
+
+		if (count - i < 4)
+		{
+			_mm_storeu_ps(tail_dst, result);
+			memcpy(dst + i, tail_dst, (count - i) * sizeof(float));
+			break;
+		}
+		_mm_storeu_ps(dst + i, result);
+		i += 4;
+	}
+}
 
 VoxelGrid engine::loadVoxelGrid(std::string fileName)
 {
 	FILE *fp = fopen(fileName.c_str(), "rb");
 	if (NULL == fp) throw core::FatalException("failed to load voxel");
-	
-	engine::VoxelGrid voxelgrid(VOXEL_DATA_SIZE);
-	fread(&voxelgrid.max_dist, 4, 1, fp);
-	for (int z = 0; z < VOXEL_DATA_SIZE; ++z)
+
+	VoxelFileHeader header;
+	if (1 != fread(&header.magic, 4, 1, fp))
 	{
-		for (int y = 0; y < VOXEL_DATA_SIZE; ++y)
+		fclose(fp);
+		throw core::FatalException("failed to load voxel: empty file");
+	}
+
+	if (VOXEL_FILE_MAGIC == header.magic)
+	{
+		if (1 != fread(&header.version, sizeof(header) - 4, 1, fp))
+		{
+			fclose(fp);
+			throw core::FatalException("failed to load voxel: truncated header");
+		}
+		if (VOXEL_FILE_VERSION_PRECOMPUTED == header.version)
 		{
-			for (int x = 0; x < VOXEL_DATA_SIZE; ++x)
+			fclose(fp);
+			return mapVoxelGrid(fileName);
+		}
+		if (VOXEL_FILE_VERSION_RAW != header.version)
+		{
+			fclose(fp);
+			throw core::FatalException("failed to load voxel: unsupported version");
+		}
+		if (!isValidGridSize(header.grid_size))
+		{
+			fclose(fp);
+			throw core::FatalException("failed to load voxel: grid size must be a power of two up to 1024");
+		}
+	}
+	else
+	{
+		/* legacy file, the first four bytes were max_dist */
+		memcpy(&header.max_dist, &header.magic, 4);
+		header.grid_size = VOXEL_LEGACY_DATA_SIZE;
+	}
+
+	const int size = int(header.grid_size);
+	engine::VoxelGrid voxelgrid(size);
+	voxelgrid.max_dist = header.max_dist;
+
+	std::vector<signed char> slice(size * size);
+	for (int z = 0; z < size; ++z)
+	{
+		if (slice.size() != fread(&slice[0], 1, slice.size(), fp))
+		{
+			fclose(fp);
+			throw core::FatalException("failed to load voxel: truncated data");
+		}
+
+		const signed char *src = &slice[0];
+		for (int y = 0; y < size; ++y)
+		{
+			for (int x = 0; x < size; ++x)
 			{
-				signed char bdist;
-				fread(&bdist, 1, 1, fp);
-				voxelgrid.setDistance(x, y, z, bdist);
+				voxelgrid.setDistance(x, y, z, *src++);
 			}
 		}
+
+		/* min/max of a cell also depend on the next slice, so a layer of bricks
+		 * is final once the first slice of the layer after it is in */
+		if (z > 0 && 0 == (z & 7)) voxelgrid.compactBrickLayer((z >> 3) - 1);
 	}
 	fclose(fp);
+
+	voxelgrid.compact();
 	return voxelgrid;
 }
+
+void engine::saveVoxelGrid(const VoxelGrid &voxelGrid, std::string fileName)
+{
+	FILE *fp = fopen(fileName.c_str(), "wb");
+	if (NULL == fp) throw core::FatalException("failed to save voxel");
+
+	VoxelFileHeader header;
+	header.magic = VOXEL_FILE_MAGIC;
+	header.version = VOXEL_FILE_VERSION_PRECOMPUTED;
+	header.grid_size = (unsigned int)voxelGrid.getSize();
+	header.max_dist = voxelGrid.max_dist;
+
+	bool ok = 1 == fwrite(&header, sizeof(header), 1, fp);
+	ok = ok && writePlane(fp, voxelGrid.getDistances());
+	ok = ok && writePlane(fp, voxelGrid.getMinLevel(0));
+	ok = ok && writePlane(fp, voxelGrid.getMaxLevel(0));
+	for (int level = 1; ok && level < voxelGrid.getPyramidLevels(); ++level)
+	{
+		ok = ok && writePlane(fp, voxelGrid.getMinLevel(level));
+		ok = ok && writePlane(fp, voxelGrid.getMaxLevel(level));
+	}
+	fclose(fp);
+	if (!ok) throw core::FatalException("failed to save voxel");
+}
+
+void engine::convertVoxelGrid(std::string srcFileName, std::string dstFileName)
+{
+	saveVoxelGrid(loadVoxelGrid(srcFileName), dstFileName);
+}
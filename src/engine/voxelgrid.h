@@ -2,294 +2,189 @@
 #define VOXELGRID_H
 
 #include "../math/math.h"
-
-static unsigned int swizzle_3d_lut[256] = 
-{
-0x0,
-0x1,
-0x8,
-0x9,
-0x40,
-0x41,
-0x48,
-0x49,
-0x200,
-0x201,
-0x208,
-0x209,
-0x240,
-0x241,
-0x248,
-0x249,
-0x1000,
-0x1001,
-0x1008,
-0x1009,
-0x1040,
-0x1041,
-0x1048,
-0x1049,
-0x1200,
-0x1201,
-0x1208,
-0x1209,
-0x1240,
-0x1241,
-0x1248,
-0x1249,
-0x8000,
-0x8001,
-0x8008,
-0x8009,
-0x8040,
-0x8041,
-0x8048,
-0x8049,
-0x8200,
-0x8201,
-0x8208,
-0x8209,
-0x8240,
-0x8241,
-0x8248,
-0x8249,
-0x9000,
-0x9001,
-0x9008,
-0x9009,
-0x9040,
-0x9041,
-0x9048,
-0x9049,
-0x9200,
-0x9201,
-0x9208,
-0x9209,
-0x9240,
-0x9241,
-0x9248,
-0x9249,
-0x40000,
-0x40001,
-0x40008,
-0x40009,
-0x40040,
-0x40041,
-0x40048,
-0x40049,
-0x40200,
-0x40201,
-0x40208,
-0x40209,
-0x40240,
-0x40241,
-0x40248,
-0x40249,
-0x41000,
-0x41001,
-0x41008,
-0x41009,
-0x41040,
-0x41041,
-0x41048,
-0x41049,
-0x41200,
-0x41201,
-0x41208,
-0x41209,
-0x41240,
-0x41241,
-0x41248,
-0x41249,
-0x48000,
-0x48001,
-0x48008,
-0x48009,
-0x48040,
-0x48041,
-0x48048,
-0x48049,
-0x48200,
-0x48201,
-0x48208,
-0x48209,
-0x48240,
-0x48241,
-0x48248,
-0x48249,
-0x49000,
-0x49001,
-0x49008,
-0x49009,
-0x49040,
-0x49041,
-0x49048,
-0x49049,
-0x49200,
-0x49201,
-0x49208,
-0x49209,
-0x49240,
-0x49241,
-0x49248,
-0x49249,
-0x200000,
-0x200001,
-0x200008,
-0x200009,
-0x200040,
-0x200041,
-0x200048,
-0x200049,
-0x200200,
-0x200201,
-0x200208,
-0x200209,
-0x200240,
-0x200241,
-0x200248,
-0x200249,
-0x201000,
-0x201001,
-0x201008,
-0x201009,
-0x201040,
-0x201041,
-0x201048,
-0x201049,
-0x201200,
-0x201201,
-0x201208,
-0x201209,
-0x201240,
-0x201241,
-0x201248,
-0x201249,
-0x208000,
-0x208001,
-0x208008,
-0x208009,
-0x208040,
-0x208041,
-0x208048,
-0x208049,
-0x208200,
-0x208201,
-0x208208,
-0x208209,
-0x208240,
-0x208241,
-0x208248,
-0x208249,
-0x209000,
-0x209001,
-0x209008,
-0x209009,
-0x209040,
-0x209041,
-0x209048,
-0x209049,
-0x209200,
-0x209201,
-0x209208,
-0x209209,
-0x209240,
-0x209241,
-0x209248,
-0x209249,
-0x240000,
-0x240001,
-0x240008,
-0x240009,
-0x240040,
-0x240041,
-0x240048,
-0x240049,
-0x240200,
-0x240201,
-0x240208,
-0x240209,
-0x240240,
-0x240241,
-0x240248,
-0x240249,
-0x241000,
-0x241001,
-0x241008,
-0x241009,
-0x241040,
-0x241041,
-0x241048,
-0x241049,
-0x241200,
-0x241201,
-0x241208,
-0x241209,
-0x241240,
-0x241241,
-0x241248,
-0x241249,
-0x248000,
-0x248001,
-0x248008,
-0x248009,
-0x248040,
-0x248041,
-0x248048,
-0x248049,
-0x248200,
-0x248201,
-0x248208,
-0x248209,
-0x248240,
-0x248241,
-0x248248,
-0x248249,
-0x249000,
-0x249001,
-0x249008,
-0x249009,
-0x249040,
-0x249041,
-0x249048,
-0x249049,
-0x249200,
-0x249201,
-0x249208,
-0x249209,
-0x249240,
-0x249241,
-0x249248,
-0x249249
-};
+#include "voxelbricks.h"
 
 #include <limits.h>
+#include <emmintrin.h>
+
+#define VOXEL_GRID_MAX_SIZE 1024
+#define VOXEL_GRID_MAX_LEVELS 11
 
 namespace engine
 {
 	class VoxelGrid
 	{
 	public:
+		/* starts out without any bricks allocated, they appear as setDistance()
+		 * writes into them and go away again on compact() if they end up uniform */
 		VoxelGrid(size_t grid_size) :
-		  distances(NULL),
-		  max_distances(NULL),
-		  min_distances(NULL),
-		  grid_size(grid_size)
+		  grid_size(grid_size),
+		  fixed_shift(getFixedShift(grid_size)),
+		  swizzle(getSwizzleLut()),
+		  pool(new VoxelBrickPool),
+		  mapped_view(NULL)
+		{
+			/* morton-indexing needs a power of two */
+			assert(grid_size > 0 && grid_size <= VOXEL_GRID_MAX_SIZE);
+			assert(0 == (grid_size & (grid_size - 1)));
+
+			size_t cells = grid_size * grid_size * grid_size;
+			distances.init(pool, cells, 0);
+			min_distances.init(pool, cells, CHAR_MAX);
+			max_distances.init(pool, cells, CHAR_MIN);
+
+			pyramid_levels = 1;
+			for (size_t size = grid_size >> 1; size > 0; size >>= 1)
+			{
+				assert(pyramid_levels < VOXEL_GRID_MAX_LEVELS);
+				cells = size * size * size;
+				min_levels[pyramid_levels].init(pool, cells, CHAR_MAX);
+				max_levels[pyramid_levels].init(pool, cells, CHAR_MIN);
+				pyramid_levels++;
+			}
+		}
+
+		/* wraps already initialized dense storage, laid out as described by
+		 * getStorageSize(). if it lies in a mapped view of a file, passing the
+		 * view hands it over to the grid, which unmaps it when it goes away. */
+		VoxelGrid(size_t grid_size, signed char *storage, void *mapped_view = NULL) :
+		  grid_size(grid_size),
+		  fixed_shift(getFixedShift(grid_size)),
+		  swizzle(getSwizzleLut()),
+		  pool(new VoxelBrickPool),
+		  mapped_view(mapped_view)
+		{
+			assert(grid_size > 0 && grid_size <= VOXEL_GRID_MAX_SIZE);
+			assert(0 == (grid_size & (grid_size - 1)));
+
+			size_t cells = grid_size * grid_size * grid_size;
+			distances.attach(pool, cells, storage);     storage += cells;
+			min_distances.attach(pool, cells, storage); storage += cells;
+			max_distances.attach(pool, cells, storage); storage += cells;
+
+			pyramid_levels = 1;
+			for (size_t size = grid_size >> 1; size > 0; size >>= 1)
+			{
+				assert(pyramid_levels < VOXEL_GRID_MAX_LEVELS);
+				cells = size * size * size;
+				min_levels[pyramid_levels].attach(pool, cells, storage); storage += cells;
+				max_levels[pyramid_levels].attach(pool, cells, storage); storage += cells;
+				pyramid_levels++;
+			}
+		}
+
+		/* copies are deep, into a pool of their own. the copy of a mapped
+		 * grid lives in memory, only the original keeps the view */
+		VoxelGrid(const VoxelGrid &other);
+		VoxelGrid &operator=(const VoxelGrid &other);
+		~VoxelGrid();
+
+		/* size of the dense layout: distances, min_distances, max_distances,
+		 * followed by the min and max plane of each coarser pyramid level. */
+		static size_t getStorageSize(size_t grid_size)
+		{
+			size_t total = 3 * grid_size * grid_size * grid_size;
+			for (size_t size = grid_size >> 1; size > 0; size >>= 1)
+				total += 2 * size * size * size;
+			return total;
+		}
+
+		/* releases every brick that ended up uniform */
+		void compact()
+		{
+			distances.compact();
+			min_distances.compact();
+			max_distances.compact();
+			for (int level = 1; level < pyramid_levels; ++level)
+			{
+				min_levels[level].compact();
+				max_levels[level].compact();
+			}
+		}
+
+		/* compact() for the base planes of one layer of bricks (cells z in
+		 * [8 * brick_z, 8 * brick_z + 8)), for loaders that go slice by slice */
+		void compactBrickLayer(int brick_z)
+		{
+			int bricks = std::max(int(grid_size) >> 3, 1);
+			assert(brick_z >= 0 && brick_z < bricks);
+			for (int y = 0; y < bricks; ++y)
+				for (int x = 0; x < bricks; ++x)
+				{
+					int brick = getIndex(x, y, brick_z);
+					distances.compactBrick(brick);
+					min_distances.compactBrick(brick);
+					max_distances.compactBrick(brick);
+				}
+		}
+
+		size_t getMemoryUsage() const
+		{
+			size_t usage = distances.getMemoryUsage() + min_distances.getMemoryUsage() + max_distances.getMemoryUsage();
+			for (int level = 1; level < pyramid_levels; ++level)
+				usage += min_levels[level].getMemoryUsage() + max_levels[level].getMemoryUsage();
+			return usage;
+		}
+
+		const VoxelBrickPlane &getDistances() const { return distances; }
+		int getPyramidLevels() const { return pyramid_levels; }
+		const VoxelBrickPlane &getMinLevel(int level) const { return 0 == level ? min_distances : min_levels[level]; }
+		const VoxelBrickPlane &getMaxLevel(int level) const { return 0 == level ? max_distances : max_levels[level]; }
+
+		/* fraction bits of the fixed-point coordinates of trilinearSample(int,
+		 * int, int) and the fillGrid() rows. rotated, the coordinates reach
+		 * from -0.37 to 1.37 times the size, so it's 8.24 up to 64^3 and a bit
+		 * less for every doubling above, down to 12.20 at 1024^3. */
+		int getFixedShift() const { return fixed_shift; }
+
+		static int getFixedShift(size_t grid_size)
 		{
-			distances = new signed char[grid_size * grid_size * grid_size];
-			max_distances = new signed char[grid_size * grid_size * grid_size];
-			min_distances = new signed char[grid_size * grid_size * grid_size];
-			memset(distances, 0, sizeof(signed char) *grid_size * grid_size * grid_size);
-			memset(max_distances, CHAR_MIN, sizeof(signed char) * grid_size * grid_size * grid_size);
-			memset(min_distances, CHAR_MAX, sizeof(signed char) * grid_size * grid_size * grid_size);
+			int shift = 24;
+			for (size_t size = 64; size < grid_size; size <<= 1)
+				shift--;
+			return shift;
 		}
 
 		inline int getIndex(int x, int y, int z) const
 		{
-			return swizzle_3d_lut[x] | (swizzle_3d_lut[y] << 1) | (swizzle_3d_lut[z] << 2);
+			return swizzle[x] | (swizzle[y] << 1) | (swizzle[z] << 2);
 //			return (z * grid_size + y) * grid_size + x;
 		}
 
+		/* inverse of getIndex() */
+		inline void getCoords(int index, int &x, int &y, int &z) const
+		{
+			x = compactBits(index);
+			y = compactBits(index >> 1);
+			z = compactBits(index >> 2);
+		}
+
+		/* insert two zero-bits between each of the lower 10 bits */
+		static inline unsigned int spreadBits(unsigned int v)
+		{
+			v &= 0x000003FF;
+			v = (v | (v << 16)) & 0x030000FF;
+			v = (v | (v <<  8)) & 0x0300F00F;
+			v = (v | (v <<  4)) & 0x030C30C3;
+			v = (v | (v <<  2)) & 0x09249249;
+			return v;
+		}
+
+		static inline int compactBits(unsigned int v)
+		{
+			v &= 0x09249249;
+			v = (v | (v >>  2)) & 0x030C30C3;
+			v = (v | (v >>  4)) & 0x0300F00F;
+			v = (v | (v >>  8)) & 0x030000FF;
+			v = (v | (v >> 16)) & 0x000003FF;
+			return int(v);
+		}
+
+		/* spreadBits() for every valid coordinate, filled in by the first
+		 * call rather than a static constructor, so grids made during static
+		 * initialization don't depend on the order of it */
+		static const unsigned int *getSwizzleLut();
+
 		inline signed char pointSample(int x, int y, int z) const
 		{
 			assert(x >= 0);
@@ -385,9 +280,9 @@ namespace engine
 
 		float trilinearSample(int x, int y, int z) const
 		{
-			int ix = x >> 24;
-			int iy = y >> 24;
-			int iz = z >> 24;
+			int ix = x >> fixed_shift;
+			int iy = y >> fixed_shift;
+			int iz = z >> fixed_shift;
 			
 			int f0 = pointSample(ix,     iy,     iz);
 			int f1 = pointSample(ix + 1, iy,     iz);
@@ -399,9 +294,11 @@ namespace engine
 			int b2 = pointSample(ix,     iy + 1, iz + 1);
 			int b3 = pointSample(ix + 1, iy + 1, iz + 1);
 			
-			int ixt = (x & ((1 << 24) - 1)) >> 8;
-			int iyt = (y & ((1 << 24) - 1)) >> 8;
-			int izt = (z & ((1 << 24) - 1)) >> 8;
+			/* always 16 bits of the fraction */
+			const int frac_mask = (1 << fixed_shift) - 1;
+			int ixt = (x & frac_mask) >> (fixed_shift - 16);
+			int iyt = (y & frac_mask) >> (fixed_shift - 16);
+			int izt = (z & frac_mask) >> (fixed_shift - 16);
 			
 			float xt = float(ixt) / (1 << 16);
 			float yt = float(iyt) / (1 << 16);
@@ -421,7 +318,78 @@ namespace engine
 			
 			return math::lerp(z1, z2, zt);
 		}
-		
+
+		/* SSE2 version of getIndex(), valid for coordinates up to 10 bits */
+		static inline __m128i getIndex4(__m128i x, __m128i y, __m128i z)
+		{
+			x = spreadBits4(x);
+			y = spreadBits4(y);
+			z = spreadBits4(z);
+			return _mm_or_si128(x, _mm_or_si128(_mm_slli_epi32(y, 1), _mm_slli_epi32(z, 2)));
+		}
+
+		/* SSE2 version of the fixed-point trilinearSample(), four samples at a time.
+		 * all lanes must be in range, and the blend is done in the same order as
+		 * the scalar version, so the results only differ where the scalar one
+		 * keeps x87 precision between the steps. */
+		__m128 trilinearSample4(__m128i x, __m128i y, __m128i z) const
+		{
+			const __m128i shift = _mm_cvtsi32_si128(fixed_shift);
+			const __m128i frac_mask = _mm_set1_epi32((1 << fixed_shift) - 1);
+			return sampleCells4(
+				_mm_sra_epi32(x, shift), _mm_sra_epi32(y, shift), _mm_sra_epi32(z, shift),
+				getFraction4(_mm_and_si128(x, frac_mask), fixed_shift),
+				getFraction4(_mm_and_si128(y, frac_mask), fixed_shift),
+				getFraction4(_mm_and_si128(z, frac_mask), fixed_shift));
+		}
+
+		/* batched trilinearSample(), for count points given as separate x/y/z
+		 * arrays. points outside the grid are clamped to the border. the fixed-
+		 * point version takes getFixedShift() coordinates, and blends the points
+		 * inside like trilinearSample4() does. */
+		void trilinearSampleBatch(const float *x, const float *y, const float *z, float *dst, size_t count) const;
+		void trilinearSampleBatch(const int *x, const int *y, const int *z, float *dst, size_t count) const;
+
+		/* blends the eight corners of the cells at (ix, iy, iz), which all have to be inside */
+		__m128 sampleCells4(__m128i ix, __m128i iy, __m128i iz, __m128 xt, __m128 yt, __m128 zt) const
+		{
+			__m128i sx0 = spreadBits4(ix);
+			__m128i sy0 = _mm_slli_epi32(spreadBits4(iy), 1);
+			__m128i sz0 = _mm_slli_epi32(spreadBits4(iz), 2);
+
+			/* the far corners are a morton-increment away, no need to spread again */
+			__m128i sx1 = incrementSpread4(sx0, 0x09249249);
+			__m128i sy1 = incrementSpread4(sy0, 0x09249249 << 1);
+			__m128i sz1 = incrementSpread4(sz0, 0x09249249 << 2);
+
+			__m128i yz00 = _mm_or_si128(sy0, sz0);
+			__m128i yz10 = _mm_or_si128(sy1, sz0);
+			__m128i yz01 = _mm_or_si128(sy0, sz1);
+			__m128i yz11 = _mm_or_si128(sy1, sz1);
+
+			__m128 f0 = gather4(distances, _mm_or_si128(sx0, yz00));
+			__m128 f1 = gather4(distances, _mm_or_si128(sx1, yz00));
+			__m128 f2 = gather4(distances, _mm_or_si128(sx0, yz10));
+			__m128 f3 = gather4(distances, _mm_or_si128(sx1, yz10));
+
+			__m128 b0 = gather4(distances, _mm_or_si128(sx0, yz01));
+			__m128 b1 = gather4(distances, _mm_or_si128(sx1, yz01));
+			__m128 b2 = gather4(distances, _mm_or_si128(sx0, yz11));
+			__m128 b3 = gather4(distances, _mm_or_si128(sx1, yz11));
+
+			/* first layer */
+			__m128 y1 = lerp4(f0, f1, xt);
+			__m128 y2 = lerp4(f2, f3, xt);
+			__m128 z1 = lerp4(y1, y2, yt);
+
+			/* second layer */
+			y1 = lerp4(b0, b1, xt);
+			y2 = lerp4(b2, b3, xt);
+			__m128 z2 = lerp4(y1, y2, yt);
+
+			return lerp4(z1, z2, zt);
+		}
+
 		void setDistance(int x, int y, int z, float dist)
 		{
 			assert(x >= 0);
@@ -432,7 +400,7 @@ namespace engine
 			assert(z < int(grid_size));
 			
 			signed char cdist = (signed char)dist;
-			distances[getIndex(x, y, z)] = cdist;
+			distances.set(getIndex(x, y, z), cdist);
 
 			updateMinMax(x,   y,   z, cdist);
 			updateMinMax(x-1, y,   z, cdist);
@@ -454,23 +422,147 @@ namespace engine
 			if (z >= int(grid_size)) return;
 			
 			int index = getIndex(x, y, z);
-			if (min_distances[index] > dist) min_distances[index] = dist;
-			if (max_distances[index] < dist) max_distances[index] = dist;
+			if (min_distances[index] > dist) min_distances.set(index, dist);
+			if (max_distances[index] < dist) max_distances.set(index, dist);
+
+			/* propagate up the pyramid until a level already covers dist */
+			for (int level = 1; level < pyramid_levels; ++level)
+			{
+				index >>= 3;
+				if (min_levels[level][index] <= dist && max_levels[level][index] >= dist) break;
+				if (min_levels[level][index] > dist) min_levels[level].set(index, dist);
+				if (max_levels[level][index] < dist) max_levels[level].set(index, dist);
+			}
+		}
+
+		/* conservative min/max over the cells [x0, x1] x [y0, y1] x [z0, z1]
+		 * (inclusive, cell coordinates). picks the finest pyramid level where
+		 * the range spans at most four cells per axis, so this is at most 64 lookups. */
+		void getRangeMinMax(int x0, int y0, int z0, int x1, int y1, int z1, signed char &min_dist, signed char &max_dist) const
+		{
+			assert(x0 >= 0 && x0 <= x1 && x1 < int(grid_size));
+			assert(y0 >= 0 && y0 <= y1 && y1 < int(grid_size));
+			assert(z0 >= 0 && z0 <= z1 && z1 < int(grid_size));
+
+			int level = 0;
+			while (
+				((x1 >> level) - (x0 >> level)) > 3 ||
+				((y1 >> level) - (y0 >> level)) > 3 ||
+				((z1 >> level) - (z0 >> level)) > 3)
+				level++;
+			assert(level < pyramid_levels);
+
+			const VoxelBrickPlane &min_level = getMinLevel(level);
+			const VoxelBrickPlane &max_level = getMaxLevel(level);
+
+			min_dist = SCHAR_MAX;
+			max_dist = SCHAR_MIN;
+			for (int z = z0 >> level; z <= (z1 >> level); ++z)
+				for (int y = y0 >> level; y <= (y1 >> level); ++y)
+					for (int x = x0 >> level; x <= (x1 >> level); ++x)
+					{
+						int index = getIndex(x, y, z);
+						min_dist = std::min(min_dist, min_level[index]);
+						max_dist = std::max(max_dist, max_level[index]);
+					}
 		}
 
 		size_t getSize() const { return grid_size; }
 
+		/* SSE2 version of spreadBits() */
+		static inline __m128i spreadBits4(__m128i v)
+		{
+			v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 16)), _mm_set1_epi32(0x030000FF));
+			v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v,  8)), _mm_set1_epi32(0x0300F00F));
+			v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v,  4)), _mm_set1_epi32(0x030C30C3));
+			v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v,  2)), _mm_set1_epi32(0x09249249));
+			return v;
+		}
+
+		static inline __m128 gather4(const VoxelBrickPlane &src, __m128i index)
+		{
+			_MM_ALIGN16 int i[4];
+			_mm_store_si128((__m128i*)i, index);
+			return _mm_cvtepi32_ps(_mm_setr_epi32(src[i[0]], src[i[1]], src[i[2]], src[i[3]]));
+		}
+
+		static inline __m128i gatherInt4(const VoxelBrickPlane &src, __m128i index)
+		{
+			_MM_ALIGN16 int i[4];
+			_mm_store_si128((__m128i*)i, index);
+			return _mm_setr_epi32(src[i[0]], src[i[1]], src[i[2]], src[i[3]]);
+		}
+
+		static inline __m128 lerp4(__m128 v0, __m128 v1, __m128 t)
+		{
+			return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+		}
+
+		/* spread coordinate + 1: set the gaps, so the carry ripples through them */
+		static inline __m128i incrementSpread4(__m128i v, int mask)
+		{
+			const __m128i m = _mm_set1_epi32(mask);
+			return _mm_and_si128(_mm_add_epi32(_mm_or_si128(v, _mm_andnot_si128(m, _mm_set1_epi32(-1))), _mm_set1_epi32(1)), m);
+		}
+
+		/* fixed-point fraction to float, through 16 bits just like trilinearSample(int, int, int) */
+		static inline __m128 getFraction4(__m128i frac, int shift)
+		{
+			return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srl_epi32(frac, _mm_cvtsi32_si128(shift - 16))), _mm_set1_ps(1.0f / (1 << 16)));
+		}
+
+		/* SSE2 lacks min/max for 32-bit integers */
+		static inline __m128i clamp4(__m128i v, __m128i lo, __m128i hi)
+		{
+			__m128i below = _mm_cmplt_epi32(v, lo);
+			v = _mm_or_si128(_mm_and_si128(below, lo), _mm_andnot_si128(below, v));
+			__m128i above = _mm_cmpgt_epi32(v, hi);
+			return _mm_or_si128(_mm_and_si128(above, hi), _mm_andnot_si128(above, v));
+		}
+
 	private:
+		void copyPlanes(const VoxelGrid &other);
+		void release();
+
 		size_t grid_size;
-		signed char *distances;
+		int fixed_shift;
+		const unsigned int *swizzle;
+		VoxelBrickPool *pool;
+		void *mapped_view;
+		VoxelBrickPlane distances;
+
+		/* min/max pyramid from level 1 on, level 0 is min_distances/max_distances.
+		 * since the cells are morton-ordered, the parent of a cell is simply its
+		 * index shifted down by three. */
+		int pyramid_levels;
+		VoxelBrickPlane min_levels[VOXEL_GRID_MAX_LEVELS];
+		VoxelBrickPlane max_levels[VOXEL_GRID_MAX_LEVELS];
 	public:
-		signed char *max_distances;
-		signed char *min_distances;
+		VoxelBrickPlane max_distances;
+		VoxelBrickPlane min_distances;
 
 		float max_dist;
 	};
 	
+	/* voxel files start with this header. version 1 is followed by grid_size^3
+	 * distances in x-major order, version 2 by the dense precomputed planes of
+	 * VoxelGrid (see getStorageSize()), and gets memory-mapped as-is. files without a header are the old
+	 * fixed-size 32^3 ones, with just max_dist in front. */
+	struct VoxelFileHeader
+	{
+		unsigned int magic;
+		unsigned int version;
+		unsigned int grid_size;
+		float max_dist;
+	};
+
+	#define VOXEL_FILE_MAGIC (('G' << 24) | ('X' << 16) | ('O' << 8) | 'V')
+	#define VOXEL_FILE_VERSION_RAW 1
+	#define VOXEL_FILE_VERSION_PRECOMPUTED 2
+
 	VoxelGrid loadVoxelGrid(std::string fileName);
+	void saveVoxelGrid(const VoxelGrid &voxelGrid, std::string fileName);
+	void convertVoxelGrid(std::string srcFileName, std::string dstFileName);
 }
 
 #endif /* VOXELGRID_H */
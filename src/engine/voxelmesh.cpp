@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "voxelmesh.h"
 #include "../math/vector3.h"
+#include "../core/cpu.h"
+#include "../core/fatalexception.h"
 
 using namespace engine;
 using math::Vector3;
@@ -12,15 +14,278 @@ float VoxelMesh::getVoxelSize(float dist) const
 	return (0.5f / voxelGrid.getSize()) - dist * 0.5f;
 }
 
+bool VoxelMesh::reusePrevious(const math::Matrix4x4 &mrot)
+{
+	updateCount++;
+	if (hasPrevious && currSize == previousSize)
+	{
+		if (0 == memcmp(&mrot, &previousTransform, sizeof(mrot)))
+		{
+			skippedCount++;
+			return true;
+		}
+
+		if (reuseAngle > 0.0f &&
+		    mrot._41 == previousTransform._41 &&
+		    mrot._42 == previousTransform._42 &&
+		    mrot._43 == previousTransform._43)
+		{
+			/* trace(a^T * b) = 1 + 2 cos(angle of the rotation between them) */
+			float trace = 0.0f;
+			for (int i = 0; i < 3; ++i)
+				for (int j = 0; j < 3; ++j)
+					trace += mrot.m[i][j] * previousTransform.m[i][j];
+			if ((trace - 1.0f) * 0.5f >= cosf(reuseAngle))
+			{
+				reusedCount++;
+				return true;
+			}
+		}
+	}
+
+	hasPrevious = true;
+	previousTransform = mrot;
+	previousSize = currSize;
+	return false;
+}
+
 void VoxelMesh::update(const math::Matrix4x4 &mrot)
 {
-	fillGrid(mrot);
-	renderer::VertexBuffer &vb = dynamic_vb;
-	cubes = updateDynamicVertexBuffer(vb);
+	updateView(mrot, NULL);
+}
+
+void VoxelMesh::update(const math::Matrix4x4 &mrot, const math::Matrix4x4 &gridToClip)
+{
+	updateView(mrot, &gridToClip);
+}
+
+void VoxelMesh::updateView(const math::Matrix4x4 &mrot, const math::Matrix4x4 *gridToClip)
+{
+	bool reuse = reusePrevious(mrot);
+
+	if (OUTPUT_SURFACE == outputMode)
+	{
+		if (reuse) return;
+		fillGrid(mrot, currSize);
+		extractSurface(getGridSize(currSize));
+		cubes = 0;
+		return;
+	}
+
+	/* a new view only needs new instances, the grid can stay. only this
+	 * thread writes pendingView, so it can be read without the lock, but the
+	 * new one is made aside and handed over under it */
+	const View &lastView = NULL == workerThread ? view : pendingView;
+	bool sameView = NULL == gridToClip ?
+		!lastView.enabled :
+		lastView.enabled && 0 == memcmp(gridToClip, &lastView.gridToClip, sizeof(*gridToClip));
+	View nextView;
+	if (!sameView) makeView(nextView, gridToClip);
+
+	if (NULL == workerThread)
+	{
+		if (!sameView) view = nextView;
+
+		/* the grid and the vertex buffer are still what they were */
+		if (reuse && sameView) return;
+		if (!reuse) fillGrid(mrot, currSize);
+		if (headless || isLevelOfDetailActive())
+		{
+			/* the levels of detail don't know their total up front, so they go through staging too */
+			stagingCubes[vbSelector] = writeStaging(vbSelector, getGridSize(currSize));
+			uploadStaging(vbSelector);
+			return;
+		}
+		renderer::VertexBuffer &vb = dynamic_vb;
+		cubes = updateDynamicVertexBuffer(vb);
+		return;
+	}
+
+	EnterCriticalSection(&workerLock);
+	bool fresh = stagingFresh;
+	if (fresh)
+	{
+		std::swap(vbSelector, stagingReady);
+		stagingFresh = false;
+	}
+	if (!reuse)
+	{
+		pendingTransform = mrot;
+		pendingSize = currSize;
+		pendingFill = true;
+	}
+	if (!sameView) pendingView = nextView;
+	bool request = !reuse || !sameView;
+	if (request) pendingRequest = true;
+	LeaveCriticalSection(&workerLock);
+	if (request) SetEvent(workerWake);
+
+	/* the worker never touches the buffer we hold, no need to lock for the copy */
+	if (fresh) uploadStaging(vbSelector);
+}
+
+void VoxelMesh::uploadStaging(int buffer)
+{
+	cubes = stagingCubes[buffer];
+	if (0 == cubes || headless) return;
+	void *dst = dynamic_vb.lock(0, UINT(cubes * (4 * 3)), D3DLOCK_DISCARD);
+	memcpy(dst, &staging[buffer][0], cubes * (4 * 3));
+	dynamic_vb.unlock();
+}
+
+size_t VoxelMesh::writeStaging(int buffer, int igrid_size)
+{
+	if (isLevelOfDetailActive()) return writeLevels(buffer, igrid_size);
+
+	size_t count = countInstances(igrid_size);
+	if (staging[buffer].size() < count * (4 * 3))
+		staging[buffer].resize(count * (4 * 3));
+	if (0 != count) writeInstances(&staging[buffer][0], igrid_size);
+	return count;
+}
+
+void VoxelMesh::setOutputMode(OutputMode mode)
+{
+	if (OUTPUT_SURFACE == mode) setAsync(false);
+	if (mode != outputMode) invalidate();
+	outputMode = mode;
+}
+
+void VoxelMesh::setResampler(Resampler resampler)
+{
+	bool fillShear = RESAMPLE_SHEAR == resampler && shearValues.empty();
+	if (resampler == this->resampler && !fillShear) return;
+
+	/* the worker reads both, so it's stopped while they change */
+	bool async = getAsync();
+	setAsync(false);
+	if (fillShear)
+	{
+		/* the same mapping as fillRow(), for every 8.8 distance */
+		shearValues.resize(1 << 16);
+		for (int i = 0; i < (1 << 16); ++i)
+		{
+			float size = getVoxelSize(float(i + SHRT_MIN) / (1 << 8));
+			shearValues[i] = BYTE(math::clamp(size, 0.0f, 1.0f) * 255);
+		}
+	}
+	if (resampler != this->resampler) invalidate();
+	this->resampler = resampler;
+	setAsync(async);
+}
+
+void VoxelMesh::setLevelOfDetail(int levels, float distance)
+{
+	levels = std::min(std::max(levels, 1), VOXEL_MESH_MAX_LOD_LEVELS);
+	distance = std::max(distance, 1.0f);
+	if (levels == lodLevels && distance == lodDistance) return;
+
+	/* the worker writes into the level buffers, so it's stopped while they grow */
+	bool async = getAsync();
+	setAsync(false);
+	for (int level = 1; level < levels; ++level)
+	{
+		LodLevel &l = lod[level];
+		if (!l.storage.empty()) continue;
+		/* as many planes as the level can have, with the rows of the full grid */
+		size_t planes = (maxSize >> level) + 1;
+		l.storage.resize(maxSize * maxSize * planes);
+		l.grid = &l.storage[0];
+		l.solidRows.resize(maxSize * planes * rowWords);
+		l.filledRows.resize(maxSize * planes * rowWords);
+		l.insideRows.resize(maxSize * planes * rowWords);
+	}
+	invalidate();
+	lodLevels = levels;
+	lodDistance = distance;
+	setAsync(async);
+}
+
+void VoxelMesh::setAsync(bool enable)
+{
+	if (enable == (NULL != workerThread)) return;
+	assert(!enable || OUTPUT_CUBES == outputMode);
+	invalidate();
+
+	if (enable)
+	{
+		InitializeCriticalSection(&workerLock);
+		workerQuit = false;
+		pendingRequest = false;
+		pendingFill = false;
+		pendingView.enabled = false;
+		stagingWriting = 0;
+		stagingReady = 1;
+		vbSelector = 2;
+		stagingFresh = false;
+		for (int i = 0; i < VOXEL_MESH_STAGING_BUFFERS; ++i)
+			stagingCubes[i] = 0;
+
+		workerWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (NULL == workerWake) throw core::FatalException("failed to create voxel worker event");
+		workerThread = CreateThread(NULL, 0, workerProc, this, 0, NULL);
+		if (NULL == workerThread) throw core::FatalException("failed to start voxel worker");
+	}
+	else
+	{
+		EnterCriticalSection(&workerLock);
+		workerQuit = true;
+		LeaveCriticalSection(&workerLock);
+		SetEvent(workerWake);
+		WaitForSingleObject(workerThread, INFINITE);
+
+		CloseHandle(workerThread);
+		CloseHandle(workerWake);
+		DeleteCriticalSection(&workerLock);
+		workerThread = NULL;
+		workerWake = NULL;
+	}
+}
+
+DWORD WINAPI VoxelMesh::workerProc(LPVOID param)
+{
+	((VoxelMesh *)param)->workerLoop();
+	return 0;
+}
+
+void VoxelMesh::workerLoop()
+{
+	for (;;)
+	{
+		WaitForSingleObject(workerWake, INFINITE);
+
+		EnterCriticalSection(&workerLock);
+		bool quit = workerQuit;
+		bool request = pendingRequest;
+		bool fill = pendingFill;
+		math::Matrix4x4 mrot = pendingTransform;
+		float size = pendingSize;
+		int buffer = stagingWriting;
+		view = pendingView;
+		pendingRequest = false;
+		pendingFill = false;
+		LeaveCriticalSection(&workerLock);
+
+		if (quit) break;
+		if (!request) continue;
+
+		/* the grid, the row masks and the view belong to the worker while it runs */
+		if (fill) fillGrid(mrot, size);
+		size_t count = writeStaging(buffer, getGridSize(size));
+
+		EnterCriticalSection(&workerLock);
+		stagingCubes[buffer] = count;
+		std::swap(stagingWriting, stagingReady);
+		stagingFresh = true;
+		LeaveCriticalSection(&workerLock);
+	}
 }
 
 void VoxelMesh::draw(renderer::Device &device) const
 {
+	assert(!headless);
+	if (OUTPUT_SURFACE == outputMode) return;
+
 	// setup render state
 	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
 	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW);
@@ -49,10 +314,10 @@ void VoxelMesh::draw(renderer::Device &device) const
 	device->SetStreamSourceFreq(1, 1);
 }
 
-void VoxelMesh::fillGrid(math::Matrix4x4 mrot)
+void VoxelMesh::fillGrid(math::Matrix4x4 mrot, float size)
 {
-	int igrid_min_size = int(floor(currSize) / 2);
-	int igrid_max_size = int(ceil(currSize) / 2);
+	int igrid_min_size = int(floor(size) / 2);
+	int igrid_max_size = int(ceil(size) / 2);
 	
 #if 0
 	igrid_min_size /= 4;
@@ -67,7 +332,7 @@ void VoxelMesh::fillGrid(math::Matrix4x4 mrot)
 	mscale.makeScaling(math::Vector3(scale, scale, scale));
 	mrot *= mscale * mtranslate;
 	
-	float grid_size_rcp = 1.0f / (currSize / 2);
+	float grid_size_rcp = 1.0f / (size / 2);
 	
 	Vector3 dx = Vector3(mrot._11, mrot._12, mrot._13) * grid_size_rcp;
 	Vector3 dy = Vector3(mrot._21, mrot._22, mrot._23) * grid_size_rcp;
@@ -79,10 +344,18 @@ void VoxelMesh::fillGrid(math::Matrix4x4 mrot)
 		float(-igrid_min_size) * grid_size_rcp
 		);
 	pz = math::mul(mrot, pz);
+
+	if (RESAMPLE_SHEAR == resampler)
+	{
+		fillGridShear(dx, dy, dz, pz, igrid_max_size + igrid_min_size);
+		return;
+	}
 	
-	int dx_x = int(dx.x * (1 << 24));
-	int dx_y = int(dx.y * (1 << 24));
-	int dx_z = int(dx.z * (1 << 24));
+	/* as many fraction bits as the source size leaves room for */
+	const float fixed_one = float(1 << voxelGrid.getFixedShift());
+	int dx_x = int(dx.x * fixed_one);
+	int dx_y = int(dx.y * fixed_one);
+	int dx_z = int(dx.z * fixed_one);
 	
 	// find the lowest and highest min/max values that can contribute to a result
 	int min_threshold = SCHAR_MIN;
@@ -94,123 +367,825 @@ void VoxelMesh::fillGrid(math::Matrix4x4 mrot)
 		if (size < 1.0f) max_threshold = std::min(max_threshold, i);
 	}
 	
+	int igrid_size = igrid_max_size + igrid_min_size;
+	
+	/* fixed-point start of every row, accumulated the same way as always */
+	rowStarts.resize(igrid_size * igrid_size * 3);
+#pragma omp parallel for
+	for (int z = 0; z < igrid_size; ++z)
+	{
+		Vector3 py = pz + dz * float(z);
+		int *start = &rowStarts[z * igrid_size * 3];
+		for (int y = 0; y < igrid_size; ++y)
+		{
+			*start++ = int(py.x * fixed_one);
+			*start++ = int(py.y * fixed_one);
+			*start++ = int(py.z * fixed_one);
+			py += dy;
+		}
+	}
+	
+	/* resample in blocks, so whole empty or solid blocks can be filled in one go */
+	int blocks = (igrid_size + VOXEL_MESH_BLOCK_SIZE - 1) / VOXEL_MESH_BLOCK_SIZE;
 #pragma omp parallel for
-	for (int z = -igrid_min_size; z < igrid_max_size; ++z)
+	for (int bz = 0; bz < blocks; ++bz)
 	{
-		Vector3 py = pz + dz * float(z + igrid_min_size);
-		for (int y = -igrid_min_size; y < igrid_max_size; ++y)
+		int z0 = bz * VOXEL_MESH_BLOCK_SIZE;
+		int z1 = std::min(z0 + VOXEL_MESH_BLOCK_SIZE, igrid_size);
+		for (int z = z0; z < z1; ++z)
 		{
-			int px_x = int(py.x * (1 << 24));
-			int px_y = int(py.y * (1 << 24));
-			int px_z = int(py.z * (1 << 24));
+			memset(&solidRows[getRowIndex(0, z)],  0, sizeof(UINT64) * getRowIndex(igrid_size, 0));
+			memset(&filledRows[getRowIndex(0, z)], 0, sizeof(UINT64) * getRowIndex(igrid_size, 0));
+			memset(&insideRows[getRowIndex(0, z)], 0, sizeof(UINT64) * getRowIndex(igrid_size, 0));
+		}
 
-			for (int x = -igrid_min_size; x < igrid_max_size; ++x)
+		for (int by = 0; by < blocks; ++by)
+		{
+			int y0 = by * VOXEL_MESH_BLOCK_SIZE;
+			int y1 = std::min(y0 + VOXEL_MESH_BLOCK_SIZE, igrid_size);
+			for (int bx = 0; bx < blocks; ++bx)
 			{
-				int px = px_x;
-				int py = px_y;
-				int pz = px_z;
-
-				px_x += dx_x;
-				px_y += dx_y;
-				px_z += dx_z;
-
-				int ix = px >> 24;
-				int iy = py >> 24;
-				int iz = pz >> 24;
-
-				int xx = x + igrid_min_size;
-				int yy = y + igrid_min_size;
-				int zz = z + igrid_min_size;
-				size_t dstIndex = getIndex(xx, yy, zz);
+				int x0 = bx * VOXEL_MESH_BLOCK_SIZE;
+				int x1 = std::min(x0 + VOXEL_MESH_BLOCK_SIZE, igrid_size);
+				
+				int fill = classifyBlock(x0, y0, z0, x1, y1, z1, igrid_size, dx_x, dx_y, dx_z, min_threshold, max_threshold);
+				if (fill >= 0)
+				{
+					for (int z = z0; z < z1; ++z)
+						for (int y = y0; y < y1; ++y)
+						{
+							memset(&grid[getIndex(x0, y, z)], fill, x1 - x0);
+							if (0 != fill) setRowBits(x0, y, z, x1 - x0);
+						}
+					continue;
+				}
 				
-				if (
-					ix <= 0 || ix >= int(voxelGrid.getSize()) - 1 ||
-					iy <= 0 || iy >= int(voxelGrid.getSize()) - 1 ||
-					iz <= 0 || iz >= int(voxelGrid.getSize()) - 1)
+				for (int z = z0; z < z1; ++z)
+				{
+					for (int y = y0; y < y1; ++y)
+					{
+						const int *start = &rowStarts[(z * igrid_size + y) * 3];
+						int px_x = start[0] + dx_x * x0;
+						int px_y = start[1] + dx_y * x0;
+						int px_z = start[2] + dx_z * x0;
+						
+						BYTE *dst = &grid[getIndex(x0, y, z)];
+						int x = 0;
+						if (useSSE2)
+							x = fillRowSSE2(dst, x1 - x0, px_x, px_y, px_z, dx_x, dx_y, dx_z, min_threshold, max_threshold);
+						
+						fillRow(dst + x, x1 - x0 - x,
+							px_x + dx_x * x, px_y + dx_y * x, px_z + dx_z * x,
+							dx_x, dx_y, dx_z, min_threshold, max_threshold);
+						setRowBits(x0, y, z, x1 - x0);
+					}
+				}
+			}
+		}
+	}
+}
+
+namespace
+{
+	/* outside of the source grid, as far from the surface as it gets */
+	const short shear_outside = SCHAR_MAX << 8;
+
+	/* the passes step through rows in 16.16 fixed-point */
+	inline int toShearFixed(float v)
+	{
+		return int(floor(v * (1 << 16) + 0.5f));
+	}
+
+	inline short lerpShear(short v0, short v1, int p)
+	{
+		/* 15 bits of the fraction, so the product fits */
+		return short(v0 + (((v1 - v0) * ((p & 0xFFFF) >> 1)) >> 15));
+	}
+}
+
+/* the destination voxel q maps to the source position p = a * q + t. the
+ * three passes each solve for one source coordinate, along rows:
+ *
+ *  first:  (p0, p1, z) from the source, linear along the source axis i2
+ *  second: (p0, y, z)  from the first, linear along p1
+ *  third:  (x, y, z)   from the second, linear along p0
+ *
+ * p0 and p1 are the source coordinates i0 and i1, at integer positions. the
+ * inner loops all run along p0 or x, so every pass reads and writes close to
+ * sequentially, two rows at a time. */
+void VoxelMesh::fillGridShear(const Vector3 &dx, const Vector3 &dy, const Vector3 &dz, const Vector3 &origin, int igrid_size)
+{
+	assert(!shearValues.empty());
+	const int src_size = int(voxelGrid.getSize());
+	const float a[3][3] = {
+		{ dx.x, dy.x, dz.x },
+		{ dx.y, dy.y, dz.y },
+		{ dx.z, dy.z, dz.z }
+	};
+	const float t[3] = { origin.x, origin.y, origin.z };
+
+	/* order the source axes the way partial pivoting would, so the shears
+	 * stay well-defined whatever the rotation */
+	int i0 = 0;
+	for (int i = 1; i < 3; ++i)
+		if (fabs(a[i][0]) > fabs(a[i0][0])) i0 = i;
+	int i1 = (i0 + 1) % 3, i2 = (i0 + 2) % 3;
+	if (fabs(a[i0][0] * a[i2][1] - a[i2][0] * a[i0][1]) > fabs(a[i0][0] * a[i1][1] - a[i1][0] * a[i0][1]))
+		std::swap(i1, i2);
+
+	/* p1 in terms of p0 and the destination y and z */
+	const float alpha = a[i1][0] / a[i0][0];
+	const float beta  = a[i1][1] - alpha * a[i0][1];
+	const float gamma = a[i1][2] - alpha * a[i0][2];
+	const float c1    = t[i1] - alpha * t[i0];
+
+	/* p2 in terms of p0, p1 and the destination z */
+	const float det    = a[i0][0] * a[i1][1] - a[i1][0] * a[i0][1];
+	const float lambda = (a[i2][0] * a[i1][1] - a[i1][0] * a[i2][1]) / det;
+	const float mu     = (a[i0][0] * a[i2][1] - a[i2][0] * a[i0][1]) / det;
+	const float nu     = a[i2][2] - lambda * a[i0][2] - mu * a[i1][2];
+	const float c2     = t[i2] - lambda * t[i0] - mu * t[i1];
+
+	/* the range of p0 and p1 the destination touches, with a line to spare */
+	int lo[2], hi[2];
+	const int axes[2] = { i0, i1 };
+	for (int i = 0; i < 2; ++i)
+	{
+		float min_p = t[axes[i]], max_p = t[axes[i]];
+		for (int j = 0; j < 3; ++j)
+		{
+			float d = a[axes[i]][j] * (igrid_size - 1);
+			if (d < 0) min_p += d;
+			else max_p += d;
+		}
+		lo[i] = std::max(int(floor(min_p)), 0);
+		hi[i] = std::min(int(ceil(max_p)) + 1, src_size - 1);
+	}
+	const int m0 = hi[0] - lo[0] + 1;
+	const int m1 = hi[1] - lo[1] + 1;
+	if (m0 < 2 || m1 < 2)
+	{
+		for (int z = 0; z < igrid_size; ++z)
+			for (int y = 0; y < igrid_size; ++y)
+				memset(&grid[getIndex(0, y, z)], 0, igrid_size);
+		setGridRowBits(igrid_size);
+		return;
+	}
+
+	if (shearFirst.size() < size_t(m0) * m1 * igrid_size)
+		shearFirst.resize(size_t(m0) * m1 * igrid_size);
+	if (shearSecond.size() < size_t(m0) * igrid_size * igrid_size)
+		shearSecond.resize(size_t(m0) * igrid_size * igrid_size);
+
+	const int step0 = toShearFixed(lambda);
+	const int step1 = toShearFixed(alpha);
+	const int step2 = toShearFixed(a[i0][0]);
+
+#pragma omp parallel for
+	for (int z = 0; z < igrid_size; ++z)
+	{
+		for (int v = 0; v < m1; ++v)
+		{
+			short *dst = &shearFirst[(size_t(z) * m1 + v) * m0];
+			int c[3];
+			c[i1] = lo[1] + v;
+			if (c[i1] < 1 || c[i1] > src_size - 2)
+			{
+				for (int u = 0; u < m0; ++u)
+					dst[u] = shear_outside;
+				continue;
+			}
+
+			int p = toShearFixed(mu * c[i1] + nu * z + c2 + lambda * lo[0]);
+			for (int u = 0; u < m0; ++u, p += step0)
+			{
+				/* source voxels outside [1, size - 2] are empty, just like in fillRow() */
+				c[i0] = lo[0] + u;
+				int ip = p >> 16;
+				if (c[i0] < 1 || c[i0] > src_size - 2 || unsigned(ip - 1) >= unsigned(src_size - 2))
 				{
-					grid[dstIndex] = 0;
+					dst[u] = shear_outside;
 					continue;
 				}
 
-				int srcIndex = voxelGrid.getIndex(ix, iy, iz);
+				c[i2] = ip;
+				short s0 = short(voxelGrid.pointSample(c[0], c[1], c[2]) << 8);
+				c[i2] = ip + 1;
+				short s1 = short(voxelGrid.pointSample(c[0], c[1], c[2]) << 8);
+				dst[u] = lerpShear(s0, s1, p);
+			}
+		}
+	}
 
-				if (voxelGrid.min_distances[srcIndex] > min_threshold)
+#pragma omp parallel for
+	for (int z = 0; z < igrid_size; ++z)
+	{
+		const short *src = &shearFirst[size_t(z) * m1 * m0];
+		for (int y = 0; y < igrid_size; ++y)
+		{
+			short *dst = &shearSecond[(size_t(z) * igrid_size + y) * m0];
+			int p = toShearFixed(beta * y + gamma * z + c1 - lo[1] + alpha * lo[0]);
+			for (int u = 0; u < m0; ++u, p += step1)
+			{
+				int ip = p >> 16;
+				if (unsigned(ip) >= unsigned(m1 - 1))
 				{
-					grid[dstIndex] = 0;
+					dst[u] = shear_outside;
 					continue;
 				}
-				if (voxelGrid.max_distances[srcIndex] < max_threshold)
+				dst[u] = lerpShear(src[ip * m0 + u], src[(ip + 1) * m0 + u], p);
+			}
+		}
+	}
+
+#pragma omp parallel for
+	for (int z = 0; z < igrid_size; ++z)
+	{
+		for (int y = 0; y < igrid_size; ++y)
+		{
+			const short *src = &shearSecond[(size_t(z) * igrid_size + y) * m0];
+			BYTE *dst = &grid[getIndex(0, y, z)];
+			int p = toShearFixed(a[i0][1] * y + a[i0][2] * z + t[i0] - lo[0]);
+			for (int x = 0; x < igrid_size; ++x, p += step2)
+			{
+				int ip = p >> 16;
+				if (unsigned(ip) >= unsigned(m0 - 1))
 				{
-					grid[dstIndex] = 255;
+					dst[x] = 0;
 					continue;
 				}
+				dst[x] = shearValues[lerpShear(src[ip], src[ip + 1], p) - SHRT_MIN];
+			}
+		}
+	}
+
+	setGridRowBits(igrid_size);
+}
+
+/* the row masks of the whole grid, for resamplers that don't work in blocks */
+void VoxelMesh::setGridRowBits(int igrid_size)
+{
+#pragma omp parallel for
+	for (int z = 0; z < igrid_size; ++z)
+	{
+		memset(&solidRows[getRowIndex(0, z)],  0, sizeof(UINT64) * getRowIndex(igrid_size, 0));
+		memset(&filledRows[getRowIndex(0, z)], 0, sizeof(UINT64) * getRowIndex(igrid_size, 0));
+		memset(&insideRows[getRowIndex(0, z)], 0, sizeof(UINT64) * getRowIndex(igrid_size, 0));
+		for (int y = 0; y < igrid_size; ++y)
+			for (int x0 = 0; x0 < igrid_size; x0 += VOXEL_MESH_BLOCK_SIZE)
+				setRowBits(x0, y, z, std::min(VOXEL_MESH_BLOCK_SIZE, igrid_size - x0));
+	}
+}
 
-				float size = getVoxelSize(voxelGrid.trilinearSample(px, py, pz));
-				grid[dstIndex] = BYTE(math::clamp(size, 0.0f, 1.0f) * 255);
+/* returns the value every voxel in the block resamples to, or -1 if the block
+ * needs to be resampled voxel by voxel. */
+int VoxelMesh::classifyBlock(int x0, int y0, int z0, int x1, int y1, int z1, int igrid_size, int dx_x, int dx_y, int dx_z, int min_threshold, int max_threshold) const
+{
+	/* bounding box of the source cells touched by the block. the rows are
+	 * accumulated in floating point and thus not quite affine, but each row
+	 * is stepped linearly, so its end-points bound it exactly. */
+	const int shift = voxelGrid.getFixedShift();
+	int min_x = INT_MAX, min_y = INT_MAX, min_z = INT_MAX;
+	int max_x = INT_MIN, max_y = INT_MIN, max_z = INT_MIN;
+	for (int z = z0; z < z1; ++z)
+	{
+		for (int y = y0; y < y1; ++y)
+		{
+			const int *start = &rowStarts[(z * igrid_size + y) * 3];
+			for (int i = 0; i < 2; ++i)
+			{
+				int x = i ? x1 - 1 : x0;
+				int ix = (start[0] + dx_x * x) >> shift;
+				int iy = (start[1] + dx_y * x) >> shift;
+				int iz = (start[2] + dx_z * x) >> shift;
+				min_x = std::min(min_x, ix); max_x = std::max(max_x, ix);
+				min_y = std::min(min_y, iy); max_y = std::max(max_y, iy);
+				min_z = std::min(min_z, iz); max_z = std::max(max_z, iz);
 			}
-			py += dy;
 		}
 	}
+	
+	/* voxels outside [1, size - 2] always end up empty */
+	const int upper = int(voxelGrid.getSize()) - 2;
+	bool inside =
+		min_x >= 1 && max_x <= upper &&
+		min_y >= 1 && max_y <= upper &&
+		min_z >= 1 && max_z <= upper;
+	
+	min_x = std::max(min_x, 1); max_x = std::min(max_x, upper);
+	min_y = std::max(min_y, 1); max_y = std::min(max_y, upper);
+	min_z = std::max(min_z, 1); max_z = std::min(max_z, upper);
+	if (min_x > max_x || min_y > max_y || min_z > max_z)
+		return 0;
+	
+	signed char min_dist, max_dist;
+	voxelGrid.getRangeMinMax(min_x, min_y, min_z, max_x, max_y, max_z, min_dist, max_dist);
+	
+	if (min_dist > min_threshold)
+		return 0;
+	if (inside && max_dist < max_threshold && max_dist <= min_threshold)
+		return 255;
+	return -1;
 }
 
-size_t VoxelMesh::updateDynamicVertexBuffer(renderer::VertexBuffer &vb)
+void VoxelMesh::fillRow(BYTE *dst, int count, int px_x, int px_y, int px_z, int dx_x, int dx_y, int dx_z, int min_threshold, int max_threshold) const
 {
-	int cubes = 0;
-	int culled = 0;
+	const int shift = voxelGrid.getFixedShift();
+	for (int x = 0; x < count; ++x)
+	{
+		int px = px_x;
+		int py = px_y;
+		int pz = px_z;
+
+		px_x += dx_x;
+		px_y += dx_y;
+		px_z += dx_z;
+
+		int ix = px >> shift;
+		int iy = py >> shift;
+		int iz = pz >> shift;
+
+		if (
+			ix <= 0 || ix >= int(voxelGrid.getSize()) - 1 ||
+			iy <= 0 || iy >= int(voxelGrid.getSize()) - 1 ||
+			iz <= 0 || iz >= int(voxelGrid.getSize()) - 1)
+		{
+			dst[x] = 0;
+			continue;
+		}
 
-	int igrid_min_size = int(floor(currSize) / 2);
-	int igrid_max_size = int(ceil(currSize) / 2);
-	int igrid_size = igrid_max_size + igrid_min_size;
+		int srcIndex = voxelGrid.getIndex(ix, iy, iz);
+
+		if (voxelGrid.min_distances[srcIndex] > min_threshold)
+		{
+			dst[x] = 0;
+			continue;
+		}
+		if (voxelGrid.max_distances[srcIndex] < max_threshold)
+		{
+			dst[x] = 255;
+			continue;
+		}
+
+		float size = getVoxelSize(voxelGrid.trilinearSample(px, py, pz));
+		dst[x] = BYTE(math::clamp(size, 0.0f, 1.0f) * 255);
+	}
+}
+
+/* handles the row in blocks of 8 voxels, returns the number of voxels written.
+ * the caller finishes off the remaining ones with the scalar code-path. */
+int VoxelMesh::fillRowSSE2(BYTE *dst, int count, int px_x, int px_y, int px_z, int dx_x, int dx_y, int dx_z, int min_threshold, int max_threshold) const
+{
+	const int size = int(voxelGrid.getSize());
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i upper = _mm_set1_epi32(size - 1);
+	const __m128i shift = _mm_cvtsi32_si128(voxelGrid.getFixedShift());
+	const __m128i safe = _mm_set1_epi32(1 << voxelGrid.getFixedShift());
+	const __m128i min_thres = _mm_set1_epi32(min_threshold);
+	const __m128i max_thres = _mm_set1_epi32(max_threshold);
+
+	/* getVoxelSize() constants, in the order of the scalar version. with SSE
+	 * scalar math the rows come out the same, the x87 can be a step off */
+	const __m128 dist_scale = _mm_set1_ps(1.0f / 128);
+	const __m128 size_scale = _mm_set1_ps(sqrtf(float(voxelGrid.getSize() * voxelGrid.getSize() * voxelGrid.getSize())) / 2);
+	const __m128 size_bias  = _mm_set1_ps(0.5f / voxelGrid.getSize());
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(255.0f);
+
+	__m128i px = _mm_setr_epi32(px_x, px_x + dx_x, px_x + dx_x * 2, px_x + dx_x * 3);
+	__m128i py = _mm_setr_epi32(px_y, px_y + dx_y, px_y + dx_y * 2, px_y + dx_y * 3);
+	__m128i pz = _mm_setr_epi32(px_z, px_z + dx_z, px_z + dx_z * 2, px_z + dx_z * 3);
+	const __m128i step_x = _mm_set1_epi32(dx_x * 4);
+	const __m128i step_y = _mm_set1_epi32(dx_y * 4);
+	const __m128i step_z = _mm_set1_epi32(dx_z * 4);
+
+	int x = 0;
+	for (; x + 8 <= count; x += 8)
+	{
+		__m128i res[2];
+		for (int half_block = 0; half_block < 2; ++half_block)
+		{
+			__m128i ix = _mm_sra_epi32(px, shift);
+			__m128i iy = _mm_sra_epi32(py, shift);
+			__m128i iz = _mm_sra_epi32(pz, shift);
+
+			__m128i inside = _mm_and_si128(
+				_mm_and_si128(
+					_mm_and_si128(_mm_cmpgt_epi32(ix, zero), _mm_cmplt_epi32(ix, upper)),
+					_mm_and_si128(_mm_cmpgt_epi32(iy, zero), _mm_cmplt_epi32(iy, upper))),
+				_mm_and_si128(_mm_cmpgt_epi32(iz, zero), _mm_cmplt_epi32(iz, upper)));
+
+			/* move the outside lanes somewhere safe so we can sample unconditionally */
+			__m128i sx = _mm_or_si128(_mm_and_si128(inside, px), _mm_andnot_si128(inside, safe));
+			__m128i sy = _mm_or_si128(_mm_and_si128(inside, py), _mm_andnot_si128(inside, safe));
+			__m128i sz = _mm_or_si128(_mm_and_si128(inside, pz), _mm_andnot_si128(inside, safe));
+
+			__m128i srcIndex = VoxelGrid::getIndex4(_mm_sra_epi32(sx, shift), _mm_sra_epi32(sy, shift), _mm_sra_epi32(sz, shift));
+			__m128i empty = _mm_or_si128(
+				_mm_andnot_si128(inside, _mm_set1_epi32(-1)),
+				_mm_cmpgt_epi32(VoxelGrid::gatherInt4(voxelGrid.min_distances, srcIndex), min_thres));
+			__m128i solid = _mm_andnot_si128(empty,
+				_mm_cmplt_epi32(VoxelGrid::gatherInt4(voxelGrid.max_distances, srcIndex), max_thres));
+			__m128i done = _mm_or_si128(empty, solid);
+
+			__m128i value = _mm_and_si128(solid, _mm_set1_epi32(255));
+			if (0xFFFF != _mm_movemask_epi8(done))
+			{
+				__m128 dist = voxelGrid.trilinearSample4(sx, sy, sz);
+				dist = _mm_mul_ps(_mm_mul_ps(dist, dist_scale), size_scale);
+				__m128 size = _mm_sub_ps(size_bias, _mm_mul_ps(dist, half));
+				size = _mm_max_ps(_mm_min_ps(size, one), _mm_setzero_ps());
+				__m128i sampled = _mm_cvttps_epi32(_mm_mul_ps(size, scale));
+				value = _mm_or_si128(value, _mm_andnot_si128(done, sampled));
+			}
+			res[half_block] = value;
+
+			px = _mm_add_epi32(px, step_x);
+			py = _mm_add_epi32(py, step_y);
+			pz = _mm_add_epi32(pz, step_z);
+		}
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(res[0], res[1]), zero);
+		_mm_storel_epi64((__m128i*)&dst[x], packed);
+	}
+	return x;
+}
+
+/* sets the solid/filled bits of count already resampled voxels. blocks are
+ * aligned to and smaller than a word, so they never straddle two words. */
+void VoxelMesh::setRowBits(int x0, int y, int z, int count)
+{
+	const BYTE *src = &grid[getIndex(x0, y, z)];
+	UINT64 solid = 0, filled = 0, inside = 0;
+	if (useSSE2 && 8 == count)
+	{
+		__m128i v = _mm_loadl_epi64((const __m128i*)src);
+		solid  = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(-1))) & 0xFF;
+		filled = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xFF;
+		inside = _mm_movemask_epi8(v) & 0xFF; // top bit set is > 127
+	}
+	else
+	{
+		for (int x = 0; x < count; ++x)
+		{
+			if (255 == src[x]) solid  |= UINT64(1) << x;
+			if (0 != src[x])   filled |= UINT64(1) << x;
+			if (127 < src[x])  inside |= UINT64(1) << x;
+		}
+	}
+	size_t index = getRowIndex(y, z) + (x0 >> 6);
+	solidRows[index]  |= solid  << (x0 & 63);
+	filledRows[index] |= filled << (x0 & 63);
+	insideRows[index] |= inside << (x0 & 63);
+}
+
+/* the faces of a row's voxels not covered by a solid neighbour, in the order
+ * of the instance neighbour bytes: +z, -z, +y, -y, +x, -x. the bits past the
+ * end of the row are always clear, so the x-borders take care of themselves,
+ * and nothing outside the y/z-borders is solid. */
+void VoxelMesh::getExposedBits(int word, int y, int z, int igrid_size, UINT64 exposed[6]) const
+{
+	const size_t row = getRowIndex(y, z) + word;
+	const int words = (igrid_size + 63) >> 6;
+	UINT64 left  = solidRows[row] << 1; // bit x: solid at x - 1
+	UINT64 right = solidRows[row] >> 1; // bit x: solid at x + 1
+	if (word > 0)         left  |= solidRows[row - 1] >> 63;
+	if (word < words - 1) right |= solidRows[row + 1] << 63;
+
+	exposed[0] = z < igrid_size - 1 ? ~solidRows[getRowIndex(y, z + 1) + word] : ~UINT64(0);
+	exposed[1] = z > 0 ?              ~solidRows[getRowIndex(y, z - 1) + word] : ~UINT64(0);
+	exposed[2] = y < igrid_size - 1 ? ~solidRows[getRowIndex(y + 1, z) + word] : ~UINT64(0);
+	exposed[3] = y > 0 ?              ~solidRows[getRowIndex(y - 1, z) + word] : ~UINT64(0);
+	exposed[4] = ~right;
+	exposed[5] = ~left;
+}
+
+namespace
+{
+	/* bits of a word for the x in [x0, x1) */
+	inline UINT64 getSpanBits(int word, int x0, int x1)
+	{
+		x0 = std::min(std::max(x0 - (word << 6), 0), 64);
+		x1 = std::min(std::max(x1 - (word << 6), 0), 64);
+		UINT64 below_x1 = x1 < 64 ? (UINT64(1) << x1) - 1 : ~UINT64(0);
+		UINT64 below_x0 = x0 < 64 ? (UINT64(1) << x0) - 1 : ~UINT64(0);
+		return below_x1 & ~below_x0;
+	}
+}
+
+/* filled voxels of a row with at least one face worth drawing, which ends up
+ * in faces. without a view, those are the ones not fully enclosed by solid
+ * voxels. with one, the faces also have to be front-facing, and the voxel
+ * inside the frustum. */
+UINT64 VoxelMesh::getVisibleBits(int word, int y, int z, int igrid_size, UINT64 faces[6]) const
+{
+	UINT64 filled = filledRows[getRowIndex(y, z) + word];
+	const RowView *row = view.enabled ? &rowViews[y + z * igrid_size] : NULL;
+	if (NULL != row) filled &= getSpanBits(word, row->spanStart, row->spanEnd) & ~getSpanBits(word, row->holeStart, row->holeEnd);
+	if (0 == filled) return 0;
+
+	getExposedBits(word, y, z, igrid_size, faces);
+	if (NULL != row)
+	{
+		for (int face = 0; face < 4; ++face)
+			if (0 == (row->frontYZ & (1 << face))) faces[face] = 0;
+		faces[4] &= getSpanBits(word, 0, row->frontPosX);
+		faces[5] &= getSpanBits(word, row->frontNegX, igrid_size);
+	}
+	return filled & (faces[0] | faces[1] | faces[2] | faces[3] | faces[4] | faces[5]);
+}
+
+void VoxelMesh::makeView(View &view, const math::Matrix4x4 *gridToClip)
+{
+	view.shellInner = 0.0f;
+	view.shellOuter = FLT_MAX;
+	view.enabled = NULL != gridToClip;
+	if (!view.enabled) return;
+	const math::Matrix4x4 &m = *gridToClip;
+	view.gridToClip = m;
+
+	/* clip-space is -w <= x, y <= w and 0 <= z <= w, so the planes are
+	 * sums and differences of the columns */
+	for (int i = 0; i < 4; ++i)
+	{
+		view.planes[0][i] = m.m[i][3] + m.m[i][0];
+		view.planes[1][i] = m.m[i][3] - m.m[i][0];
+		view.planes[2][i] = m.m[i][3] + m.m[i][1];
+		view.planes[3][i] = m.m[i][3] - m.m[i][1];
+		view.planes[4][i] = m.m[i][2];
+		view.planes[5][i] = m.m[i][3] - m.m[i][2];
+	}
+
+	/* the eye is where clip-space (0, 0, -1, 0) comes from. that's the
+	 * origin of a perspective view-space, or the backward direction of an
+	 * orthographic one. */
+	math::Matrix4x4 inv = m.inverse();
+	for (int i = 0; i < 4; ++i)
+		view.eye[i] = -inv.m[2][i];
+	if (view.eye[3] < 0.0f)
+		for (int i = 0; i < 4; ++i)
+			view.eye[i] = -view.eye[i];
+}
 
+/* the cube [x, x + 1]^3 is culled when it's fully outside one of the planes */
+bool VoxelMesh::isCubeInFrustum(const View &view, int x, int y, int z)
+{
+	for (int i = 0; i < 6; ++i)
+	{
+		const float *plane = view.planes[i];
+		float dist =
+			plane[0] * float(plane[0] > 0.0f ? x + 1 : x) +
+			plane[1] * float(plane[1] > 0.0f ? y + 1 : y) +
+			plane[2] * float(plane[2] > 0.0f ? z + 1 : z) +
+			plane[3];
+		if (dist < 0.0f) return false;
+	}
+	return true;
+}
+
+/* faces are tested at the voxel centre, which works for any cube size */
+bool VoxelMesh::isFrontFace(const View &view, int face, int x, int y, int z)
+{
+	const int axis = 2 - (face >> 1);
+	const int pos[3] = { x, y, z };
+	float side = view.eye[axis] - (float(pos[axis]) + 0.5f) * view.eye[3];
+	return (face & 1) ? side < 0.0f : side > 0.0f;
+}
+
+/* squared distance from the eye to the voxel centre, perspective views only */
+float VoxelMesh::getEyeDistance2(const View &view, int x, int y, int z)
+{
+	assert(view.eye[3] > 0.0f);
+	const float rcp = 1.0f / view.eye[3];
+	float dx = float(x) + 0.5f - view.eye[0] * rcp;
+	float dy = float(y) + 0.5f - view.eye[1] * rcp;
+	float dz = float(z) + 0.5f - view.eye[2] * rcp;
+	return dx * dx + dy * dy + dz * dz;
+}
+
+/* the cubes of a row closer than the square root of limit are [x0, x1), as
+ * the distance only grows away from the eye. like the frustum span, it's
+ * estimated too wide and trimmed with the exact test. */
+void VoxelMesh::getShellSpan(const View &view, float limit, int y, int z, int igrid_size, int &x0, int &x1)
+{
+	const float rcp = 1.0f / view.eye[3];
+	float dy = float(y) + 0.5f - view.eye[1] * rcp;
+	float dz = float(z) + 0.5f - view.eye[2] * rcp;
+	float rest = limit - (dy * dy + dz * dz);
+	x0 = x1 = 0;
+	if (rest <= 0.0f) return;
+
+	const float eye_x = math::clamp(view.eye[0] * rcp - 0.5f, -1.0f, float(igrid_size + 1));
+	const float half = std::min(sqrtf(rest), float(igrid_size + 1));
+	x0 = std::min(std::max(int(floor(eye_x - half)) - 1, 0), igrid_size);
+	x1 = std::min(std::max(int(floor(eye_x + half)) + 2, x0), igrid_size);
+	while (x0 < x1 && !(getEyeDistance2(view, x0, y, z) < limit)) x0++;
+	while (x1 > x0 && !(getEyeDistance2(view, x1 - 1, y, z) < limit)) x1--;
+}
 
-	BYTE *dst = (BYTE*)vb.lock(0, igrid_size * igrid_size * igrid_size * (4 * 3), 0);
+/* picks the slab order, and works out the RowView of every row. the estimates
+ * are made too wide and then trimmed with the exact per-cube tests, so the
+ * rows agree with isCubeInFrustum() and isFrontFace() exactly. */
+void VoxelMesh::prepareView(int igrid_size)
+{
+	if (!view.enabled)
+	{
+		slabAxis = 2;
+		reverseOrder[0] = reverseOrder[1] = reverseOrder[2] = false;
+		return;
+	}
+
+	/* from the eye towards the centre of the grid */
+	float forward[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		forward[i] = float(igrid_size) * 0.5f * view.eye[3] - view.eye[i];
+		reverseOrder[i] = forward[i] < 0.0f;
+	}
+	/* rows run along x, so the slabs can only go along y or z */
+	slabAxis = fabs(forward[1]) > fabs(forward[2]) ? 1 : 2;
+
+	rowViews.resize(igrid_size * igrid_size);
+	const float limit = float(igrid_size + 1);
 #pragma omp parallel for
 	for (int z = 0; z < igrid_size; ++z)
 	{
 		for (int y = 0; y < igrid_size; ++y)
 		{
-			for (int x = 0; x < igrid_size; ++x)
+			RowView &row = rowViews[y + z * igrid_size];
+
+			int x0 = 0, x1 = igrid_size;
+			for (int i = 0; i < 6; ++i)
 			{
-				int srcIndex = getIndex(x, y, z);
-				BYTE size = grid[srcIndex];
-
-				if (size == 0) continue;
-				if (
-					(x > 0 && x < igrid_size - 1) &&
-					(y > 0 && y < igrid_size - 1) &&
-					(z > 0 && z < igrid_size - 1)
-					)
+				const float *plane = view.planes[i];
+				float rest =
+					plane[1] * float(plane[1] > 0.0f ? y + 1 : y) +
+					plane[2] * float(plane[2] > 0.0f ? z + 1 : z) +
+					plane[3];
+				if (plane[0] > 0.0f)
 				{
-
-					if (
-						at(x-1, y, z) == 255 &&
-						at(x+1, y, z) == 255 &&
-						at(x, y-1, z) == 255 &&
-						at(x, y+1, z) == 255 &&
-						at(x, y, z-1) == 255 &&
-						at(x, y, z+1) == 255
-						)
-					{
-						culled++;
-						continue;
-					}
+					float bound = math::clamp(-(rest + plane[0]) / plane[0], -1.0f, limit);
+					x0 = std::max(x0, int(floor(bound)) - 1);
 				}
+				else if (plane[0] < 0.0f)
+				{
+					float bound = math::clamp(rest / -plane[0], -1.0f, limit);
+					x1 = std::min(x1, int(floor(bound)) + 2);
+				}
+				else if (rest < 0.0f)
+					x1 = x0;
+			}
+			x0 = std::min(std::max(x0, 0), igrid_size);
+			x1 = std::min(std::max(x1, x0), igrid_size);
+			while (x0 < x1 && !isCubeInFrustum(view, x0, y, z)) x0++;
+			while (x1 > x0 && !isCubeInFrustum(view, x1 - 1, y, z)) x1--;
+
+			/* the shell of a level of detail */
+			row.holeStart = row.holeEnd = 0;
+			if (view.shellOuter < FLT_MAX)
+			{
+				int outer0, outer1;
+				getShellSpan(view, view.shellOuter, y, z, igrid_size, outer0, outer1);
+				x0 = std::max(x0, outer0);
+				x1 = std::max(std::min(x1, outer1), x0);
+			}
+			if (view.shellInner > 0.0f)
+				getShellSpan(view, view.shellInner, y, z, igrid_size, row.holeStart, row.holeEnd);
+			row.spanStart = x0;
+			row.spanEnd = x1;
+
+			/* +x faces are front-facing up to the eye, -x faces beyond it */
+			int pos_x, neg_x;
+			if (view.eye[3] > 0.0f)
+			{
+				float eye_x = math::clamp(view.eye[0] / view.eye[3] - 0.5f, -1.0f, limit);
+				pos_x = std::min(std::max(int(floor(eye_x)) + 2, 0), igrid_size);
+				neg_x = std::min(std::max(int(floor(eye_x)) - 1, 0), igrid_size);
+			}
+			else
+			{
+				/* orthographic, the same for the whole row */
+				pos_x = isFrontFace(view, 4, 0, y, z) ? igrid_size : 0;
+				neg_x = isFrontFace(view, 5, 0, y, z) ? 0 : igrid_size;
+			}
+			while (pos_x > 0 && !isFrontFace(view, 4, pos_x - 1, y, z)) pos_x--;
+			while (neg_x < igrid_size && !isFrontFace(view, 5, neg_x, y, z)) neg_x++;
+			row.frontPosX = pos_x;
+			row.frontNegX = neg_x;
+
+			row.frontYZ = 0;
+			for (int face = 0; face < 4; ++face)
+				if (isFrontFace(view, face, 0, y, z)) row.frontYZ |= 1 << face;
+		}
+	}
+}
 
-				int sizes[6];
-				sizes[0] = z < igrid_size - 1 ? at(x, y, z+1) : 0; // +z
-				sizes[1] = z > 0 ?              at(x, y, z-1) : 0; // -z
+/* the y and z of a row, in the order the rows are emitted */
+void VoxelMesh::getSlabRow(int slab, int row, int igrid_size, int &y, int &z) const
+{
+	const int rowAxis = 3 - slabAxis;
+	if (reverseOrder[slabAxis]) slab = igrid_size - 1 - slab;
+	if (reverseOrder[rowAxis]) row = igrid_size - 1 - row;
+	y = 2 == slabAxis ? row : slab;
+	z = 2 == slabAxis ? slab : row;
+}
 
-				sizes[2] = y < igrid_size - 1 ? at(x, y+1, z) : 0; // +y
-				sizes[3] = y > 0 ?              at(x, y-1, z) : 0; // -y
+namespace
+{
+	inline int countBits(UINT64 v)
+	{
+		v = v - ((v >> 1) & 0x5555555555555555ULL);
+		v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+		v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+		return int((v * 0x0101010101010101ULL) >> 56);
+	}
+
+	inline int lowestBit(UINT64 v)
+	{
+		unsigned long index;
+		if (_BitScanForward(&index, (unsigned long)v)) return int(index);
+		_BitScanForward(&index, (unsigned long)(v >> 32));
+		return int(index) + 32;
+	}
 
-				sizes[4] = x < igrid_size - 1 ? at(x+1, y, z) : 0; // +x
-				sizes[5] = x > 0 ?              at(x-1, y, z) : 0; // -x
+	inline int highestBit(UINT64 v)
+	{
+		unsigned long index;
+		if (_BitScanReverse(&index, (unsigned long)(v >> 32))) return int(index) + 32;
+		_BitScanReverse(&index, (unsigned long)v);
+		return int(index);
+	}
+}
+
+size_t VoxelMesh::updateDynamicVertexBuffer(renderer::VertexBuffer &vb)
+{
+	int igrid_size = getGridSize(currSize);
+	size_t cubes = countInstances(igrid_size);
+	if (0 == cubes) return 0;
 
-#pragma omp critical
+	BYTE *base = (BYTE*)vb.lock(0, UINT(cubes * (4 * 3)), D3DLOCK_DISCARD);
+	writeInstances(base, igrid_size);
+	vb.unlock();
+	return cubes;
+}
+
+size_t VoxelMesh::countInstances(int igrid_size)
+{
+	int words = (igrid_size + 63) >> 6;
+	prepareView(igrid_size);
+
+	/* first pass: count the visible cubes of each slab */
+	slabOffsets.resize(igrid_size + 1);
+	slabOffsets[0] = 0;
+#pragma omp parallel for
+	for (int slab = 0; slab < igrid_size; ++slab)
+	{
+		int count = 0;
+		for (int i = 0; i < igrid_size; ++i)
+		{
+			int y, z;
+			getSlabRow(slab, i, igrid_size, y, z);
+			UINT64 faces[6];
+			for (int word = 0; word < words; ++word)
+				count += countBits(getVisibleBits(word, y, z, igrid_size, faces));
+		}
+		slabOffsets[slab + 1] = count;
+	}
+
+	/* exclusive prefix sum gives each slab its own range of the buffer */
+	for (int slab = 0; slab < igrid_size; ++slab)
+		slabOffsets[slab + 1] += slabOffsets[slab];
+
+	return slabOffsets[igrid_size];
+}
+
+/* second pass: each slab writes straight into its range of base, no locking
+ * needed. the slabs, the rows and the voxels of a row all come in view order. */
+void VoxelMesh::writeInstances(BYTE *base, int igrid_size) const
+{
+	int words = (igrid_size + 63) >> 6;
+	const bool reverse_x = reverseOrder[0];
+#pragma omp parallel for
+	for (int slab = 0; slab < igrid_size; ++slab)
+	{
+		BYTE *dst = base + slabOffsets[slab] * (4 * 3);
+		for (int i = 0; i < igrid_size; ++i)
+		{
+			int y, z;
+			getSlabRow(slab, i, igrid_size, y, z);
+			for (int w = 0; w < words; ++w)
+			{
+				int word = reverse_x ? words - 1 - w : w;
+				UINT64 faces[6];
+				UINT64 bits = getVisibleBits(word, y, z, igrid_size, faces);
+				while (0 != bits)
 				{
+					int bit = reverse_x ? highestBit(bits) : lowestBit(bits);
+					bits &= ~(UINT64(1) << bit);
+					int x = (word << 6) + bit;
 
-					*dst++ = x; *dst++ = y; *dst++ = z;
-					*dst++ = size;
+					*dst++ = x << currentLevel; *dst++ = y << currentLevel; *dst++ = z << currentLevel;
+					*dst++ = at(x, y, z);
 
 					/* neighbour info: 6 centers, 12 edges, 8 corners */
 					/* x = center, y = even edge, z = odd edge, w = */
@@ -223,47 +1198,355 @@ size_t VoxelMesh::updateDynamicVertexBuffer(renderer::VertexBuffer &vb)
 					/* tc6 - x y z w */
 
 					/* fill in centre faces */
-					*dst++ = sizes[0];
-					*dst++ = sizes[1];
-
-					*dst++ = sizes[2];
-					*dst++ = sizes[3];
-
-					*dst++ = sizes[4];
-					*dst++ = sizes[5];
-
-	#if 0
-					/* fill in edge faces */
-					// front layer (z+1)
-					*dst++ = (y < igrid_size - 1 && z < igrid_size - 1) ? grid[z+1][y+1][x] : 0; // +y +z
-					*dst++ = (y > 0              && z < igrid_size - 1) ? grid[z+1][y-1][x] : 0; // -y +z
-					*dst++ = (x < igrid_size - 1 && z < igrid_size - 1) ? grid[z+1][y][x+1] : 0; // +x +z
-					*dst++ = (x > 0              && z < igrid_size - 1) ? grid[z+1][y][x-1] : 0; // -x +z
-
-					// middle layer (z)
-					*dst++ = (x > 0              && y > 0             ) ? grid[z][y-1][x-1] : 0; // -x -y
-					*dst++ = (x < igrid_size - 1 && y > 0             ) ? grid[z][y-1][x+1] : 0; // +x -y
-					*dst++ = (x > 0              && y < igrid_size - 1) ? grid[z][y+1][x-1] : 0; // -x +y
-					*dst++ = (x < igrid_size - 1 && y < igrid_size - 1) ? grid[z][y+1][x+1] : 0; // +x +y
-
-					// bottom layer (z-1)
-					*dst++ = (y < igrid_size - 1 && z > 0             ) ? grid[z-1][y+1][x] : 0; // +y -z
-					*dst++ = (y > 0              && z > 0             ) ? grid[z-1][y-1][x] : 0; // -y -z
-					*dst++ = (x < igrid_size - 1 && z > 0             ) ? grid[z-1][y][x+1] : 0; // +x -z
-					*dst++ = (x > 0              && z > 0             ) ? grid[z-1][y][x-1] : 0; // -x -z
-	#endif
+					*dst++ = z < igrid_size - 1 ? at(x, y, z+1) : 0; // +z
+					*dst++ = z > 0 ?              at(x, y, z-1) : 0; // -z
+
+					*dst++ = y < igrid_size - 1 ? at(x, y+1, z) : 0; // +y
+					*dst++ = y > 0 ?              at(x, y-1, z) : 0; // -y
+
+					*dst++ = x < igrid_size - 1 ? at(x+1, y, z) : 0; // +x
+					*dst++ = x > 0 ?              at(x-1, y, z) : 0; // -x
+
+					/* the faces worth drawing */
+					BYTE face_bits = 0;
+					for (int face = 0; face < 6; ++face)
+						face_bits |= BYTE(((faces[face] >> bit) & 1) << face);
+					*dst++ = face_bits;
 
 					/* fill in corners (?) */
 
-					*dst++ = 128;
-					*dst++ = 128;
-					cubes++;
+					*dst++ = BYTE(128 + currentLevel);
 				}
 			}
 		}
+		assert(dst == base + slabOffsets[slab + 1] * (4 * 3));
+	}
+}
+
+bool VoxelMesh::isLevelOfDetailActive() const
+{
+	return lodLevels > 1 && view.enabled && view.eye[3] > 0.0f;
+}
+
+/* trades the grid and the row masks for those of a coarser level, calling it
+ * again trades them back */
+void VoxelMesh::swapLevel(int level)
+{
+	assert(level > 0 && level < lodLevels);
+	LodLevel &l = lod[level];
+	std::swap(grid, l.grid);
+	solidRows.swap(l.solidRows);
+	filledRows.swap(l.filledRows);
+	insideRows.swap(l.insideRows);
+}
+
+/* every voxel of the level is the mean of the 2x2x2 it covers in src, which
+ * is the finer level. voxels past the end of src count as empty. */
+void VoxelMesh::downsampleLevel(const BYTE *src, int src_size, int dst_size)
+{
+#pragma omp parallel for
+	for (int z = 0; z < dst_size; ++z)
+	{
+		for (int y = 0; y < dst_size; ++y)
+		{
+			BYTE *dst = &grid[getIndex(0, y, z)];
+			for (int x = 0; x < dst_size; ++x)
+			{
+				int sum = 0;
+				for (int i = 0; i < 8; ++i)
+				{
+					int sx = 2 * x + (i & 1), sy = 2 * y + ((i >> 1) & 1), sz = 2 * z + (i >> 2);
+					if (sx < src_size && sy < src_size && sz < src_size) sum += src[getIndex(sx, sy, sz)];
+				}
+				dst[x] = BYTE((sum + 4) >> 3);
+			}
+		}
+	}
+	setGridRowBits(dst_size);
+}
+
+/* the levels of detail, nearest first, into one staging buffer. each level
+ * gets the view scaled to its cubes, and in those units its shell is the
+ * same for all of them: out to the distance (plus a cube of overlap) for all
+ * but the last, and from half of it (less a cube) for all but the first. a
+ * surface point is then always within the shell of the level whose cube
+ * around it has its centre closer than the overlap. */
+size_t VoxelMesh::writeLevels(int buffer, int igrid_size)
+{
+	const View full = view;
+	const float inner = std::max(lodDistance * 0.5f - 1.0f, 0.0f);
+	const float outer = lodDistance + 1.0f;
+
+	size_t count = 0;
+	int level_size = igrid_size;
+	for (int level = 0; level < lodLevels; ++level)
+	{
+		if (level > 0)
+		{
+			const BYTE *src = grid;
+			swapLevel(level);
+			downsampleLevel(src, level_size, (level_size + 1) >> 1);
+			level_size = (level_size + 1) >> 1;
+		}
+
+		const float scale = float(1 << level);
+		math::Matrix4x4 gridToClip = math::Matrix4x4::scaling(Vector3(scale, scale, scale)) * full.gridToClip;
+		makeView(view, &gridToClip);
+		view.shellInner = level > 0 ? inner * inner : 0.0f;
+		view.shellOuter = level < lodLevels - 1 ? outer * outer : FLT_MAX;
+		currentLevel = level;
+
+		size_t level_count = countInstances(level_size);
+		if (staging[buffer].size() < (count + level_count) * (4 * 3))
+			staging[buffer].resize((count + level_count) * (4 * 3));
+		if (0 != level_count) writeInstances(&staging[buffer][count * (4 * 3)], level_size);
+		count += level_count;
+	}
+
+	for (int level = lodLevels - 1; level > 0; --level)
+		swapLevel(level);
+	view = full;
+	currentLevel = 0;
+	return count;
+}
+
+/* surface nets: the grid values are treated as a density with the surface at
+ * 127.5, every cell (2x2x2 voxels) the surface passes through gets one vertex,
+ * and every voxel edge it crosses one quad joining the four cells around it. */
+
+namespace
+{
+	const int cube_edges[12][2] =
+	{
+		{ 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, // x
+		{ 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 }, // y
+		{ 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }  // z
+	};
+
+	VoxelSurfaceVertex makeSurfaceVertex(int x, int y, int z, const int *values)
+	{
+		/* mean of the points where the surface crosses the cell edges */
+		float sum[3] = { 0.0f, 0.0f, 0.0f };
+		int crossings = 0;
+		for (int e = 0; e < 12; ++e)
+		{
+			int c0 = cube_edges[e][0];
+			int c1 = cube_edges[e][1];
+			if ((values[c0] > 127) == (values[c1] > 127)) continue;
+
+			float t = (127.5f - values[c0]) / (values[c1] - values[c0]);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float p0 = float((c0 >> axis) & 1);
+				float p1 = float((c1 >> axis) & 1);
+				sum[axis] += p0 + (p1 - p0) * t;
+			}
+			crossings++;
+		}
+		assert(crossings > 0);
+
+		/* the density grows inwards, so the normal is the negated gradient */
+		float gx = float((values[1] + values[3] + values[5] + values[7]) - (values[0] + values[2] + values[4] + values[6]));
+		float gy = float((values[2] + values[3] + values[6] + values[7]) - (values[0] + values[1] + values[4] + values[5]));
+		float gz = float((values[4] + values[5] + values[6] + values[7]) - (values[0] + values[1] + values[2] + values[3]));
+		float len = sqrtf(gx * gx + gy * gy + gz * gz);
+		float rcp = len > 0.0f ? -1.0f / len : 0.0f;
+
+		VoxelSurfaceVertex v;
+		v.x = x + sum[0] / crossings;
+		v.y = y + sum[1] / crossings;
+		v.z = z + sum[2] / crossings;
+		v.nx = gx * rcp;
+		v.ny = gy * rcp;
+		v.nz = gz * rcp;
+		return v;
+	}
+}
+
+/* bit i is set if corner i, at (x + (i & 1), y + ((i >> 1) & 1), z + (i >> 2)), is inside */
+int VoxelMesh::getCornerMask(int x, int y, int z, int igrid_size, int *values) const
+{
+	int mask = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		values[i] = sample(x + (i & 1), y + ((i >> 1) & 1), z + (i >> 2), igrid_size);
+		if (values[i] > 127) mask |= 1 << i;
+	}
+	return mask;
+}
+
+/* the inside-bits of a row, all clear outside of the grid */
+const UINT64 *VoxelMesh::getInsideRow(int y, int z, int igrid_size) const
+{
+	if (y < 0 || y >= igrid_size || z < 0 || z >= igrid_size)
+		return &emptyRow[0];
+	return &insideRows[getRowIndex(y, z)];
+}
+
+namespace
+{
+	/* bit i of the result is bit i - 1 of the row, so cell/edge c lines up with voxels c - 1 and c */
+	inline UINT64 shiftedWord(const UINT64 *row, int word)
+	{
+		UINT64 bits = row[word] << 1;
+		if (word > 0) bits |= row[word - 1] >> 63;
+		return bits;
+	}
+}
+
+/* everything is done a row at a time on the inside-bits from fillGrid(): a
+ * cell is on the surface where its corners are neither all inside nor all
+ * outside, and an edge where its two ends differ. cells and x-edges start at
+ * -1, so bit c of those rows stands for x = c - 1. */
+void VoxelMesh::extractSurface(int igrid_size)
+{
+	const int cells = igrid_size + 1;
+	const int words = (cells + 63) >> 6;
+	assert(words <= int(rowWords));
+	surfaceCells.resize(size_t(cells) * cells * cells);
+	cellRows.resize(size_t(cells) * cells * words);
+
+	/* first pass: find the cells the surface passes through, and count them per slab */
+	slabOffsets.resize(cells + 1);
+	slabOffsets[0] = 0;
+#pragma omp parallel for
+	for (int z = -1; z < igrid_size; ++z)
+	{
+		int count = 0;
+		for (int y = -1; y < igrid_size; ++y)
+		{
+			const UINT64 *r00 = getInsideRow(y,     z,     igrid_size);
+			const UINT64 *r10 = getInsideRow(y + 1, z,     igrid_size);
+			const UINT64 *r01 = getInsideRow(y,     z + 1, igrid_size);
+			const UINT64 *r11 = getInsideRow(y + 1, z + 1, igrid_size);
+			UINT64 *dst = &cellRows[(size_t(z + 1) * cells + (y + 1)) * words];
+			UINT64 any_carry = 0, all_carry = 0;
+			for (int word = 0; word < words; ++word)
+			{
+				UINT64 any = r00[word] | r10[word] | r01[word] | r11[word];
+				UINT64 all = r00[word] & r10[word] & r01[word] & r11[word];
+				UINT64 any_shifted = (any << 1) | any_carry;
+				UINT64 all_shifted = (all << 1) | all_carry;
+				any_carry = any >> 63;
+				all_carry = all >> 63;
+				dst[word] = (any | any_shifted) & ~(all & all_shifted);
+				count += countBits(dst[word]);
+			}
+		}
+		slabOffsets[z + 2] = count;
+	}
+	for (int z = 0; z < cells; ++z)
+		slabOffsets[z + 1] += slabOffsets[z];
+
+	surfaceVertices.resize(slabOffsets[cells]);
+	surfaceIndices.clear();
+	if (surfaceVertices.empty()) return;
+
+	/* second pass: the vertices. the cell -> vertex table is shared by all
+	 * slabs, so the quads on slab borders pick up their neighbours' vertices. */
+#pragma omp parallel for
+	for (int z = -1; z < igrid_size; ++z)
+	{
+		int index = slabOffsets[z + 1];
+		int values[8];
+		for (int y = -1; y < igrid_size; ++y)
+		{
+			const UINT64 *src = &cellRows[(size_t(z + 1) * cells + (y + 1)) * words];
+			for (int word = 0; word < words; ++word)
+			{
+				for (UINT64 bits = src[word]; 0 != bits; bits &= bits - 1)
+				{
+					int x = (word << 6) + lowestBit(bits) - 1;
+					getCornerMask(x, y, z, igrid_size, values);
+					surfaceCells[getSurfaceCell(x, y, z, igrid_size)] = index;
+					surfaceVertices[index++] = makeSurfaceVertex(x, y, z, values);
+				}
+			}
+		}
+		assert(index == slabOffsets[z + 2]);
+	}
+
+	/* third pass: a quad for every crossing edge. x-edges need y, z >= 0,
+	 * y-edges x, z >= 0 and z-edges x, y >= 0, to have cells all around. */
+	quadOffsets.resize(cells + 1);
+	quadOffsets[0] = 0;
+#pragma omp parallel for
+	for (int z = -1; z < igrid_size; ++z)
+	{
+		int count = 0;
+		for (int y = -1; y < igrid_size; ++y)
+		{
+			const UINT64 *row = getInsideRow(y, z, igrid_size);
+			const UINT64 *row_y = getInsideRow(y + 1, z, igrid_size);
+			const UINT64 *row_z = getInsideRow(y, z + 1, igrid_size);
+			for (int word = 0; word < words; ++word)
+			{
+				if (y >= 0 && z >= 0) count += countBits(row[word] ^ shiftedWord(row, word));
+				if (z >= 0)           count += countBits(row[word] ^ row_y[word]);
+				if (y >= 0)           count += countBits(row[word] ^ row_z[word]);
+			}
+		}
+		quadOffsets[z + 2] = count;
+	}
+	for (int z = 0; z < cells; ++z)
+		quadOffsets[z + 1] += quadOffsets[z];
+
+	surfaceIndices.resize(quadOffsets[cells] * 6);
+	if (surfaceIndices.empty()) return;
+
+#pragma omp parallel for
+	for (int z = -1; z < igrid_size; ++z)
+	{
+		unsigned int *dst = &surfaceIndices[0] + quadOffsets[z + 1] * 6;
+		for (int y = -1; y < igrid_size; ++y)
+		{
+			const UINT64 *row = getInsideRow(y, z, igrid_size);
+			const UINT64 *row_y = getInsideRow(y + 1, z, igrid_size);
+			const UINT64 *row_z = getInsideRow(y, z + 1, igrid_size);
+			for (int word = 0; word < words; ++word)
+			{
+				UINT64 edges[3] = { 0, 0, 0 };
+				if (y >= 0 && z >= 0) edges[0] = row[word] ^ shiftedWord(row, word);
+				if (z >= 0)           edges[1] = row[word] ^ row_y[word];
+				if (y >= 0)           edges[2] = row[word] ^ row_z[word];
+
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					for (UINT64 bits = edges[axis]; 0 != bits; bits &= bits - 1)
+					{
+						int bit = lowestBit(bits);
+						int x = (word << 6) + bit - (0 == axis ? 1 : 0);
+						bool inside = 0 != ((0 == axis ? shiftedWord(row, word) : row[word]) & (UINT64(1) << bit));
+
+						/* the four cells around the edge, going around it in the plane of the other two axes */
+						int b = (axis + 1) % 3;
+						int c = (axis + 2) % 3;
+						unsigned int q[4];
+						for (int i = 0; i < 4; ++i)
+						{
+							int p[3] = { x, y, z };
+							if (0 == i || 3 == i) p[b]--;
+							if (i < 2) p[c]--;
+							q[i] = surfaceCells[getSurfaceCell(p[0], p[1], p[2], igrid_size)];
+						}
+
+						/* clockwise seen from the outside */
+						if (inside)
+						{
+							*dst++ = q[0]; *dst++ = q[1]; *dst++ = q[2];
+							*dst++ = q[0]; *dst++ = q[2]; *dst++ = q[3];
+						}
+						else
+						{
+							*dst++ = q[0]; *dst++ = q[2]; *dst++ = q[1];
+							*dst++ = q[0]; *dst++ = q[3]; *dst++ = q[2];
+						}
+					}
+				}
+			}
+		}
+		assert(dst == &surfaceIndices[0] + quadOffsets[z + 2] * 6);
 	}
-	vb.unlock();
-	return cubes;
 }
 
 void engine::VoxelMesh::setupVoxel(renderer::Device &device)
@@ -8,21 +8,101 @@
 #include "../renderer/vertexbuffer.h"
 #include "../renderer/indexbuffer.h"
 #include "../engine/effect.h"
+#include "../core/cpu.h"
+
+#define VOXEL_MESH_BLOCK_SIZE 8
+#define VOXEL_MESH_STAGING_BUFFERS 3
+#define VOXEL_MESH_MAX_LOD_LEVELS 4
 
 namespace engine
 {
+	/* surface-nets output, in the same grid-space as the cube instances */
+	struct VoxelSurfaceVertex
+	{
+		float x, y, z;
+		float nx, ny, nz;
+	};
+
 	class VoxelMesh
 	{
 	public:
+		enum OutputMode
+		{
+			OUTPUT_CUBES,
+			OUTPUT_SURFACE
+		};
+
+		enum Resampler
+		{
+			RESAMPLE_DIRECT,
+			RESAMPLE_SHEAR
+		};
+
 		VoxelMesh(renderer::Device &device, engine::Effect *effect, const VoxelGrid &voxelGrid, size_t maxSize) :
 		  effect(effect),
 		  voxelGrid(voxelGrid),
 		  maxSize(maxSize),
 		  currSize(float(maxSize)),
-		  vbSelector(0)
+		  cubes(0),
+		  vbSelector(0),
+		  useSSE2(core::cpu::hasSSE2()),
+		  rowWords((maxSize + 64) / 64),
+		  workerThread(NULL),
+		  workerWake(NULL),
+		  outputMode(OUTPUT_CUBES),
+		  headless(false),
+		  slabAxis(2),
+		  resampler(RESAMPLE_DIRECT),
+		  reuseAngle(0.0f),
+		  hasPrevious(false),
+		  updateCount(0),
+		  skippedCount(0),
+		  reusedCount(0),
+		  lodLevels(1),
+		  lodDistance(64.0f),
+		  currentLevel(0)
 		{
+			view.enabled = false;
 			setupVoxel(device);
-			grid = new BYTE[maxSize * maxSize * maxSize];
+			allocateGrid();
+		}
+
+		/* headless, for tools and benchmarks: there's no device and no vertex
+		 * buffers, update() leaves the instances in memory (see getInstances()) */
+		VoxelMesh(const VoxelGrid &voxelGrid, size_t maxSize) :
+		  effect(NULL),
+		  voxelGrid(voxelGrid),
+		  maxSize(maxSize),
+		  currSize(float(maxSize)),
+		  cubes(0),
+		  vbSelector(0),
+		  useSSE2(core::cpu::hasSSE2()),
+		  rowWords((maxSize + 64) / 64),
+		  workerThread(NULL),
+		  workerWake(NULL),
+		  outputMode(OUTPUT_CUBES),
+		  headless(true),
+		  slabAxis(2),
+		  resampler(RESAMPLE_DIRECT),
+		  reuseAngle(0.0f),
+		  hasPrevious(false),
+		  updateCount(0),
+		  skippedCount(0),
+		  reusedCount(0),
+		  lodLevels(1),
+		  lodDistance(64.0f),
+		  currentLevel(0)
+		{
+			view.enabled = false;
+			allocateGrid();
+		}
+
+		~VoxelMesh()
+		{
+			setAsync(false);
+			/* writeLevels() trades the levels back before it returns, so with the
+			 * worker stopped this is the buffer allocateGrid() made */
+			delete[] grid;
 		}
 		
 		void setSize(float size)
@@ -32,11 +112,99 @@ namespace engine
 		}
 
 		float getSize() const { return currSize; }
+
+		/* the SSE2 resampler is picked at runtime, this allows forcing the scalar path */
+		void setSSE2Enabled(bool enable) { useSSE2 = enable && core::cpu::hasSSE2(); }
+		bool getSSE2Enabled() const { return useSSE2; }
+
+		/* RESAMPLE_SHEAR splits the rotation into three shears along the source
+		 * axes, each a 1D resample along rows, instead of sampling the source
+		 * trilinearly at rotated positions. the result differs slightly, since
+		 * every pass interpolates on its own. it takes two temporary volumes,
+		 * and doesn't skip empty or solid blocks like the direct path does. */
+		void setResampler(Resampler resampler);
+		Resampler getResampler() const { return resampler; }
 		
+		/* in async mode, fillGrid() and the instance extraction run on a worker
+		 * thread into one of three staging buffers. update() then only uploads
+		 * the newest finished buffer and hands the worker the next transform,
+		 * so what gets drawn lags one update behind. */
+		void setAsync(bool enable);
+		bool getAsync() const { return NULL != workerThread; }
+
+		/* OUTPUT_SURFACE makes update() extract the iso-surface of the
+		 * resampled grid as an indexed triangle mesh (surface nets) instead of
+		 * the cube instances. the mesh stays on the CPU, draw() ignores it.
+		 * surface output always runs synchronously. */
+		void setOutputMode(OutputMode mode);
+		OutputMode getOutputMode() const { return outputMode; }
+
+		const std::vector<VoxelSurfaceVertex> &getSurfaceVertices() const { return surfaceVertices; }
+		const std::vector<unsigned int> &getSurfaceIndices() const { return surfaceIndices; }
+
 		void update(const math::Matrix4x4 &mrot);
+
+		/* like update(mrot), but only emits the cubes that intersect the view
+		 * frustum and show a front-facing, uncovered face, in front-to-back
+		 * order. gridToClip takes the instance grid coordinates (a cube spans
+		 * x to x + 1) to clip-space, like the shader does. the third instance
+		 * byte of every cube then holds the faces worth drawing, one bit per
+		 * face in the order of the neighbour bytes: +z, -z, +y, -y, +x, -x. */
+		void update(const math::Matrix4x4 &mrot, const math::Matrix4x4 &gridToClip);
 		void draw(renderer::Device &device) const;
+
+		/* update() skips the resampling when the transform and size are the
+		 * same as for the last one. with a non-zero reuse angle (in radians),
+		 * rotations closer than that to the last resampled one keep the old
+		 * grid as well, at the price of lagging by up to that angle. mrot is
+		 * expected to be a pure rotation for this. */
+		void setReuseAngle(float angle) { reuseAngle = angle; }
+		float getReuseAngle() const { return reuseAngle; }
+
+		/* distance-based level of detail, for updates with a perspective view.
+		 * the cubes within distance (in cubes) of the eye come at the full
+		 * resolution, the ones out to twice that at half the resolution with
+		 * cubes twice the size, and so on, the last level taking everything
+		 * further out. the instance count then depends on the distance and the
+		 * surface, not on the grid size. neighbouring levels overlap by a cube
+		 * of the coarser one, so there are no cracks, just a little overdraw.
+		 * one level turns it off, the surface output ignores it. */
+		void setLevelOfDetail(int levels, float distance);
+		int getLevelOfDetailLevels() const { return lodLevels; }
+		float getLevelOfDetailDistance() const { return lodDistance; }
+
+		/* forces the next update() to resample, say after editing the VoxelGrid */
+		void invalidate() { hasPrevious = false; }
+
+		size_t getUpdateCount() const { return updateCount; }
+		size_t getSkippedCount() const { return skippedCount; }   // unchanged input
+		size_t getReusedCount() const { return reusedCount; }     // within the reuse angle
+		void resetCounters() { updateCount = skippedCount = reusedCount = 0; }
+
+		/* the 12-byte instances of the last update(), headless only.
+		 * in order: x, y, z, value, the values of the six neighbours, the
+		 * face bits (see update()) and 128 plus the level of detail. the cube
+		 * of level l spans 2^l from x, y, z, which are always in the cubes of
+		 * the full resolution, and its neighbours are those of its level. */
+		const BYTE *getInstances() const
+		{
+			assert(headless);
+			return 0 != cubes ? &staging[vbSelector][0] : NULL;
+		}
+		size_t getInstanceCount() const { return cubes; }
+
+		/* a voxel of the grid the last update() resampled, headless only */
+		unsigned char getVoxel(int x, int y, int z) const
+		{
+			assert(headless);
+			return at(x, y, z);
+		}
 		
 	private:
+		/* not copyable, the grid is owned and the worker holds this */
+		VoxelMesh(const VoxelMesh &);
+		VoxelMesh &operator=(const VoxelMesh &);
+
 		unsigned char at(int x, int y, int z) const
 		{
 			return grid[getIndex(x, y, z)];
@@ -48,9 +216,9 @@ namespace engine
 			assert(y >= 0);
 			assert(z >= 0);
 			
-			assert(x < currSize);
-			assert(y < currSize);
-			assert(z < currSize);
+			assert(x < int(maxSize));
+			assert(y < int(maxSize));
+			assert(z < int(maxSize));
 			
 			return
 				x + 
@@ -58,13 +226,109 @@ namespace engine
 				z * maxSize * maxSize;
 		}
 		
+		size_t getRowIndex(int y, int z) const
+		{
+			return (y + z * maxSize) * rowWords;
+		}
+
+		void setRowBits(int x0, int y, int z, int count);
+		const UINT64 *getInsideRow(int y, int z, int igrid_size) const;
+		void getExposedBits(int word, int y, int z, int igrid_size, UINT64 exposed[6]) const;
+		UINT64 getVisibleBits(int word, int y, int z, int igrid_size, UINT64 faces[6]) const;
 		size_t updateDynamicVertexBuffer(renderer::VertexBuffer &vb);
-		
-		void fillGrid(math::Matrix4x4 mrot);
+		size_t countInstances(int igrid_size);
+		void writeInstances(BYTE *base, int igrid_size) const;
+		bool isLevelOfDetailActive() const;
+		size_t writeLevels(int buffer, int igrid_size);
+		void swapLevel(int level);
+		void downsampleLevel(const BYTE *src, int src_size, int dst_size);
+
+		static int getGridSize(float size)
+		{
+			return int(ceil(size) / 2) + int(floor(size) / 2);
+		}
+
+		void fillGrid(math::Matrix4x4 mrot, float size);
+		void fillGridShear(const math::Vector3 &dx, const math::Vector3 &dy, const math::Vector3 &dz, const math::Vector3 &origin, int igrid_size);
+		void setGridRowBits(int igrid_size);
+		int classifyBlock(int x0, int y0, int z0, int x1, int y1, int z1, int igrid_size, int dx_x, int dx_y, int dx_z, int min_threshold, int max_threshold) const;
+		void fillRow(BYTE *dst, int count, int px_x, int px_y, int px_z, int dx_x, int dx_y, int dx_z, int min_threshold, int max_threshold) const;
+		int fillRowSSE2(BYTE *dst, int count, int px_x, int px_y, int px_z, int dx_x, int dx_y, int dx_z, int min_threshold, int max_threshold) const;
 		void setupVoxel(renderer::Device &device);
+		void allocateGrid()
+		{
+			grid = new BYTE[maxSize * maxSize * maxSize];
+			solidRows.resize(maxSize * maxSize * rowWords);
+			filledRows.resize(maxSize * maxSize * rowWords);
+			insideRows.resize(maxSize * maxSize * rowWords);
+			emptyRow.resize(rowWords);
+		}
 		float getVoxelSize(float dist) const;
+
+		void extractSurface(int igrid_size);
+		int getCornerMask(int x, int y, int z, int igrid_size, int *values) const;
+
+		size_t getSurfaceCell(int x, int y, int z, int igrid_size) const
+		{
+			/* cells start at -1, so the surface gets closed off at the borders */
+			const size_t cells = igrid_size + 1;
+			return (x + 1) + ((y + 1) + (z + 1) * cells) * cells;
+		}
+
+		unsigned char sample(int x, int y, int z, int igrid_size) const
+		{
+			if (
+				x < 0 || x >= igrid_size ||
+				y < 0 || y >= igrid_size ||
+				z < 0 || z >= igrid_size)
+				return 0;
+			return at(x, y, z);
+		}
+
+		bool reusePrevious(const math::Matrix4x4 &mrot);
+		void updateView(const math::Matrix4x4 &mrot, const math::Matrix4x4 *gridToClip);
+
+		/* the frustum planes and the eye of a gridToClip matrix. the eye is
+		 * homogeneous, with w = 0 for orthographic projections. a level of
+		 * detail only keeps the cubes with centres at squared distances from
+		 * the eye in [shellInner, shellOuter). */
+		struct View
+		{
+			bool enabled;
+			math::Matrix4x4 gridToClip;
+			float planes[6][4];
+			float eye[4];
+			float shellInner, shellOuter;
+		};
+
+		/* what the view makes of a single row of the grid: the cubes in
+		 * [spanStart, spanEnd) are in the frustum and not past the shell, the
+		 * ones in [holeStart, holeEnd) are inside it, the +x faces are front-
+		 * facing left of frontPosX, the -x faces from frontNegX on, and
+		 * frontYZ has the bits of the front-facing y and z faces */
+		struct RowView
+		{
+			int spanStart, spanEnd;
+			int holeStart, holeEnd;
+			int frontPosX, frontNegX;
+			int frontYZ;
+		};
+
+		static void makeView(View &view, const math::Matrix4x4 *gridToClip);
+		static bool isCubeInFrustum(const View &view, int x, int y, int z);
+		static bool isFrontFace(const View &view, int face, int x, int y, int z);
+		static float getEyeDistance2(const View &view, int x, int y, int z);
+		static void getShellSpan(const View &view, float limit, int y, int z, int igrid_size, int &x0, int &x1);
+		void prepareView(int igrid_size);
+		void getSlabRow(int slab, int row, int igrid_size, int &y, int &z) const;
+
+		static DWORD WINAPI workerProc(LPVOID param);
+		void workerLoop();
+		void uploadStaging(int buffer);
+		size_t writeStaging(int buffer, int igrid_size);
 		
 		BYTE *grid;
+		std::vector<int> rowStarts;
 		const VoxelGrid &voxelGrid;
 		size_t maxSize;
 		float currSize;
@@ -72,10 +336,90 @@ namespace engine
 		renderer::VertexDeclaration vertex_decl;
 		renderer::VertexBuffer dynamic_vb;
 		size_t cubes;
+		std::vector<int> slabOffsets;
 		renderer::VertexBuffer static_vb;
 		renderer::IndexBuffer ib;
 		engine::Effect *effect;
-		int vbSelector;
+		int vbSelector; // staging buffer owned by the render thread
+		bool useSSE2;
+
+		/* one bit per voxel, 64 voxels per word: solid (255), filled (non-zero)
+		 * and inside (> 127). built by fillGrid(), so the culling and surface
+		 * extraction work on whole rows at a time. there is always room for
+		 * one more bit than voxels, the surface cells start at -1. */
+		size_t rowWords;
+		std::vector<UINT64> solidRows;
+		std::vector<UINT64> filledRows;
+		std::vector<UINT64> insideRows;
+		std::vector<UINT64> emptyRow;
+
+		/* async mode: the worker fills stagingWriting, and swaps it with
+		 * stagingReady when done. update() swaps stagingReady with vbSelector
+		 * whenever stagingFresh is set. all of it is guarded by workerLock. */
+		HANDLE workerThread;
+		HANDLE workerWake;
+		CRITICAL_SECTION workerLock;
+		bool workerQuit;
+		bool pendingRequest;
+		bool pendingFill;
+		View pendingView;
+		math::Matrix4x4 pendingTransform;
+		float pendingSize;
+		std::vector<BYTE> staging[VOXEL_MESH_STAGING_BUFFERS];
+		size_t stagingCubes[VOXEL_MESH_STAGING_BUFFERS];
+		int stagingWriting;
+		int stagingReady;
+		bool stagingFresh;
+
+		OutputMode outputMode;
+		std::vector<int> surfaceCells;
+		std::vector<UINT64> cellRows;
+		std::vector<int> quadOffsets;
+		std::vector<VoxelSurfaceVertex> surfaceVertices;
+		std::vector<unsigned int> surfaceIndices;
+
+		bool headless;
+
+		/* view culling and ordering of the instances. the slabs go along
+		 * slabAxis (y or z), and reverseOrder flips the order along an axis,
+		 * so the cubes come out roughly front-to-back */
+		View view;
+		std::vector<RowView> rowViews;
+		int slabAxis;
+		bool reverseOrder[3];
+
+		/* RESAMPLE_SHEAR: the two intermediate volumes, in 8.8 fixed-point
+		 * distances, and the voxel value of every such distance */
+		Resampler resampler;
+		std::vector<short> shearFirst;
+		std::vector<short> shearSecond;
+		std::vector<BYTE> shearValues;
+
+		/* the transform and size the current grid was made from */
+		float reuseAngle;
+		bool hasPrevious;
+		math::Matrix4x4 previousTransform;
+		float previousSize;
+		size_t updateCount;
+		size_t skippedCount;
+		size_t reusedCount;
+
+		/* the coarser levels of detail, downsampled from the finer ones. they
+		 * have the strides of the full grid, so swapLevel() can trade them for
+		 * grid and the row masks, and all of the extraction works on them as
+		 * is. level 0 is the grid itself, its slot is unused. */
+		struct LodLevel
+		{
+			std::vector<BYTE> storage;
+			BYTE *grid;
+			std::vector<UINT64> solidRows;
+			std::vector<UINT64> filledRows;
+			std::vector<UINT64> insideRows;
+		};
+		int lodLevels;
+		float lodDistance;
+		int currentLevel;
+		LodLevel lod[VOXEL_MESH_MAX_LOD_LEVELS];
 	};
 }
 
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "vector3.h"
+
+namespace math
+{
+	/* the point at t of the uniform cubic B-spline segment between knots k1 and k2 */
+	inline Vector3 evalBSpline(const Vector3 &k0, const Vector3 &k1, const Vector3 &k2, const Vector3 &k3, float t)
+	{
+		float it = 1.0f - t;
+		float b0 = it * it * it / 6.f;
+		float b1 = (3.f * t * t * t - 6.f * t * t + 4.f) / 6.f;
+		float b2 = (-3.f * t * t * t + 3.f * t * t + 3.f * t + 1) / 6.f;
+		float b3 = t * t * t / 6.f;
+		return k0 * b0 + k1 * b1 + k2 * b2 + k3 * b3;
+	}
+
+	/* arc length along a closed loop of uniform cubic B-spline segments, segment
+	 * c running from knot c + 1 to c + 2 as with UniformBSpline. a place on the
+	 * loop is u = segment + t, and the length is tabled at a fixed number of
+	 * samples per segment, so going from a distance along the loop to u is a
+	 * binary search and a lerp. points evenly spaced along the curve are
+	 * getParameter() of evenly spaced distances. */
+	class ArcLengthTable
+	{
+	public:
+		ArcLengthTable() : samples(0) {}
+
+		void build(const Vector3 *knots, int count, int samples = 16)
+		{
+			this->knots.assign(knots, knots + count);
+			this->samples = samples;
+			lengths.resize(count * samples + 1);
+			/* simpson on the speed, which agrees with getParameter() */
+			const float h = 1.0f / samples;
+			lengths[0] = 0.0f;
+			float prev = getSpeed(0.0f);
+			for (int i = 1; i <= count * samples; ++i)
+			{
+				float speed = getSpeed(i * h);
+				lengths[i] = lengths[i - 1] + h * (prev + 4.0f * getSpeed((i - 0.5f) * h) + speed) / 6.0f;
+				prev = speed;
+			}
+		}
+
+		int getCount() const { return int(knots.size()); }
+		float getLength() const { return lengths.back(); }
+
+		/* the distance along the loop to u, for u in [0, count] */
+		float getLength(float u) const
+		{
+			float j = u * samples;
+			int i = std::max(0, std::min(int(j), int(lengths.size()) - 2));
+			return lengths[i] + (lengths[i + 1] - lengths[i]) * (j - i);
+		}
+
+		/* u at distance s along the loop, s going around it any number of times */
+		float getParameter(float s) const
+		{
+			const float total = getLength();
+			if (!(total > 0.0f)) return 0.0f;
+			s = fmodf(s, total);
+			if (s < 0.0f) s += total;
+
+			int i = int(std::upper_bound(lengths.begin(), lengths.end(), s) - lengths.begin()) - 1;
+			i = std::max(0, std::min(i, int(lengths.size()) - 2));
+			float chord = lengths[i + 1] - lengths[i];
+			float f = chord > 0.0f ? (s - lengths[i]) / chord : 0.0f;
+
+			/* the lerp is off where the speed changes along the chord, a newton
+			 * step on the length from the sample (simpson) fixes most of that */
+			float u0 = float(i) / samples, u = (i + f) / samples;
+			float speed = getSpeed(u);
+			if (speed > 0.0f)
+			{
+				float length = lengths[i] + (u - u0) * (getSpeed(u0) + 4.0f * getSpeed(0.5f * (u0 + u)) + speed) / 6.0f;
+				u = std::max(u0, std::min(float(i + 1) / samples, u - (length - s) / speed));
+			}
+			return u;
+		}
+
+		Vector3 getPoint(float u) const
+		{
+			const int count = getCount();
+			float segment = floorf(u);
+			int c = int(segment) % count;
+			if (c < 0) c += count;
+			return evalBSpline(knots[c], knots[(c + 1) % count], knots[(c + 2) % count], knots[(c + 3) % count], u - segment);
+		}
+
+		/* how fast the curve goes at u, the length of its derivative */
+		float getSpeed(float u) const
+		{
+			const int count = getCount();
+			float segment = floorf(u);
+			int c = int(segment) % count;
+			if (c < 0) c += count;
+			float t = u - segment, it = 1.0f - t;
+			Vector3 d =
+				knots[c] * (-0.5f * it * it) +
+				knots[(c + 1) % count] * (1.5f * t * t - 2.0f * t) +
+				knots[(c + 2) % count] * (-1.5f * t * t + t + 0.5f) +
+				knots[(c + 3) % count] * (0.5f * t * t);
+			return length(d);
+		}
+
+	private:
+		std::vector<Vector3> knots;
+		int samples;
+		std::vector<float> lengths;
+	};
+
+	/* how far p is from the chord a b */
+	inline float getChordError(const Vector3 &a, const Vector3 &b, const Vector3 &p)
+	{
+		Vector3 ab = b - a;
+		float len2 = dot(ab, ab);
+		float f = len2 > 0.0f ? std::max(0.0f, std::min(1.0f, dot(p - a, ab) / len2)) : 0.0f;
+		return distance(a + ab * f, p);
+	}
+
+	inline void splitByTolerance(const ArcLengthTable &table, float u0, float u1, const Vector3 &p0, const Vector3 &p1,
+		float tolerance, int depth, std::vector<float> &params)
+	{
+		/* the quarters too, the middle alone misses s-bends */
+		float um = 0.5f * (u0 + u1);
+		Vector3 pm = table.getPoint(um);
+		float error = std::max(getChordError(p0, p1, pm), std::max(
+			getChordError(p0, p1, table.getPoint(0.5f * (u0 + um))),
+			getChordError(p0, p1, table.getPoint(0.5f * (um + u1)))));
+		if (depth > 0 && error > tolerance)
+		{
+			splitByTolerance(table, u0, um, p0, pm, tolerance, depth - 1, params);
+			splitByTolerance(table, um, u1, pm, p1, tolerance, depth - 1, params);
+			return;
+		}
+		params.push_back(u1);
+	}
+
+	/* u from u0 to u1 (whole segments) where the curve strays at most tolerance
+	 * from the chords between the points, as measured at the middle and the
+	 * quarters of each chord. every segment starts with a single chord that is
+	 * halved until it's close enough, at most depth times, so a segment gets
+	 * between 1 and 2^depth chords. */
+	inline void sampleByTolerance(const ArcLengthTable &table, int u0, int u1, float tolerance, int depth, std::vector<float> &params)
+	{
+		params.clear();
+		params.push_back(float(u0));
+		Vector3 p0 = table.getPoint(float(u0));
+		for (int u = u0; u < u1; ++u)
+		{
+			Vector3 p1 = table.getPoint(float(u + 1));
+			splitByTolerance(table, float(u), float(u + 1), p0, p1, tolerance, depth, params);
+			p0 = p1;
+		}
+	}
+}
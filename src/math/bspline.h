@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <xmmintrin.h>
+#include "vector3.h"
+
+namespace math
+{
+	/* uniform cubic B-spline segments, each sampled at lod points t = i / lod.
+	 * the basis weights of the samples are tabled once, so a point is four
+	 * multiply-adds per axis, and SSE does four samples of a segment at once.
+	 * the axes are separate (SoA), one call per axis. */
+	class UniformBSpline
+	{
+	public:
+		explicit UniformBSpline(int lod) :
+		  lod(lod),
+		  stride((lod + 3) & ~3),
+		  basis(4 * ((lod + 3) & ~3))
+		{
+			for (int i = 0; i < stride; ++i)
+			{
+				float t = float(i < lod ? i : lod - 1) / float(lod);
+				float it = 1.0f - t;
+				basis[0 * stride + i] = it * it * it / 6.f;
+				basis[1 * stride + i] = (3.f * t * t * t - 6.f * t * t + 4.f) / 6.f;
+				basis[2 * stride + i] = (-3.f * t * t * t + 3.f * t * t + 3.f * t + 1) / 6.f;
+				basis[3 * stride + i] = t * t * t / 6.f;
+			}
+		}
+
+		int getLod() const { return lod; }
+		float getBasis(int k, int i) const { return basis[k * stride + i]; }
+
+		/* the lod points of the segment between knots k1 and k2 */
+		void evalSegment(float k0, float k1, float k2, float k3, float *dst) const
+		{
+			const float *b0 = &basis[0], *b1 = b0 + stride, *b2 = b1 + stride, *b3 = b2 + stride;
+			const __m128 v0 = _mm_set1_ps(k0), v1 = _mm_set1_ps(k1), v2 = _mm_set1_ps(k2), v3 = _mm_set1_ps(k3);
+			int i = 0;
+			for (; i + 4 <= lod; i += 4)
+			{
+				__m128 p = _mm_mul_ps(_mm_loadu_ps(b0 + i), v0);
+				p = _mm_add_ps(p, _mm_mul_ps(_mm_loadu_ps(b1 + i), v1));
+				p = _mm_add_ps(p, _mm_mul_ps(_mm_loadu_ps(b2 + i), v2));
+				p = _mm_add_ps(p, _mm_mul_ps(_mm_loadu_ps(b3 + i), v3));
+				_mm_storeu_ps(dst + i, p);
+			}
+			for (; i < lod; ++i)
+				dst[i] = b0[i] * k0 + b1[i] * k1 + b2[i] * k2 + b3[i] * k3;
+		}
+
+		/* the count * lod points of a closed loop of count knots, segment c
+		 * running from knot c + 1 to c + 2 */
+		void evalLoop(const float *knots, int count, float *dst) const
+		{
+			for (int c = 0; c < count; ++c)
+				evalSegment(knots[c], knots[(c + 1) % count], knots[(c + 2) % count], knots[(c + 3) % count], dst + c * lod);
+		}
+
+	private:
+		int lod, stride;
+		std::vector<float> basis;
+	};
+
+	/* forward differencing of a single segment, all three axes at once: every
+	 * step is three adds, for walking the points in order without a table.
+	 * it drifts a little from the tabled points with the number of steps, so
+	 * it should be restarted on every segment. it holds SSE registers, so keep
+	 * it on the stack. */
+	class BSplineStepper
+	{
+	public:
+		/* at point first of the segment between knots k1 and k2, stepping
+		 * 1 / lod of it at a time */
+		void start(const Vector3 &k0, const Vector3 &k1, const Vector3 &k2, const Vector3 &k3, int lod, int first)
+		{
+			const __m128 v0 = load(k0), v1 = load(k1), v2 = load(k2), v3 = load(k3);
+			const __m128 sixth = _mm_set1_ps(1.0f / 6);
+
+			/* the power basis: ((a t + b) t + c) t + d */
+			__m128 a = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(v3, v0), _mm_mul_ps(_mm_set1_ps(3.0f), _mm_sub_ps(v1, v2))), sixth);
+			__m128 b = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(v0, _mm_add_ps(v1, v1)), v2), _mm_set1_ps(0.5f));
+			__m128 c = _mm_mul_ps(_mm_sub_ps(v2, v0), _mm_set1_ps(0.5f));
+			__m128 d = _mm_mul_ps(_mm_add_ps(_mm_add_ps(v0, v2), _mm_mul_ps(_mm_set1_ps(4.0f), v1)), sixth);
+
+			const float h = 1.0f / lod, t = first * h;
+			const __m128 vh = _mm_set1_ps(h), vt = _mm_set1_ps(t);
+			const __m128 h2 = _mm_mul_ps(vh, vh), h3 = _mm_mul_ps(h2, vh);
+			const __m128 t2 = _mm_mul_ps(vt, vt);
+
+			point = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(a, vt), b), vt), c), vt), d);
+			/* a (3 t^2 h + 3 t h^2 + h^3) + b (2 t h + h^2) + c h */
+			delta1 = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(a, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_add_ps(_mm_mul_ps(t2, vh), _mm_mul_ps(vt, h2))), h3)),
+				_mm_mul_ps(b, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.0f), _mm_mul_ps(vt, vh)), h2))),
+				_mm_mul_ps(c, vh));
+			/* a (6 t h^2 + 6 h^3) + 2 b h^2 */
+			delta2 = _mm_add_ps(
+				_mm_mul_ps(a, _mm_mul_ps(_mm_set1_ps(6.0f), _mm_add_ps(_mm_mul_ps(vt, h2), h3))),
+				_mm_mul_ps(b, _mm_mul_ps(_mm_set1_ps(2.0f), h2)));
+			/* 6 a h^3 */
+			delta3 = _mm_mul_ps(a, _mm_mul_ps(_mm_set1_ps(6.0f), h3));
+		}
+
+		void step()
+		{
+			point = _mm_add_ps(point, delta1);
+			delta1 = _mm_add_ps(delta1, delta2);
+			delta2 = _mm_add_ps(delta2, delta3);
+		}
+
+		Vector3 getPoint() const
+		{
+			float p[4];
+			_mm_storeu_ps(p, point);
+			return Vector3(p[0], p[1], p[2]);
+		}
+
+	private:
+		static __m128 load(const Vector3 &v) { return _mm_set_ps(0.0f, v.z, v.y, v.x); }
+
+		__m128 point, delta1, delta2, delta3;
+	};
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <emmintrin.h>
+
+namespace math
+{
+	/* counter-based random numbers: a value is a hash of (seed, stream, index),
+	 * so there is no state to share, any thread can draw any of them in any
+	 * order, and the same numbers come out on every CRT. streams keep apart
+	 * whatever draws from the same seed (a loop, a frame), indices go through
+	 * the numbers of a stream.
+	 *
+	 * the hash is two rounds of a 32 bit integer mix (xor-shift-multiply, as
+	 * in the SplitMix finalizer) keyed by seed and stream. it is only 32 bit
+	 * so SSE2 can do four at once. */
+
+	inline unsigned counterMix(unsigned x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352dU;
+		x ^= x >> 15;
+		x *= 0x846ca68bU;
+		x ^= x >> 16;
+		return x;
+	}
+
+	inline unsigned counterKey(unsigned seed, unsigned stream)
+	{
+		return counterMix(seed ^ counterMix(stream + 0x9e3779b9U));
+	}
+
+	inline unsigned counterRand(unsigned seed, unsigned stream, unsigned index)
+	{
+		unsigned key = counterKey(seed, stream);
+		return counterMix(counterMix(index ^ key) + key);
+	}
+
+	/* in [0, 1), 24 bits of it */
+	inline float counterRandf(unsigned seed, unsigned stream, unsigned index)
+	{
+		return float(counterRand(seed, stream, index) >> 8) * (1.0f / (1 << 24));
+	}
+
+	/* low 32 bits of the products, SSE2 only has them for two lanes at a time */
+	inline __m128i counterMul(__m128i a, __m128i b)
+	{
+		__m128i even = _mm_mul_epu32(a, b);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+
+	inline __m128i counterMix(__m128i x)
+	{
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		x = counterMul(x, _mm_set1_epi32(0x7feb352d));
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+		x = counterMul(x, _mm_set1_epi32(int(0x846ca68bU)));
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		return x;
+	}
+
+	/* counterRandf() of indices first to first + count, four at a time */
+	inline void counterRandFill(unsigned seed, unsigned stream, unsigned first, int count, float *dst)
+	{
+		const unsigned key = counterKey(seed, stream);
+		const __m128i vkey = _mm_set1_epi32(int(key));
+		const __m128 scale = _mm_set1_ps(1.0f / (1 << 24));
+		__m128i index = _mm_add_epi32(_mm_set1_epi32(int(first)), _mm_set_epi32(3, 2, 1, 0));
+		int i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i x = counterMix(_mm_add_epi32(counterMix(_mm_xor_si128(index, vkey)), vkey));
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), scale));
+			index = _mm_add_epi32(index, _mm_set1_epi32(4));
+		}
+		for (; i < count; ++i)
+			dst[i] = float(counterMix(counterMix((first + i) ^ key) + key) >> 8) * (1.0f / (1 << 24));
+	}
+}
@@ -0,0 +1,211 @@
+#include "stdafx.h"
+
+#include "../core/fatalexception.h"
+#include "../math/vector3.h"
+#include "../math/matrix4x4.h"
+#include "../renderer/device.h"
+#include "../engine/explosion.h"
+#include "toolcommon.h"
+
+#include <omp.h>
+
+/* headless benchmark of the Explosion fragments: how long it takes to set up
+ * an explosion, and how fast the fragments turn every frame. the turning is
+ * timed the way it used to be done, a rotation matrix per fragment and a
+ * cross product for the normal, against the SSE kernel (writeVertices) into
+ * memory, and against updateGraphics() into the dynamic vertex buffer of a
+ * null device, so with the lock but without any drawing.
+ *
+ * usage: explosionbench [-startups 3] [-frames 200] [-triangles 100000]
+ *                       [-threads 1] [-verify 1]
+ *
+ * -triangles is the fragment count, far more than the demo uses
+ * (EXPLOSION_INIT_TRIANGLE_COUNT) so the kernel has something to chew on.
+ * the matrices always run on one thread, the kernel splits the fragments
+ * over -threads (0 is all of them), so the default compares a core to a core.
+ *
+ * -verify 1 checks that the kernel puts the fragments where the matrices
+ * would, at steps all through the animation and long after it, instead of
+ * timing anything. */
+
+using engine::Explosion;
+using tools::getTime;
+using tools::sink;
+
+namespace
+{
+	struct Options
+	{
+		Options() :
+		  startups(3),
+		  frames(200),
+		  triangles(100000),
+		  threads(1),
+		  verify(false)
+		{}
+
+		int startups;
+		int frames;
+		int triangles;
+		int threads;
+		bool verify;
+	};
+
+	Options parseOptions(int argc, char *argv[])
+	{
+		Options options;
+		tools::Arguments args(argc, argv);
+		while (args.next())
+		{
+			const std::string arg = args.getName();
+			const char *value = args.getValue();
+
+			if      ("-startups" == arg)  options.startups = atoi(value);
+			else if ("-frames" == arg)    options.frames = atoi(value);
+			else if ("-triangles" == arg) options.triangles = atoi(value);
+			else if ("-threads" == arg)   options.threads = atoi(value);
+			else if ("-verify" == arg)    options.verify = 0 != atoi(value);
+			else throw core::FatalException("unknown option " + arg);
+		}
+
+		if (options.startups < 1 || options.frames < 1)
+			throw core::FatalException("need at least one startup and one frame");
+		if (options.triangles < 1)
+			throw core::FatalException("need at least one triangle");
+		if (options.threads <= 0)
+			options.threads = omp_get_num_procs();
+		return options;
+	}
+
+	Vector3 getFragment(const Explosion &explosion, int plane, int i)
+	{
+		return Vector3(explosion.getFragment(plane, i), explosion.getFragment(plane + 1, i), explosion.getFragment(plane + 2, i));
+	}
+
+	/* what updateGraphics did before the kernel: a matrix per fragment */
+	void writeReference(const Explosion &explosion, int step, Explosion::MovingVertex *dst)
+	{
+		Matrix4x4 mrot;
+		for (int i = 0; i < explosion.getTriangleCount(); ++i)
+		{
+			Vector3 axis = getFragment(explosion, EXPLOSION_AXIS, i);
+			D3DXMatrixRotationAxis(&mrot, &axis, step / explosion.getFragment(EXPLOSION_WEIGHT, i) * 0.1f);
+			for (int j = 0; j < 3; ++j) dst[j].pos = mul(mrot, getFragment(explosion, EXPLOSION_CORNERS + 3 * j, i));
+			Vector3 norm = normalize(cross(Vector3(dst[1].pos - dst[0].pos), Vector3(dst[2].pos - dst[0].pos)));
+			for (int j = 0; j < 3; ++j) dst[j].norm = norm;
+			dst += 3;
+		}
+	}
+
+	void verify(const Explosion &explosion)
+	{
+		const int count = explosion.getTriangleCount();
+		std::vector<Explosion::MovingVertex> kernel(3 * count), reference(3 * count);
+		float posError = 0.0f, normError = 0.0f;
+
+		/* all through the animation, and long after it, as the step keeps
+		 * counting for as long as the explosion is drawn */
+		std::vector<int> steps;
+		for (int step = 0; step <= EXPLOSION_ANIMATION_LENGTH; step += EXPLOSION_ANIMATION_LENGTH / 16)
+			steps.push_back(step);
+		for (int step = 4 * EXPLOSION_ANIMATION_LENGTH; step <= 1024 * EXPLOSION_ANIMATION_LENGTH; step *= 4)
+			steps.push_back(step + 1);
+
+		int skipped = 0;
+		for (size_t n = 0; n < steps.size(); ++n)
+		{
+			explosion.writeVertices(steps[n], &kernel[0]);
+			writeReference(explosion, steps[n], &reference[0]);
+			for (int i = 0; i < count; ++i)
+			{
+				/* a sliver's cross product is mostly rounding */
+				if (explosion.getFragment(EXPLOSION_WEIGHT, i) < 1e-3f)
+				{
+					skipped += 0 == n;
+					continue;
+				}
+				for (int j = 0; j < 3; ++j)
+				{
+					const Explosion::MovingVertex &a = kernel[3 * i + j], &b = reference[3 * i + j];
+					posError = std::max(posError, length(Vector3(a.pos - b.pos)));
+					normError = std::max(normError, length(Vector3(a.norm - b.norm)));
+				}
+			}
+		}
+		printf("explosion: %d steps up to %d, largest error %g in position, %g in normal (%d slivers skipped)\n",
+			int(steps.size()), steps.back(), posError, normError, skipped);
+		if (!(posError < 1e-4f) || !(normError < 1e-3f))
+			throw core::FatalException("the kernel doesn't turn the fragments like the matrices do");
+	}
+
+	void runReference(const Explosion &explosion, int frames)
+	{
+		std::vector<Explosion::MovingVertex> vertices(3 * explosion.getTriangleCount());
+		double begin = getTime();
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			writeReference(explosion, frame, &vertices[0]);
+			sink(vertices[frame % vertices.size()].pos.x);
+		}
+		double seconds = (getTime() - begin) / frames;
+		printf("explosion, matrices: %.3f ms/frame, %.0f fragments/s on 1 thread\n", seconds * 1e3, explosion.getTriangleCount() / seconds);
+	}
+
+	void runKernel(const Explosion &explosion, int frames)
+	{
+		std::vector<Explosion::MovingVertex> vertices(3 * explosion.getTriangleCount());
+		double begin = getTime();
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			explosion.writeVertices(frame, &vertices[0]);
+			sink(vertices[frame % vertices.size()].pos.x);
+		}
+		double seconds = (getTime() - begin) / frames;
+		printf("explosion, kernel:   %.3f ms/frame, %.0f fragments/s on %d threads\n", seconds * 1e3,
+			explosion.getTriangleCount() / seconds, omp_get_max_threads());
+	}
+
+	void runUpdate(Explosion &explosion, int frames)
+	{
+		double begin = getTime();
+		for (int frame = 0; frame < frames; ++frame)
+			explosion.updateGraphics();
+		double seconds = (getTime() - begin) / frames;
+		printf("explosion, update:   %.3f ms/frame, %.0f fragments/s on %d threads, %.0f kB/frame streamed\n", seconds * 1e3,
+			explosion.getTriangleCount() / seconds, omp_get_max_threads(), sizeof(Explosion::MovingVertex) * 3.0 * explosion.getTriangleCount() / 1024.0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try {
+		Options options = parseOptions(argc, argv);
+		omp_set_num_threads(options.threads);
+
+		renderer::Device device = tools::createNullDevice();
+		Vector3 begin(0.0f, 0.0f, 0.0f), end(0.0f, 10.0f, 0.0f);
+
+		double start = getTime();
+		for (int i = 0; i < options.startups - 1; ++i)
+		{
+			Explosion explosion(device, begin, end, options.triangles);
+		}
+		Explosion explosion(device, begin, end, options.triangles);
+		double startup = (getTime() - start) / options.startups;
+		printf("explosion startup: %.3f ms (%d fragments)\n", startup * 1e3, explosion.getTriangleCount());
+
+		if (options.verify)
+		{
+			verify(explosion);
+			return 0;
+		}
+
+		runReference(explosion, options.frames);
+		runKernel(explosion, options.frames);
+		runUpdate(explosion, options.frames);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "explosionbench: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,468 @@
+#include "stdafx.h"
+
+#include "../core/fatalexception.h"
+#include "../math/vector3.h"
+#include "../math/notrand.h"
+#include "../math/bspline.h"
+#include "../math/arclength.h"
+#include "../math/counterrand.h"
+#include "../renderer/device.h"
+#include "../engine/vertexstreamer.h"
+#include "../engine/grow.h"
+#include "../engine/ccbsplines.h"
+#include "toolcommon.h"
+
+/* headless benchmark of the spline effects: how long Grow takes to build its
+ * loops, and how fast it puts out the lines of a frame. it all goes to a null
+ * device, so the drawing is the cpu side only (the streaming and the locks).
+ * the spline evaluation (math/bspline.h) is timed on its own, as points per
+ * second for the per-point basis both effects used to work out, the tabled
+ * SSE one and forward differencing, at the LODs of Grow and CCBSplines. the
+ * CCBSplines trails are timed windowed and from the precomputed table, and
+ * drawn for the same frames, with the draw calls they take. both effects are
+ * drawn sampled evenly in t and by arc length: Grow by -tolerance, the
+ * CCBSplines trails every -spacing along the curve.
+ *
+ * usage: splinebench [-startups 10] [-frames 500] [-clusters grow.txt]
+ *                    [-trails 20] [-lod 128] [-spacing 0.03] [-tolerance 0.01]
+ *                    [-verify 1]
+ *
+ * the frames sweep the growth animation from the first cluster starting to
+ * all of them being fully grown, so every run draws the same. they are timed
+ * for the static vertex buffer and for streaming the lines. -clusters loads
+ * the cluster table (see Grow::loadClusters()) instead of the built-in one.
+ * -trails and -lod set the CCBSplines loop count and points per knot.
+ *
+ * -verify 1 checks that both paths draw the same lines for every frame, with
+ * and without the tolerance, the tabled and forward-differenced splines
+ * against the per-point basis, the arc length tables, spacing and chord
+ * error against finely chorded curves, the batch random fill against the
+ * single numbers, and the windowed CCBSplines trails against the table at
+ * every step of the loops, and that they are drawn in full particle batches,
+ * instead of timing anything. */
+
+using engine::Grow;
+using engine::CCBSplines;
+using tools::getTime;
+using tools::sink;
+
+namespace
+{
+	struct Options
+	{
+		Options() :
+		  startups(10),
+		  frames(500),
+		  trails(CSLOOP),
+		  lod(CSLOD),
+		  spacing(0.03f),
+		  tolerance(0.01f),
+		  verify(false)
+		{}
+
+		int startups;
+		int frames;
+		std::string clusterFile;
+		int trails;
+		int lod;
+		float spacing;
+		float tolerance;
+		bool verify;
+	};
+
+	Options parseOptions(int argc, char *argv[])
+	{
+		Options options;
+		tools::Arguments args(argc, argv);
+		while (args.next())
+		{
+			const std::string arg = args.getName();
+			const char *value = args.getValue();
+
+			if      ("-startups" == arg) options.startups = atoi(value);
+			else if ("-frames" == arg)   options.frames = atoi(value);
+			else if ("-clusters" == arg) options.clusterFile = value;
+			else if ("-trails" == arg)   options.trails = atoi(value);
+			else if ("-lod" == arg)      options.lod = atoi(value);
+			else if ("-spacing" == arg)  options.spacing = float(atof(value));
+			else if ("-tolerance" == arg) options.tolerance = float(atof(value));
+			else if ("-verify" == arg)   options.verify = 0 != atoi(value);
+			else throw core::FatalException("unknown option " + arg);
+		}
+
+		if (options.startups < 1 || options.frames < 1)
+			throw core::FatalException("need at least one startup and one frame");
+		if (options.trails < 1 || options.lod < 1)
+			throw core::FatalException("need at least one trail of one point");
+		if (!(options.spacing > 0) || !(options.tolerance > 0))
+			throw core::FatalException("the spacing and the tolerance need to be positive");
+		return options;
+	}
+
+	/* from the first cluster starting until the last one is done */
+	float getFrameTime(const Grow &grow, int frame, int frames)
+	{
+		const std::vector<Grow::Cluster> &clusters = grow.getClusters();
+		float first = FLT_MAX, last = 0.0f;
+		for (size_t i = 0; i < clusters.size(); ++i)
+		{
+			if (0 == clusters[i].start) continue;
+			first = std::min(first, clusters[i].start);
+			last = std::max(last, clusters[i].start + clusters[i].duration);
+		}
+		if (first > last) return 0.0f;
+		float t = frames > 1 ? float(frame) / (frames - 1) : 1.0f;
+		return first + (last - first) * t;
+	}
+
+	void verify(const Grow &grow, int frames)
+	{
+		std::vector<Vector3> streamed, baked;
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			float time = getFrameTime(grow, frame, frames);
+			grow.getFrameLines(time, true, streamed);
+			grow.getFrameLines(time, false, baked);
+			if (streamed.size() != baked.size() ||
+				(!streamed.empty() && 0 != memcmp(&streamed[0], &baked[0], streamed.size() * sizeof(Vector3))))
+				throw core::FatalException("the static lines don't match the streamed ones");
+		}
+		printf("grow, tolerance %g: the lines of all %d frames match\n", grow.getTolerance(), frames);
+	}
+
+	const int splineKnots = 40;
+	const int splineLoops = 256;
+
+	/* the basis worked out per point, as Grow and CCBSplines used to */
+	float getReferencePoint(float k0, float k1, float k2, float k3, int i, int lod)
+	{
+		float t = (float)i / (float)lod;
+		float it = (float)1.0 - t;
+
+		float b0 = it * it * it / 6.f;
+		float b1 = (3.f * t * t * t - 6.f * t * t + 4.f) / 6.f;
+		float b2 = (-3.f * t * t * t + 3.f * t * t + 3.f * t + 1) / 6.f;
+		float b3 = t * t * t / 6.f;
+		return b0 * k0 + b1 * k1 + b2 * k2 + b3 * k3;
+	}
+
+	/* a closed loop of knots in [-2.5, 2.5], a plane per axis */
+	void makeKnots(int loop, float knots[3][splineKnots])
+	{
+		for (int axis = 0; axis < 3; ++axis)
+			for (int i = 0; i < splineKnots; ++i)
+				knots[axis][i] = math::notRandf((loop * 3 + axis) * splineKnots + i) * 5.0f - 2.5f;
+	}
+
+	Vector3 getKnot(const float knots[3][splineKnots], int i)
+	{
+		i %= splineKnots;
+		return Vector3(knots[0][i], knots[1][i], knots[2][i]);
+	}
+
+	void verifySpline(int lod)
+	{
+		math::UniformBSpline spline(lod);
+		std::vector<float> points(splineKnots * lod);
+		float tableError = 0.0f, stepperError = 0.0f;
+		for (int loop = 0; loop < splineLoops; ++loop)
+		{
+			float knots[3][splineKnots];
+			makeKnots(loop, knots);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				spline.evalLoop(knots[axis], splineKnots, &points[0]);
+				for (int c = 0; c < splineKnots; ++c)
+					for (int i = 0; i < lod; ++i)
+					{
+						const float *k = knots[axis];
+						float ref = getReferencePoint(k[c], k[(c + 1) % splineKnots], k[(c + 2) % splineKnots], k[(c + 3) % splineKnots], i, lod);
+						tableError = std::max(tableError, fabsf(points[c * lod + i] - ref));
+					}
+			}
+
+			for (int c = 0; c < splineKnots; ++c)
+			{
+				math::BSplineStepper stepper;
+				stepper.start(getKnot(knots, c), getKnot(knots, c + 1), getKnot(knots, c + 2), getKnot(knots, c + 3), lod, 0);
+				for (int i = 0; i < lod; ++i, stepper.step())
+				{
+					Vector3 p = stepper.getPoint();
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						const float *k = knots[axis];
+						float ref = getReferencePoint(k[c], k[(c + 1) % splineKnots], k[(c + 2) % splineKnots], k[(c + 3) % splineKnots], i, lod);
+						stepperError = std::max(stepperError, fabsf(p[axis] - ref));
+					}
+				}
+			}
+		}
+
+		printf("spline lod %3d: largest error %g tabled, %g forward differenced\n", lod, tableError, stepperError);
+		if (tableError > 1e-5f || stepperError > 1e-4f)
+			throw core::FatalException("the splines don't match the per-point basis");
+	}
+
+	/* the length of u0 to u1 in a thousand chords */
+	float getReferenceLength(const math::ArcLengthTable &table, float u0, float u1)
+	{
+		float length = 0.0f;
+		Vector3 prev = table.getPoint(u0);
+		for (int i = 1; i <= 1000; ++i)
+		{
+			Vector3 p = table.getPoint(u0 + (u1 - u0) * i / 1000);
+			length += math::distance(prev, p);
+			prev = p;
+		}
+		return length;
+	}
+
+	void verifyArcLength(float spacing, float tolerance)
+	{
+		float lengthError = 0.0f, spacingError = 0.0f, chordError = 0.0f;
+		size_t points = 0;
+		for (int loop = 0; loop < splineLoops; loop += 16)
+		{
+			float knots[3][splineKnots];
+			makeKnots(loop, knots);
+			Vector3 loopKnots[splineKnots];
+			for (int i = 0; i < splineKnots; ++i)
+				loopKnots[i] = getKnot(knots, i);
+			math::ArcLengthTable table;
+			table.build(loopKnots, splineKnots);
+
+			float total = getReferenceLength(table, 0.0f, float(splineKnots));
+			lengthError = std::max(lengthError, fabsf(table.getLength() - total) / total);
+
+			/* the curve between points an even spacing apart, within a round */
+			float prev = table.getParameter(0.0f);
+			for (int i = 1; i * spacing < table.getLength(); ++i)
+			{
+				float u = table.getParameter(i * spacing);
+				spacingError = std::max(spacingError, fabsf(getReferenceLength(table, prev, u) - spacing) / spacing);
+				prev = u;
+			}
+
+			std::vector<float> params;
+			math::sampleByTolerance(table, 0, splineKnots, tolerance, SDEPTH, params);
+			points += params.size();
+			for (size_t i = 0; i + 1 < params.size(); ++i)
+			{
+				Vector3 a = table.getPoint(params[i]), b = table.getPoint(params[i + 1]);
+				for (int j = 1; j < 32; ++j)
+					chordError = std::max(chordError, math::getChordError(a, b, table.getPoint(params[i] + (params[i + 1] - params[i]) * j / 32)));
+			}
+		}
+
+		const int loops = (splineLoops + 15) / 16;
+		printf("arc length: largest error %g of the length, %g of spacing %g\n", lengthError, spacingError, spacing);
+		printf("arc length: largest chord error %g at tolerance %g, %.1f points per knot\n",
+			chordError, tolerance, double(points) / (loops * splineKnots));
+		if (lengthError > 1e-3f || spacingError > 0.05f || chordError > tolerance * 1.25f)
+			throw core::FatalException("the arc length sampling is off");
+	}
+
+	void runSpline(int lod)
+	{
+		math::UniformBSpline spline(lod);
+		std::vector<float> points(splineKnots * lod * 3);
+		std::vector<Vector3> stepped(splineKnots * lod);
+		const double count = double(splineLoops) * splineKnots * lod;
+		double reference = 0.0, tabled = 0.0, forward = 0.0;
+		for (int loop = 0; loop < splineLoops; ++loop)
+		{
+			float knots[3][splineKnots];
+			makeKnots(loop, knots);
+
+			double begin = getTime();
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const float *k = knots[axis];
+				float *dst = &points[axis * splineKnots * lod];
+				for (int c = 0; c < splineKnots; ++c)
+					for (int i = 0; i < lod; ++i)
+						dst[c * lod + i] = getReferencePoint(k[c], k[(c + 1) % splineKnots], k[(c + 2) % splineKnots], k[(c + 3) % splineKnots], i, lod);
+			}
+			reference += getTime() - begin;
+			sink(points[loop % points.size()]);
+
+			begin = getTime();
+			for (int axis = 0; axis < 3; ++axis)
+				spline.evalLoop(knots[axis], splineKnots, &points[axis * splineKnots * lod]);
+			tabled += getTime() - begin;
+			sink(points[loop % points.size()]);
+
+			begin = getTime();
+			for (int c = 0; c < splineKnots; ++c)
+			{
+				math::BSplineStepper stepper;
+				stepper.start(getKnot(knots, c), getKnot(knots, c + 1), getKnot(knots, c + 2), getKnot(knots, c + 3), lod, 0);
+				for (int i = 0; i < lod; ++i, stepper.step())
+					stepped[c * lod + i] = stepper.getPoint();
+			}
+			forward += getTime() - begin;
+			sink(stepped[loop % stepped.size()].x);
+		}
+
+		printf("spline lod %3d: %.0f points/s per-point basis, %.0f tabled, %.0f forward differenced\n",
+			lod, count / reference, count / tabled, count / forward);
+	}
+
+	/* the batch fill against the one at a time numbers the generators draw,
+	 * and that they look uniform */
+	void verifyRandom()
+	{
+		std::vector<float> values(100003);
+		double sum = 0.0, squares = 0.0;
+		for (unsigned stream = 0; stream < 8; ++stream)
+		{
+			unsigned first = stream * 0x10000001U;
+			math::counterRandFill(SSEED, stream, first, int(values.size()), &values[0]);
+			for (size_t i = 0; i < values.size(); ++i)
+			{
+				if (values[i] != math::counterRandf(SSEED, stream, first + unsigned(i)) || values[i] < 0.0f || values[i] >= 1.0f)
+					throw core::FatalException("the random fill doesn't match the counters");
+				sum += values[i];
+				squares += values[i] * values[i];
+			}
+		}
+		double count = 8.0 * values.size(), mean = sum / count, variance = squares / count - mean * mean;
+		printf("random: mean %f, variance %f\n", mean, variance);
+		if (fabs(mean - 0.5) > 0.01 || fabs(variance - 1.0 / 12) > 0.01)
+			throw core::FatalException("the random numbers aren't uniform");
+	}
+
+	/* the time of every step of the trails, in the middle of it */
+	double getTrailTime(int step)
+	{
+		return (step + 0.5) / 8.0;
+	}
+
+	void verifyTrails(CCBSplines &splines)
+	{
+		const int lod = splines.getLod();
+		std::vector<Vector3> windowed, tabled;
+		float error = 0.0f;
+		splines.setSpacing(0.0f);
+		splines.setWindowed(false);
+		for (int step = 0; step < CSNK * lod; ++step)
+			for (int loop = 0; loop < splines.getLoopCount(); ++loop)
+			{
+				splines.getTrail(loop, getTrailTime(step), true, windowed);
+				splines.getTrail(loop, getTrailTime(step), false, tabled);
+				for (int i = 0; i < lod; ++i)
+					for (int axis = 0; axis < 3; ++axis)
+						error = std::max(error, fabsf(windowed[i][axis] - tabled[i][axis]));
+			}
+		splines.setWindowed(true);
+		printf("ccbsplines: largest error of the windowed trails %g\n", error);
+		if (error > 1e-4f)
+			throw core::FatalException("the windowed trails don't match the table");
+
+		size_t particles = splines.drawFrame(getTrailTime(0));
+		size_t batches = (particles + PARTICLE_STREAMER_PARTICLE_COUNT - 1) / PARTICLE_STREAMER_PARTICLE_COUNT;
+		if (particles != size_t(splines.getLoopCount()) * lod || splines.getDrawCount() != batches)
+			throw core::FatalException("the trails aren't drawn in full batches");
+		printf("ccbsplines: %u particles in %u draws\n", unsigned(particles), unsigned(splines.getDrawCount()));
+	}
+
+	void runTrails(CCBSplines &splines, bool windowed)
+	{
+		const int lod = splines.getLod();
+		splines.setWindowed(windowed);
+		std::vector<Vector3> trail;
+		double begin = getTime();
+		for (int step = 0; step < CSNK * lod; ++step)
+		{
+			for (int loop = 0; loop < splines.getLoopCount(); ++loop)
+				splines.getTrail(loop, getTrailTime(step), windowed, trail);
+			sink(trail[step % lod].x);
+		}
+		double seconds = getTime() - begin;
+		size_t bytes = windowed ? 0 : sizeof(Vector3) * splines.getLoopCount() * CSNK * lod;
+		printf("ccbsplines trails, %-8s: %.0f points/s, %.0f kB of table\n",
+			windowed ? "windowed" : "tabled", double(CSNK * lod) * splines.getLoopCount() * lod / seconds, bytes / 1024.0);
+	}
+
+	void runTrailDraws(CCBSplines &splines, float spacing, int frames)
+	{
+		splines.setWindowed(true);
+		splines.setSpacing(spacing);
+		double particles = 0.0, draws = 0.0;
+		double begin = getTime();
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			particles += double(splines.drawFrame(getTrailTime(frame)));
+			draws += double(splines.getDrawCount());
+		}
+		double seconds = (getTime() - begin) / frames;
+		printf("ccbsplines draw, spacing %g: %.3f ms/frame, %.1f draws/frame (one per trail before), %.0f particles/frame\n",
+			spacing, seconds * 1e3, draws / frames, particles / frames);
+	}
+
+	void run(Grow &grow, bool streamed, int frames)
+	{
+		grow.setStreamed(streamed);
+		double vertices = 0.0, draws = 0.0;
+		double begin = getTime();
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			vertices += double(grow.drawFrame(getFrameTime(grow, frame, frames), 1));
+			draws += double(grow.getDrawCount());
+		}
+		double seconds = (getTime() - begin) / frames;
+		printf("grow draw, tolerance %g, %-8s: %.3f ms/frame, %.1f draws/frame, %.0f vertices/frame, %.0f vertices/s\n",
+			grow.getTolerance(), streamed ? "streamed" : "static", seconds * 1e3, draws / frames, vertices / frames, vertices / frames / seconds);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try {
+		Options options = parseOptions(argc, argv);
+
+		renderer::Device device = tools::createNullDevice();
+		engine::VertexStreamer vs(device);
+		Vector3 start(0.0f, 0.0f, 0.0f);
+
+		double begin = getTime();
+		for (int i = 0; i < options.startups - 1; ++i)
+		{
+			Grow grow(device, vs, start);
+		}
+		Grow grow(device, vs, start);
+		double startup = (getTime() - begin) / options.startups;
+		printf("grow startup: %.3f ms (%d loops of %d points)\n", startup * 1e3, SLOOP, SNK * SLOD);
+		if (!options.clusterFile.empty()) grow.loadClusters(options.clusterFile);
+		CCBSplines splines(device, options.trails, options.lod);
+
+		if (options.verify)
+		{
+			verify(grow, options.frames);
+			grow.setTolerance(options.tolerance);
+			verify(grow, options.frames);
+			verifySpline(SLOD);
+			verifySpline(CSLOD);
+			verifyArcLength(options.spacing, options.tolerance);
+			verifyRandom();
+			verifyTrails(splines);
+			return 0;
+		}
+
+		run(grow, false, options.frames);
+		run(grow, true, options.frames);
+		grow.setTolerance(options.tolerance);
+		run(grow, false, options.frames);
+		run(grow, true, options.frames);
+		runSpline(SLOD);
+		runSpline(CSLOD);
+		runTrails(splines, true);
+		runTrails(splines, false);
+		runTrailDraws(splines, 0.0f, options.frames);
+		runTrailDraws(splines, options.spacing, options.frames);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "splinebench: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "../core/fatalexception.h"
+#include "../core/err.h"
+#include "../renderer/device.h"
+
+/* what the command line tools share: a timer, a null device for the ones
+ * that need d3d without drawing anything, and their -name value options */
+
+namespace tools
+{
+	/* seconds, from the performance counter */
+	inline double getTime()
+	{
+		static LARGE_INTEGER freq;
+		if (0 == freq.QuadPart) QueryPerformanceFrequency(&freq);
+		LARGE_INTEGER count;
+		QueryPerformanceCounter(&count);
+		return double(count.QuadPart) / double(freq.QuadPart);
+	}
+
+	/* resources can be created and locked on it, but nothing gets drawn */
+	inline renderer::Device createNullDevice()
+	{
+		IDirect3D9 *direct3d = Direct3DCreate9(D3D_SDK_VERSION);
+		if (NULL == direct3d) throw core::FatalException("failed to create direct3d");
+
+		D3DPRESENT_PARAMETERS pp;
+		memset(&pp, 0, sizeof(pp));
+		pp.Windowed = TRUE;
+		pp.SwapEffect = D3DSWAPEFFECT_DISCARD;
+		pp.BackBufferWidth = 1;
+		pp.BackBufferHeight = 1;
+		pp.BackBufferFormat = D3DFMT_UNKNOWN;
+
+		IDirect3DDevice9 *device = NULL;
+		HRESULT hr = direct3d->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_NULLREF, GetDesktopWindow(),
+			D3DCREATE_SOFTWARE_VERTEXPROCESSING, &pp, &device);
+		direct3d->Release();
+		if (FAILED(hr)) throw core::FatalException("failed to create null device\n\n" + core::d3dGetError(hr));
+
+		renderer::Device wrapper;
+		wrapper.attachRef(device);
+		return wrapper;
+	}
+
+	/* keeps the compiler from dropping the timed work */
+	inline void sink(float value)
+	{
+		static volatile float result;
+		result = value;
+	}
+
+	/* steps through the -name value pairs of the command line:
+	 *
+	 *	Arguments args(argc, argv);
+	 *	while (args.next())
+	 *		if ("-frames" == args.getName()) frames = atoi(args.getValue());
+	 */
+	class Arguments
+	{
+	public:
+		Arguments(int argc, char *argv[]) :
+		  argc(argc),
+		  argv(argv),
+		  current(-1)
+		{}
+
+		/* false past the last pair, throws if a name comes without a value */
+		bool next()
+		{
+			current += 2;
+			if (current >= argc) return false;
+			if (current + 1 >= argc) throw core::FatalException("missing value for " + getName());
+			return true;
+		}
+
+		std::string getName() const { return argv[current]; }
+		const char *getValue() const { return argv[current + 1]; }
+
+	private:
+		int argc;
+		char **argv;
+		int current;
+	};
+}
@@ -0,0 +1,562 @@
+#include "stdafx.h"
+
+#include "../core/fatalexception.h"
+#include "../math/math.h"
+#include "../math/matrix4x4.h"
+#include "../math/notrand.h"
+#include "../engine/voxelgrid.h"
+#include "../engine/voxelmesh.h"
+#include "toolcommon.h"
+
+#include <omp.h>
+
+/* headless benchmark of the VoxelMesh pipeline (fillGrid and the instance or
+ * surface extraction), for tracking regressions without the demo.
+ *
+ * usage: voxelbench [-file voxels.vox] [-grid 64] [-min 16] [-max 256]
+ *                   [-rotations 16] [-threads 0] [-csv out.csv] [-json out.json]
+ *                   [-verify 1]
+ *
+ * without -file, a procedural field of -grid^3 is used. the mesh size doubles
+ * from -min to -max, and every size is timed for the scalar and the SSE2 cube
+ * path, the shear resampler and for the surface-nets path, with 1, 2, 4, .. up to -threads threads
+ * (0 is all of them). the rotations are fixed, so runs can be compared.
+ * primitives are instances for the cube paths and triangles for the surface,
+ * scaling is the speed-up over the same path on one thread.
+ *
+ * -verify 1 checks the swizzled grid indices against a bitwise reference, that
+ * copies of the grid are deep, the SSE2 rows of every size against the scalar
+ * ones and the direct resampler against the shear one for -rotations random
+ * rotations, and the view-culled instances against a brute-force reference for
+ * a set of cameras, instead of timing anything. */
+
+using engine::VoxelBrickPlane;
+using engine::VoxelGrid;
+using engine::VoxelMesh;
+using tools::getTime;
+
+namespace
+{
+	struct Options
+	{
+		Options() :
+		  gridSize(64),
+		  minSize(16),
+		  maxSize(256),
+		  rotations(16),
+		  maxThreads(0),
+		  verify(false)
+		{}
+
+		std::string voxelFile;
+		int gridSize;
+		int minSize, maxSize;
+		int rotations;
+		int maxThreads;
+		std::string csvFile;
+		std::string jsonFile;
+		bool verify;
+	};
+
+	struct Result
+	{
+		int size;
+		const char *path;
+		int threads;
+		double seconds;      // mean per update
+		double primitives;   // mean instances or triangles per update
+		double nsPerVoxel;
+		double primitivesPerSecond;
+		double scaling;      // speed-up over one thread
+	};
+
+	VoxelGrid makeProceduralGrid(int size)
+	{
+		/* a rippled sphere, distances scaled the same way as the exported ones */
+		VoxelGrid grid(size);
+		grid.max_dist = float(size) / 2;
+		const float center = float(size) / 2;
+		for (int z = 0; z < size; ++z)
+			for (int y = 0; y < size; ++y)
+				for (int x = 0; x < size; ++x)
+				{
+					float dx = x - center, dy = y - center, dz = z - center;
+					float dist = sqrtf(dx * dx + dy * dy + dz * dz) - size * 0.3f;
+					dist += size * 0.06f * sinf(x * 12.0f / size) * cosf(y * 10.0f / size);
+					grid.setDistance(x, y, z, math::clamp(dist * (512.0f / size), -127.0f, 127.0f));
+				}
+		grid.compact();
+		return grid;
+	}
+
+	math::Matrix4x4 getRotation(int index)
+	{
+		return math::Matrix4x4::rotation(math::Vector3(
+			math::notRandf(index * 3 + 0) * float(2 * M_PI),
+			math::notRandf(index * 3 + 1) * float(2 * M_PI),
+			math::notRandf(index * 3 + 2) * float(2 * M_PI)));
+	}
+
+	Result run(VoxelMesh &mesh, int size, const char *path, int threads, int rotations)
+	{
+		omp_set_num_threads(threads);
+		mesh.setSize(float(size));
+		mesh.update(getRotation(rotations)); // warm up, not one of the timed ones so it can't be skipped
+
+		double primitives = 0.0;
+		double start = getTime();
+		for (int i = 0; i < rotations; ++i)
+		{
+			mesh.update(getRotation(i));
+			if (VoxelMesh::OUTPUT_SURFACE == mesh.getOutputMode())
+				primitives += double(mesh.getSurfaceIndices().size() / 3);
+			else
+				primitives += double(mesh.getInstanceCount());
+		}
+		double seconds = (getTime() - start) / rotations;
+
+		Result result;
+		result.size = size;
+		result.path = path;
+		result.threads = threads;
+		result.seconds = seconds;
+		result.primitives = primitives / rotations;
+		result.nsPerVoxel = seconds * 1e9 / (double(size) * size * size);
+		result.primitivesPerSecond = result.primitives / seconds;
+		result.scaling = 1.0;
+		return result;
+	}
+
+	/* the cameras circle the grid at varying distances, some from inside it */
+	math::Matrix4x4 getCamera(int index, int size)
+	{
+		const float center = float(size) / 2;
+		float angle = math::notRandf(index * 4 + 0) * float(2 * M_PI);
+		float elevation = (math::notRandf(index * 4 + 1) - 0.5f) * 2.5f;
+		float distance = float(size) * (0.2f + math::notRandf(index * 4 + 2) * 1.5f);
+		math::Vector3 eye(
+			center + distance * cosf(angle) * cosf(elevation),
+			center + distance * sinf(elevation),
+			center + distance * sinf(angle) * cosf(elevation));
+		math::Vector3 target(center, center + (math::notRandf(index * 4 + 3) - 0.5f) * size, center);
+		return
+			math::Matrix4x4::lookAt(eye, target, 0.0f) *
+			math::Matrix4x4::projection(40.0f + 40.0f * math::notRandf(index * 4 + 3), 4.0f / 3, 1.0f, float(size) * 10);
+	}
+
+	/* the visible faces of a cube, worked out from the corners in clip-space
+	 * and the eye, or 0 if it's outside the frustum */
+	int getReferenceFaces(const math::Matrix4x4 &gridToClip, const float eye[4], const BYTE *instance)
+	{
+		int outside[6] = { 0, 0, 0, 0, 0, 0 };
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			float pos[4] = {
+				float(instance[0] + (corner & 1)),
+				float(instance[1] + ((corner >> 1) & 1)),
+				float(instance[2] + ((corner >> 2) & 1)),
+				1.0f };
+			float clip[4];
+			for (int j = 0; j < 4; ++j)
+			{
+				clip[j] = 0.0f;
+				for (int i = 0; i < 4; ++i)
+					clip[j] += pos[i] * gridToClip.m[i][j];
+			}
+			if (clip[0] < -clip[3]) outside[0]++;
+			if (clip[0] >  clip[3]) outside[1]++;
+			if (clip[1] < -clip[3]) outside[2]++;
+			if (clip[1] >  clip[3]) outside[3]++;
+			if (clip[2] < 0.0f)     outside[4]++;
+			if (clip[2] >  clip[3]) outside[5]++;
+		}
+		for (int i = 0; i < 6; ++i)
+			if (8 == outside[i]) return 0;
+
+		/* front-facing towards the eye, and not covered by a solid neighbour */
+		int faces = 0;
+		for (int face = 0; face < 6; ++face)
+		{
+			int axis = 2 - face / 2;
+			float side = eye[axis] - (instance[axis] + 0.5f) * eye[3];
+			bool front = (face & 1) ? side < 0.0f : side > 0.0f;
+			if (front && 255 != instance[4 + face]) faces |= 1 << face;
+		}
+		return faces;
+	}
+
+	void verify(VoxelMesh &mesh, int size)
+	{
+		const int cameras = 32;
+		mesh.setOutputMode(VoxelMesh::OUTPUT_CUBES);
+		mesh.setSize(float(size));
+		for (int camera = 0; camera < cameras; ++camera)
+		{
+			math::Matrix4x4 rotation = getRotation(camera);
+			math::Matrix4x4 gridToClip = getCamera(camera, size);
+
+			/* all instances without a view are the candidates */
+			mesh.update(rotation);
+			std::vector<BYTE> all(mesh.getInstances(), mesh.getInstances() + mesh.getInstanceCount() * 12);
+
+			math::Matrix4x4 inv = gridToClip.inverse();
+			float eye[4];
+			for (int i = 0; i < 4; ++i)
+				eye[i] = -inv.m[2][i];
+			if (eye[3] < 0.0f)
+				for (int i = 0; i < 4; ++i)
+					eye[i] = -eye[i];
+
+			std::map<int, int> expected;
+			for (size_t i = 0; i < all.size(); i += 12)
+			{
+				int faces = getReferenceFaces(gridToClip, eye, &all[i]);
+				if (0 != faces) expected[all[i] | (all[i + 1] << 8) | (all[i + 2] << 16)] = faces;
+			}
+
+			mesh.update(rotation, gridToClip);
+			const BYTE *instances = mesh.getInstances();
+			size_t mismatches = 0;
+			for (size_t i = 0; i < mesh.getInstanceCount(); ++i)
+			{
+				const BYTE *instance = instances + i * 12;
+				std::map<int, int>::const_iterator it = expected.find(instance[0] | (instance[1] << 8) | (instance[2] << 16));
+				if (expected.end() == it || it->second != instance[10]) mismatches++;
+			}
+
+			printf("%5d camera %2d: %7d of %7d instances, reference %7d, %d mismatches\n",
+				size, camera, int(mesh.getInstanceCount()), int(all.size() / 12), int(expected.size()), int(mismatches));
+			if (0 != mismatches || expected.size() != mesh.getInstanceCount())
+				throw core::FatalException("view-culled instances don't match the reference");
+		}
+	}
+
+	/* bit by bit, the way the swizzled index is defined */
+	int getReferenceIndex(int x, int y, int z)
+	{
+		int index = 0;
+		for (int bit = 0; bit < 10; ++bit)
+			index |= (((x >> bit) & 1) << (3 * bit)) | (((y >> bit) & 1) << (3 * bit + 1)) | (((z >> bit) & 1) << (3 * bit + 2));
+		return index;
+	}
+
+	/* getIndex() against the bitwise reference and getIndex4(), and back
+	 * through getCoords(): every index of 32^3, every coordinate along each
+	 * axis, and random ones over the whole range */
+	void verifyIndices(const VoxelGrid &grid)
+	{
+		int mismatches = 0, checked = 0;
+		std::vector<bool> seen(32 * 32 * 32);
+		for (int i = 0; i < 32 * 32 * 32 + 3 * VOXEL_GRID_MAX_SIZE + 4096; ++i, ++checked)
+		{
+			int x, y, z;
+			if (i < 32 * 32 * 32)
+			{
+				x = i & 31;
+				y = (i >> 5) & 31;
+				z = i >> 10;
+			}
+			else if (i < 32 * 32 * 32 + 3 * VOXEL_GRID_MAX_SIZE)
+			{
+				int j = i - 32 * 32 * 32, axis = j / VOXEL_GRID_MAX_SIZE, v = j % VOXEL_GRID_MAX_SIZE;
+				x = 0 == axis ? v : 7;
+				y = 1 == axis ? v : 7;
+				z = 2 == axis ? v : 7;
+			}
+			else
+			{
+				x = int(math::notRandf(3 * i + 0) * VOXEL_GRID_MAX_SIZE) & (VOXEL_GRID_MAX_SIZE - 1);
+				y = int(math::notRandf(3 * i + 1) * VOXEL_GRID_MAX_SIZE) & (VOXEL_GRID_MAX_SIZE - 1);
+				z = int(math::notRandf(3 * i + 2) * VOXEL_GRID_MAX_SIZE) & (VOXEL_GRID_MAX_SIZE - 1);
+			}
+
+			int index = grid.getIndex(x, y, z), rx, ry, rz;
+			grid.getCoords(index, rx, ry, rz);
+			__m128i index4 = VoxelGrid::getIndex4(_mm_set1_epi32(x), _mm_set1_epi32(y), _mm_set1_epi32(z));
+			if (index != getReferenceIndex(x, y, z) || index != _mm_cvtsi128_si32(index4) ||
+				rx != x || ry != y || rz != z)
+				mismatches++;
+
+			if (i < 32 * 32 * 32)
+			{
+				/* the 32^3 indices are a permutation of 0 .. 32^3 - 1 */
+				if (index >= 32 * 32 * 32 || seen[index]) mismatches++;
+				else seen[index] = true;
+			}
+		}
+
+		printf("indices: %d checked, %d mismatches\n", checked, mismatches);
+		if (0 != mismatches)
+			throw core::FatalException("getIndex() doesn't match the reference or getCoords()");
+	}
+
+	bool samePlanes(const VoxelBrickPlane &a, const VoxelBrickPlane &b)
+	{
+		if (a.getCellCount() != b.getCellCount()) return false;
+		for (size_t i = 0; i < a.getBrickCount(); ++i)
+			if (0 != memcmp(a.getBrick(i), b.getBrick(i), a.getBrickCellCount())) return false;
+		return true;
+	}
+
+	bool sameGrids(const VoxelGrid &a, const VoxelGrid &b)
+	{
+		if (a.getSize() != b.getSize() || a.getPyramidLevels() != b.getPyramidLevels() || a.max_dist != b.max_dist) return false;
+		if (!samePlanes(a.getDistances(), b.getDistances())) return false;
+		for (int level = 0; level < a.getPyramidLevels(); ++level)
+			if (!samePlanes(a.getMinLevel(level), b.getMinLevel(level)) || !samePlanes(a.getMaxLevel(level), b.getMaxLevel(level))) return false;
+		return true;
+	}
+
+	/* copies are deep: equal to the source, and edits don't leak back */
+	void verifyCopy(const VoxelGrid &grid)
+	{
+		VoxelGrid copy(grid);
+		bool ok = sameGrids(grid, copy);
+
+		const int center = int(grid.getSize()) / 2;
+		signed char before = grid.pointSample(center, center, center);
+		copy.setDistance(center, center, center, before > 0 ? -100.0f : 100.0f);
+		ok = ok && grid.pointSample(center, center, center) == before && !sameGrids(grid, copy);
+
+		VoxelGrid other(2);
+		other = copy;
+		other = grid;
+		ok = ok && sameGrids(grid, other);
+
+		printf("copies: %s\n", ok ? "deep" : "shared or different");
+		if (!ok)
+			throw core::FatalException("copies of the grid aren't deep copies");
+	}
+
+	/* the SSE2 rows against the scalar ones. they blend in the same order,
+	 * but the scalar path may keep x87 precision, so a voxel may be a step off */
+	void verifyRows(VoxelMesh &mesh, int size, int rotations)
+	{
+		mesh.setOutputMode(VoxelMesh::OUTPUT_CUBES);
+		mesh.setResampler(VoxelMesh::RESAMPLE_DIRECT);
+		mesh.setSize(float(size));
+		std::vector<BYTE> scalar(size_t(size) * size * size);
+		size_t different = 0;
+		int worst = 0;
+		for (int rotation = 0; rotation < rotations; ++rotation)
+		{
+			/* not the rotations of the timing runs */
+			math::Matrix4x4 mrot = getRotation(1000 + rotation);
+			mesh.setSSE2Enabled(false);
+			mesh.invalidate();
+			mesh.update(mrot);
+			for (int z = 0, i = 0; z < size; ++z)
+				for (int y = 0; y < size; ++y)
+					for (int x = 0; x < size; ++x)
+						scalar[i++] = mesh.getVoxel(x, y, z);
+
+			mesh.setSSE2Enabled(true);
+			mesh.invalidate();
+			mesh.update(mrot);
+			for (int z = 0, i = 0; z < size; ++z)
+				for (int y = 0; y < size; ++y)
+					for (int x = 0; x < size; ++x)
+					{
+						int diff = abs(int(mesh.getVoxel(x, y, z)) - int(scalar[i++]));
+						if (0 != diff) different++;
+						worst = std::max(worst, diff);
+					}
+		}
+
+		printf("%5d rows: %d rotations, %d voxels differ, by at most %d\n", size, rotations, int(different), worst);
+		if (worst > 1)
+			throw core::FatalException("the SSE2 rows don't match the scalar ones");
+	}
+
+	/* the direct resampler against the shear one. they interpolate
+	 * differently, so they only agree roughly, but coordinates that overflow
+	 * show up as whole regions that are way off */
+	void verifyResamplers(VoxelMesh &mesh, int size, int rotations)
+	{
+		mesh.setOutputMode(VoxelMesh::OUTPUT_CUBES);
+		mesh.setSSE2Enabled(true);
+		mesh.setSize(float(size));
+		std::vector<BYTE> shear(size_t(size) * size * size);
+		size_t far = 0, total = 0;
+		for (int rotation = 0; rotation < rotations; ++rotation)
+		{
+			math::Matrix4x4 mrot = getRotation(1000 + rotation);
+			mesh.setResampler(VoxelMesh::RESAMPLE_SHEAR);
+			mesh.update(mrot);
+			for (int z = 0, i = 0; z < size; ++z)
+				for (int y = 0; y < size; ++y)
+					for (int x = 0; x < size; ++x)
+						shear[i++] = mesh.getVoxel(x, y, z);
+
+			mesh.setResampler(VoxelMesh::RESAMPLE_DIRECT);
+			mesh.update(mrot);
+			for (int z = 0, i = 0; z < size; ++z)
+				for (int y = 0; y < size; ++y)
+					for (int x = 0; x < size; ++x)
+					{
+						if (abs(int(mesh.getVoxel(x, y, z)) - int(shear[i++])) > 64) far++;
+						total++;
+					}
+		}
+		printf("%5d resamplers: %d rotations, %.4f%% of the voxels far apart\n", size, rotations, 100.0 * far / total);
+		if (far * 1000 > total)
+			throw core::FatalException("the direct resampler doesn't match the shear one");
+	}
+
+	void writeCSV(const std::string &fileName, const std::vector<Result> &results)
+	{
+		FILE *fp = fopen(fileName.c_str(), "w");
+		if (NULL == fp) throw core::FatalException("failed to open " + fileName);
+		fprintf(fp, "size,path,threads,ms_per_update,primitives,ns_per_voxel,primitives_per_second,scaling\n");
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result &r = results[i];
+			fprintf(fp, "%d,%s,%d,%.4f,%.0f,%.3f,%.0f,%.3f\n",
+				r.size, r.path, r.threads, r.seconds * 1e3, r.primitives,
+				r.nsPerVoxel, r.primitivesPerSecond, r.scaling);
+		}
+		fclose(fp);
+	}
+
+	void writeJSON(const std::string &fileName, const Options &options, const std::vector<Result> &results)
+	{
+		FILE *fp = fopen(fileName.c_str(), "w");
+		if (NULL == fp) throw core::FatalException("failed to open " + fileName);
+		fprintf(fp, "{\n");
+		fprintf(fp, "\t\"source\": \"%s\",\n", options.voxelFile.empty() ? "procedural" : options.voxelFile.c_str());
+		fprintf(fp, "\t\"rotations\": %d,\n", options.rotations);
+		fprintf(fp, "\t\"results\": [\n");
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result &r = results[i];
+			fprintf(fp, "\t\t{ \"size\": %d, \"path\": \"%s\", \"threads\": %d, \"ms_per_update\": %.4f, \"primitives\": %.0f, "
+				"\"ns_per_voxel\": %.3f, \"primitives_per_second\": %.0f, \"scaling\": %.3f }%s\n",
+				r.size, r.path, r.threads, r.seconds * 1e3, r.primitives,
+				r.nsPerVoxel, r.primitivesPerSecond, r.scaling,
+				i + 1 < results.size() ? "," : "");
+		}
+		fprintf(fp, "\t]\n}\n");
+		fclose(fp);
+	}
+
+	Options parseOptions(int argc, char *argv[])
+	{
+		Options options;
+		tools::Arguments args(argc, argv);
+		while (args.next())
+		{
+			const std::string arg = args.getName();
+			const char *value = args.getValue();
+
+			if      ("-file" == arg)      options.voxelFile = value;
+			else if ("-grid" == arg)      options.gridSize = atoi(value);
+			else if ("-min" == arg)       options.minSize = atoi(value);
+			else if ("-max" == arg)       options.maxSize = atoi(value);
+			else if ("-rotations" == arg) options.rotations = atoi(value);
+			else if ("-threads" == arg)   options.maxThreads = atoi(value);
+			else if ("-csv" == arg)       options.csvFile = value;
+			else if ("-json" == arg)      options.jsonFile = value;
+			else if ("-verify" == arg)    options.verify = 0 != atoi(value);
+			else throw core::FatalException("unknown option " + arg);
+		}
+
+		if (options.minSize < 1 || options.maxSize > 256 || options.minSize > options.maxSize)
+			throw core::FatalException("mesh sizes must be within 1 - 256");
+		if (options.rotations < 1)
+			throw core::FatalException("need at least one rotation");
+		if (options.maxThreads <= 0)
+			options.maxThreads = omp_get_num_procs();
+		return options;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try {
+		Options options = parseOptions(argc, argv);
+
+		VoxelGrid voxelGrid = options.voxelFile.empty() ?
+			makeProceduralGrid(options.gridSize) :
+			engine::loadVoxelGrid(options.voxelFile);
+		printf("source: %s, %d^3, %.1f MB\n",
+			options.voxelFile.empty() ? "procedural" : options.voxelFile.c_str(),
+			int(voxelGrid.getSize()), voxelGrid.getMemoryUsage() / (1024.0 * 1024.0));
+
+		if (options.verify)
+		{
+			verifyIndices(voxelGrid);
+			verifyCopy(voxelGrid);
+			for (int size = options.minSize; size <= options.maxSize; size *= 2)
+			{
+				VoxelMesh mesh(voxelGrid, size);
+				if (core::cpu::hasSSE2()) verifyRows(mesh, size, options.rotations);
+				verifyResamplers(mesh, size, options.rotations);
+				verify(mesh, size);
+			}
+			printf("all indices, copies, rows, resamplers and view-culled instances match\n");
+			return 0;
+		}
+
+		printf("%5s %-12s %7s %12s %12s %11s %14s %8s\n",
+			"size", "path", "threads", "ms/update", "primitives", "ns/voxel", "primitives/s", "scaling");
+
+		std::vector<Result> results;
+		for (int size = options.minSize; size <= options.maxSize; size *= 2)
+		{
+			VoxelMesh mesh(voxelGrid, size);
+			for (int path = 0; path < 4; ++path)
+			{
+				const char *name;
+				switch (path)
+				{
+				case 0:
+					if (!core::cpu::hasSSE2()) continue;
+					name = "cubes-sse2";
+					mesh.setOutputMode(VoxelMesh::OUTPUT_CUBES);
+					mesh.setResampler(VoxelMesh::RESAMPLE_DIRECT);
+					mesh.setSSE2Enabled(true);
+					break;
+				case 1:
+					name = "cubes-scalar";
+					mesh.setOutputMode(VoxelMesh::OUTPUT_CUBES);
+					mesh.setResampler(VoxelMesh::RESAMPLE_DIRECT);
+					mesh.setSSE2Enabled(false);
+					break;
+				case 2:
+					name = "cubes-shear";
+					mesh.setOutputMode(VoxelMesh::OUTPUT_CUBES);
+					mesh.setResampler(VoxelMesh::RESAMPLE_SHEAR);
+					mesh.setSSE2Enabled(true);
+					break;
+				default:
+					name = "surface";
+					mesh.setOutputMode(VoxelMesh::OUTPUT_SURFACE);
+					mesh.setResampler(VoxelMesh::RESAMPLE_DIRECT);
+					mesh.setSSE2Enabled(true);
+					break;
+				}
+
+				double single = 0.0;
+				for (int threads = 1; ; threads = std::min(threads * 2, options.maxThreads))
+				{
+					Result result = run(mesh, size, name, threads, options.rotations);
+					if (1 == threads) single = result.seconds;
+					result.scaling = single / result.seconds;
+					results.push_back(result);
+
+					printf("%5d %-12s %7d %12.3f %12.0f %11.3f %14.0f %8.2f\n",
+						result.size, result.path, result.threads, result.seconds * 1e3, result.primitives,
+						result.nsPerVoxel, result.primitivesPerSecond, result.scaling);
+					if (threads == options.maxThreads) break;
+				}
+			}
+		}
+
+		if (!options.csvFile.empty()) writeCSV(options.csvFile, results);
+		if (!options.jsonFile.empty()) writeJSON(options.jsonFile, options, results);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "voxelbench: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
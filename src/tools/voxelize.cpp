@@ -0,0 +1,758 @@
+#include "stdafx.h"
+
+#include "../core/fatalexception.h"
+#include "../core/err.h"
+#include "../math/math.h"
+#include "../math/vector3.h"
+#include "../engine/voxelgrid.h"
+#include "toolcommon.h"
+
+#include <omp.h>
+
+/* offline mesh to signed distance field converter, writing the voxel files
+ * loadVoxelGrid() reads.
+ *
+ * usage: voxelize -mesh in.x|in.obj -out voxels.vox [-grid 128] [-padding 2]
+ *                 [-band 2] [-maxdist 0] [-threads 0] [-raw 0]
+ *
+ * the mesh is scaled uniformly to fit the grid, leaving -padding voxels on
+ * every side. voxels within -band voxels of a triangle find their closest
+ * one with a brute-force pass over the triangles near them, the voxels
+ * further out take the closest triangle of their nearest band voxel, found
+ * with a separable euclidean distance transform (three passes of independent
+ * rows, so it scales with the threads). the distance to that triangle is
+ * exact, the triangle itself very nearly always the closest one. the sign
+ * comes from casting rays along all three axes through a bvh and taking the
+ * majority of the parities, which copes with the odd crack or double face.
+ *
+ * distances are stored the same way as the exported ones, dist * 256 /
+ * -maxdist clamped to +-127 and negative inside, with -maxdist defaulting to
+ * half the grid. -raw 1 writes the plain version 1 slices instead of the
+ * precomputed file with the min/max pyramid. the working set is five bytes a
+ * voxel, the nearest seed of each plus its votes and later its distance, so
+ * 640 MB at 512^3. grids go up to 512, as 1024^3 doesn't fit a 32-bit
+ * process. */
+
+using math::Vector3;
+using tools::getTime;
+
+namespace
+{
+	struct Options
+	{
+		Options() :
+		  gridSize(128),
+		  padding(2.0f),
+		  band(2.0f),
+		  maxDist(0.0f),
+		  maxThreads(0),
+		  raw(false)
+		{}
+
+		std::string meshFile;
+		std::string voxelFile;
+		int gridSize;
+		float padding;
+		float band;
+		float maxDist;
+		int maxThreads;
+		bool raw;
+	};
+
+	struct Mesh
+	{
+		std::vector<Vector3> positions;
+		std::vector<int> indices;  // three per triangle
+
+		size_t getTriangleCount() const { return indices.size() / 3; }
+		const Vector3 &getVertex(size_t triangle, int corner) const { return positions[indices[triangle * 3 + corner]]; }
+	};
+
+	/* vertices and faces only, faces with more than three corners become fans */
+	Mesh loadOBJ(const std::string &fileName)
+	{
+		FILE *fp = fopen(fileName.c_str(), "r");
+		if (NULL == fp) throw core::FatalException("failed to load mesh " + fileName);
+
+		Mesh mesh;
+		char line[1024];
+		while (NULL != fgets(line, sizeof(line), fp))
+		{
+			if ('v' == line[0] && ' ' == line[1])
+			{
+				float x, y, z;
+				if (3 != sscanf(line + 2, "%f %f %f", &x, &y, &z))
+				{
+					fclose(fp);
+					throw core::FatalException("failed to load mesh " + fileName + ": malformed vertex");
+				}
+				mesh.positions.push_back(Vector3(x, y, z));
+			}
+			else if ('f' == line[0] && ' ' == line[1])
+			{
+				/* v, v/vt, v//vn or v/vt/vn, negative indices count from the end */
+				std::vector<int> face;
+				const char *token = line + 2;
+				int index, length;
+				while (1 == sscanf(token, " %d%n", &index, &length))
+				{
+					index = index < 0 ? int(mesh.positions.size()) + index : index - 1;
+					if (index < 0 || index >= int(mesh.positions.size()))
+					{
+						fclose(fp);
+						throw core::FatalException("failed to load mesh " + fileName + ": face index out of range");
+					}
+					face.push_back(index);
+					token += length;
+					while ('\0' != *token && !isspace((unsigned char)*token)) token++;
+				}
+				for (size_t i = 2; i < face.size(); ++i)
+				{
+					mesh.indices.push_back(face[0]);
+					mesh.indices.push_back(face[i - 1]);
+					mesh.indices.push_back(face[i]);
+				}
+			}
+		}
+		fclose(fp);
+		return mesh;
+	}
+
+	/* the .x files are compressed, so they go through d3dx like in the demo,
+	 * only on a null device since nothing gets drawn */
+	Mesh loadX(const std::string &fileName)
+	{
+		renderer::Device device = tools::createNullDevice();
+
+		ID3DXMesh *xmesh = NULL;
+		HRESULT hr = D3DXLoadMeshFromX(fileName.c_str(), D3DXMESH_SYSTEMMEM, device, 0, 0, 0, 0, &xmesh);
+		if (FAILED(hr)) throw core::FatalException("failed to load mesh \"" + fileName + "\"\n\n" + core::d3dGetError(hr));
+
+		D3DVERTEXELEMENT9 decl[MAX_FVF_DECL_SIZE];
+		xmesh->GetDeclaration(decl);
+		int offset = -1;
+		for (int i = 0; D3DDECLTYPE_UNUSED != decl[i].Type; ++i)
+			if (D3DDECLUSAGE_POSITION == decl[i].Usage && 0 == decl[i].UsageIndex) offset = decl[i].Offset;
+
+		Mesh mesh;
+		if (offset >= 0)
+		{
+			const DWORD stride = xmesh->GetNumBytesPerVertex();
+			const BYTE *vertices = NULL;
+			if (SUCCEEDED(xmesh->LockVertexBuffer(D3DLOCK_READONLY, (void**)&vertices)))
+			{
+				mesh.positions.resize(xmesh->GetNumVertices());
+				for (size_t i = 0; i < mesh.positions.size(); ++i)
+				{
+					const float *pos = (const float*)(vertices + i * stride + offset);
+					mesh.positions[i] = Vector3(pos[0], pos[1], pos[2]);
+				}
+				xmesh->UnlockVertexBuffer();
+			}
+
+			const void *indices = NULL;
+			if (SUCCEEDED(xmesh->LockIndexBuffer(D3DLOCK_READONLY, (void**)&indices)))
+			{
+				mesh.indices.resize(xmesh->GetNumFaces() * 3);
+				for (size_t i = 0; i < mesh.indices.size(); ++i)
+				{
+					if (xmesh->GetOptions() & D3DXMESH_32BIT) mesh.indices[i] = int(((const DWORD*)indices)[i]);
+					else mesh.indices[i] = int(((const WORD*)indices)[i]);
+				}
+				xmesh->UnlockIndexBuffer();
+			}
+		}
+
+		xmesh->Release();
+
+		if (mesh.positions.empty() || mesh.indices.empty())
+			throw core::FatalException("failed to load mesh " + fileName + ": no positions or faces");
+		return mesh;
+	}
+
+	Mesh loadMesh(const std::string &fileName)
+	{
+		std::string extension = fileName.substr(std::min(fileName.size(), fileName.find_last_of('.') + 1));
+		for (size_t i = 0; i < extension.size(); ++i)
+			extension[i] = char(tolower((unsigned char)extension[i]));
+		return "obj" == extension ? loadOBJ(fileName) : loadX(fileName);
+	}
+
+	/* scales and moves the mesh into grid space, where voxel (x, y, z) sits at
+	 * exactly (x, y, z) like in VoxelGrid::trilinearSample() */
+	void fitMesh(Mesh &mesh, int size, float padding)
+	{
+		Vector3 lo = mesh.positions[0], hi = mesh.positions[0];
+		for (size_t i = 1; i < mesh.positions.size(); ++i)
+		{
+			const Vector3 &p = mesh.positions[i];
+			lo = Vector3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+			hi = Vector3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+		}
+
+		float extent = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+		if (extent <= 0.0f) throw core::FatalException("mesh has no extent");
+		float scale = (size - 1 - 2 * padding) / extent;
+		if (scale <= 0.0f) throw core::FatalException("padding leaves no room for the mesh");
+
+		Vector3 center = (lo + hi) * 0.5f;
+		Vector3 offset(float(size - 1) / 2, float(size - 1) / 2, float(size - 1) / 2);
+		for (size_t i = 0; i < mesh.positions.size(); ++i)
+			mesh.positions[i] = (mesh.positions[i] - center) * scale + offset;
+	}
+
+	/* closest point on a triangle, from real-time collision detection */
+	Vector3 closestPointOnTriangle(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c)
+	{
+		Vector3 ab = b - a, ac = c - a, ap = p - a;
+		float d1 = math::dot(ab, ap), d2 = math::dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+		Vector3 bp = p - b;
+		float d3 = math::dot(ab, bp), d4 = math::dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3) return b;
+
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+		Vector3 cp = p - c;
+		float d5 = math::dot(ab, cp), d6 = math::dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6) return c;
+
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		float denom = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+
+	/* what nearest holds for voxels that haven't seen a seed yet. seeds hold
+	 * -1 - their closest triangle, all other voxels the index of their nearest
+	 * seed, so a single int a voxel does for both the band and the far field */
+	const int no_seed = INT_MAX;
+
+	inline int getSeedTriangle(const std::vector<int> &nearest, size_t index)
+	{
+		int seed = nearest[index];
+		return -1 - (seed < 0 ? seed : nearest[seed]);
+	}
+
+	/* the closest triangle of every voxel within band of one. the triangles are
+	 * binned by slabs of z, and every slab is done by one thread, so nothing is
+	 * shared. the squared distances to the closest one so far only live as
+	 * long as the slab. */
+	void computeNarrowBand(const Mesh &mesh, int size, float band, std::vector<int> &nearest)
+	{
+		const int slab_shift = 3;
+		const int slabs = (size + (1 << slab_shift) - 1) >> slab_shift;
+		std::vector<std::vector<int> > bins(slabs);
+		for (size_t t = 0; t < mesh.getTriangleCount(); ++t)
+		{
+			float lo = std::min(mesh.getVertex(t, 0).z, std::min(mesh.getVertex(t, 1).z, mesh.getVertex(t, 2).z)) - band;
+			float hi = std::max(mesh.getVertex(t, 0).z, std::max(mesh.getVertex(t, 1).z, mesh.getVertex(t, 2).z)) + band;
+			int z0 = std::max(0, int(ceilf(lo))) >> slab_shift;
+			int z1 = std::min(size - 1, int(floorf(hi))) >> slab_shift;
+			for (int slab = z0; slab <= z1; ++slab)
+				bins[slab].push_back(int(t));
+		}
+
+		const float band2 = band * band;
+#pragma omp parallel
+		{
+			std::vector<float> dist2(size_t(size) * size << slab_shift);
+#pragma omp for schedule(dynamic)
+			for (int slab = 0; slab < slabs; ++slab)
+			{
+				const int slab_z0 = slab << slab_shift;
+				const int slab_z1 = std::min(size, (slab + 1) << slab_shift) - 1;
+				const std::vector<int> &bin = bins[slab];
+				std::fill(dist2.begin(), dist2.end(), FLT_MAX);
+				for (size_t i = 0; i < bin.size(); ++i)
+				{
+					const Vector3 &a = mesh.getVertex(bin[i], 0);
+					const Vector3 &b = mesh.getVertex(bin[i], 1);
+					const Vector3 &c = mesh.getVertex(bin[i], 2);
+					Vector3 normal = math::cross(b - a, c - a);
+					float normal_length = math::length(normal);
+					if (normal_length > 0.0f) normal = normal * (1.0f / normal_length);
+
+					int x0 = std::max(0,        int(ceilf (std::min(a.x, std::min(b.x, c.x)) - band)));
+					int x1 = std::min(size - 1, int(floorf(std::max(a.x, std::max(b.x, c.x)) + band)));
+					int y0 = std::max(0,        int(ceilf (std::min(a.y, std::min(b.y, c.y)) - band)));
+					int y1 = std::min(size - 1, int(floorf(std::max(a.y, std::max(b.y, c.y)) + band)));
+					int z0 = std::max(slab_z0,  int(ceilf (std::min(a.z, std::min(b.z, c.z)) - band)));
+					int z1 = std::min(slab_z1,  int(floorf(std::max(a.z, std::max(b.z, c.z)) + band)));
+
+					for (int z = z0; z <= z1; ++z)
+						for (int y = y0; y <= y1; ++y)
+							for (int x = x0; x <= x1; ++x)
+							{
+								const Vector3 p(x, y, z);
+								/* the plane is a cheap lower bound, big slanted triangles have mostly empty boxes */
+								float plane = math::dot(normal, p - a);
+								if (plane * plane > band2) continue;
+
+								Vector3 d = p - closestPointOnTriangle(p, a, b, c);
+								float d2 = math::dot(d, d);
+								size_t index = (size_t(z) * size + y) * size + x;
+								size_t slab_index = index - size_t(slab_z0) * size * size;
+								if (d2 <= band2 && d2 < dist2[slab_index])
+								{
+									dist2[slab_index] = d2;
+									nearest[index] = -1 - bin[i];
+								}
+							}
+				}
+			}
+		}
+	}
+
+	/* axis-aligned boxes over the triangles, split at the median of the
+	 * longest axis. the first child directly follows its parent. */
+	class BVH
+	{
+	public:
+		BVH(const Mesh &mesh) : mesh(mesh)
+		{
+			triangles.resize(mesh.getTriangleCount());
+			for (size_t i = 0; i < triangles.size(); ++i)
+				triangles[i] = int(i);
+			centroids.resize(triangles.size());
+			for (size_t i = 0; i < triangles.size(); ++i)
+				centroids[i] = (mesh.getVertex(i, 0) + mesh.getVertex(i, 1) + mesh.getVertex(i, 2)) * (1.0f / 3);
+			nodes.reserve(triangles.size() * 2 / leaf_size + 1);
+			build(0, int(triangles.size()));
+		}
+
+		/* the distances to every crossing of the ray along axis through
+		 * origin, from -inf on. origin[axis] doesn't matter. */
+		void castRay(int axis, const float origin[3], std::vector<float> &hits) const
+		{
+			const int axis_u = (axis + 1) % 3, axis_v = (axis + 2) % 3;
+			const float u = origin[axis_u], v = origin[axis_v];
+			hits.clear();
+
+			int stack[64];
+			int top = 0;
+			stack[top++] = 0;
+			while (top > 0)
+			{
+				const Node &node = nodes[stack[--top]];
+				if (u < node.lo[axis_u] || u > node.hi[axis_u] || v < node.lo[axis_v] || v > node.hi[axis_v]) continue;
+
+				if (node.count > 0)
+				{
+					for (int i = node.first; i < node.first + node.count; ++i)
+					{
+						float t;
+						if (intersect(triangles[i], axis, u, v, t)) hits.push_back(t);
+					}
+					continue;
+				}
+				assert(top + 2 <= 64);
+				stack[top++] = node.first;
+				stack[top++] = int(&node - &nodes[0]) + 1;
+			}
+			std::sort(hits.begin(), hits.end());
+		}
+
+	private:
+		enum { leaf_size = 4 };
+
+		struct Node
+		{
+			float lo[3], hi[3];
+			int first;  // first triangle of a leaf, or the second child
+			int count;  // 0 for inner nodes
+		};
+
+		int build(int begin, int end)
+		{
+			int index = int(nodes.size());
+			nodes.push_back(Node());
+
+			float lo[3] = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+			float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			float centroid_lo[3] = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+			float centroid_hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (int i = begin; i < end; ++i)
+			{
+				for (int corner = 0; corner < 3; ++corner)
+				{
+					const float *p = &mesh.getVertex(triangles[i], corner).x;
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						lo[axis] = std::min(lo[axis], p[axis]);
+						hi[axis] = std::max(hi[axis], p[axis]);
+					}
+				}
+				const float *c = &centroids[triangles[i]].x;
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					centroid_lo[axis] = std::min(centroid_lo[axis], c[axis]);
+					centroid_hi[axis] = std::max(centroid_hi[axis], c[axis]);
+				}
+			}
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				nodes[index].lo[axis] = lo[axis];
+				nodes[index].hi[axis] = hi[axis];
+			}
+
+			if (end - begin <= leaf_size)
+			{
+				nodes[index].first = begin;
+				nodes[index].count = end - begin;
+				return index;
+			}
+
+			int split_axis = 0;
+			for (int axis = 1; axis < 3; ++axis)
+				if (centroid_hi[axis] - centroid_lo[axis] > centroid_hi[split_axis] - centroid_lo[split_axis]) split_axis = axis;
+
+			int middle = (begin + end) / 2;
+			std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end,
+				CentroidLess(centroids, split_axis));
+
+			build(begin, middle);
+			int second = build(middle, end);
+			nodes[index].first = second;
+			nodes[index].count = 0;
+			return index;
+		}
+
+		/* which side of p -> q the point is on. in doubles, the differences and
+		 * products of the floats are exact, so two triangles sharing an edge get
+		 * exactly opposite signs and a ray can't slip through the crack between
+		 * them or hit both. with floats, rays close to a diagonal did. */
+		static double getEdgeSide(const float *p, const float *q, int axis_u, int axis_v, float u, float v)
+		{
+			return
+				(double(p[axis_u]) - u) * (double(q[axis_v]) - v) -
+				(double(p[axis_v]) - v) * (double(q[axis_u]) - u);
+		}
+
+		/* a ray right on an edge belongs to the triangle the edge runs one way
+		 * in, so exactly one of the two triangles sharing it is hit */
+		static bool ownsEdge(const float *p, const float *q, int axis_u, int axis_v, bool flip)
+		{
+			float du = q[axis_u] - p[axis_u], dv = q[axis_v] - p[axis_v];
+			if (flip)
+			{
+				du = -du;
+				dv = -dv;
+			}
+			return dv > 0.0f || (0.0f == dv && du > 0.0f);
+		}
+
+		/* 2d point in triangle in the u-v plane, then the depth along axis */
+		bool intersect(int triangle, int axis, float u, float v, float &t) const
+		{
+			const int axis_u = (axis + 1) % 3, axis_v = (axis + 2) % 3;
+			const float *a = &mesh.getVertex(triangle, 0).x;
+			const float *b = &mesh.getVertex(triangle, 1).x;
+			const float *c = &mesh.getVertex(triangle, 2).x;
+
+			double wa = getEdgeSide(b, c, axis_u, axis_v, u, v);
+			double wb = getEdgeSide(c, a, axis_u, axis_v, u, v);
+			double wc = getEdgeSide(a, b, axis_u, axis_v, u, v);
+			double sum = wa + wb + wc;
+			if (0.0 == sum) return false;  // edge-on
+
+			/* either winding, as seen along the ray */
+			const bool flip = sum < 0.0;
+			if (flip ? (wa > 0.0 || wb > 0.0 || wc > 0.0) : (wa < 0.0 || wb < 0.0 || wc < 0.0)) return false;
+			if (0.0 == wa && !ownsEdge(b, c, axis_u, axis_v, flip)) return false;
+			if (0.0 == wb && !ownsEdge(c, a, axis_u, axis_v, flip)) return false;
+			if (0.0 == wc && !ownsEdge(a, b, axis_u, axis_v, flip)) return false;
+
+			t = float((wa * a[axis] + wb * b[axis] + wc * c[axis]) / sum);
+			return true;
+		}
+
+		struct CentroidLess
+		{
+			CentroidLess(const std::vector<Vector3> &centroids, int axis) : centroids(centroids), axis(axis) {}
+			bool operator()(int a, int b) const { return (&centroids[a].x)[axis] < (&centroids[b].x)[axis]; }
+			const std::vector<Vector3> &centroids;
+			int axis;
+		};
+
+		const Mesh &mesh;
+		std::vector<int> triangles;
+		std::vector<Vector3> centroids;
+		std::vector<Node> nodes;
+	};
+
+	/* every row along every axis is one ray, a voxel gets a vote for each ray
+	 * that crossed the surface an odd number of times before reaching it. the
+	 * rays are nudged off the voxel centers so they don't run along edges. */
+	void computeInsideVotes(const BVH &bvh, int size, std::vector<signed char> &votes)
+	{
+		const float nudge[3] = { 1.2345e-3f, 2.3456e-3f, 3.4567e-3f };
+		const size_t stride[3] = { 1, size_t(size), size_t(size) * size };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			/* rows next to each other in the loop are next to each other in memory, if the axis allows */
+			const int fast = 0 == axis ? 1 : 0, slow = 3 - axis - fast;
+#pragma omp parallel
+			{
+				std::vector<float> hits;
+#pragma omp for schedule(dynamic, 16)
+				for (int row = 0; row < size * size; ++row)
+				{
+					float origin[3];
+					origin[axis] = 0.0f;
+					origin[fast] = row % size + nudge[fast];
+					origin[slow] = row / size + nudge[slow];
+					bvh.castRay(axis, origin, hits);
+					if (hits.empty()) continue;
+
+					size_t index = (row % size) * stride[fast] + (row / size) * stride[slow];
+					size_t hit = 0;
+					for (int i = 0; i < size; ++i, index += stride[axis])
+					{
+						while (hit < hits.size() && hits[hit] < float(i)) hit++;
+						if (hit & 1) votes[index]++;
+					}
+				}
+			}
+		}
+	}
+
+	/* felzenszwalb & huttenlocher's lower envelope of parabolas, f is replaced
+	 * by min over q of (p - q)^2 + f(q), and label by the label of that q.
+	 * v, z, d and l are scratch of n, n + 1, n and n. */
+	void distanceTransform1D(float *f, int *label, int n, int *v, float *z, float *d, int *l)
+	{
+		const float inf = FLT_MAX;
+		int k = -1;
+		for (int q = 0; q < n; ++q)
+		{
+			if (f[q] >= inf) continue;
+			float s = -inf;
+			while (k >= 0)
+			{
+				s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * (q - v[k]));
+				if (s > z[k]) break;
+				k--;
+				s = -inf;
+			}
+			k++;
+			v[k] = q;
+			z[k] = s;
+			z[k + 1] = inf;
+		}
+		if (k < 0) return;  // nothing to propagate
+
+		int j = 0;
+		for (int q = 0; q < n; ++q)
+		{
+			while (z[j + 1] < q) j++;
+			float dq = float(q - v[j]);
+			d[q] = dq * dq + f[v[j]];
+			l[q] = label[v[j]];
+		}
+		memcpy(f, d, n * sizeof(float));
+		memcpy(label, l, n * sizeof(int));
+	}
+
+	/* hands the closest triangles of the band on to the rest of the grid. the
+	 * band voxels are the seeds of an exact euclidean distance transform, and
+	 * every voxel ends up with the closest triangle of its nearest seed. with
+	 * the squared band distances as the seed values instead, the parabolas
+	 * would badly underestimate the distance right outside the band. the
+	 * transform only keeps the nearest seed of a voxel, the squared distance
+	 * to it follows from the two positions. */
+	void computeFarField(int size, std::vector<int> &nearest)
+	{
+		int shift = 0;
+		while ((1 << shift) < size) shift++;
+		const int mask = size - 1;
+
+		const size_t stride[3] = { 1, size_t(size), size_t(size) * size };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const int fast = 0 == axis ? 1 : 0, slow = 3 - axis - fast;
+#pragma omp parallel
+			{
+				std::vector<float> row(size), z(size + 1), d(size);
+				std::vector<int> labels(size), v(size), l(size);
+#pragma omp for schedule(dynamic, 16)
+				for (int r = 0; r < size * size; ++r)
+				{
+					const size_t start = (r % size) * stride[fast] + (r / size) * stride[slow];
+					for (int i = 0; i < size; ++i)
+					{
+						const int index = int(start + i * stride[axis]);
+						const int seed = nearest[index] < 0 ? index : nearest[index];
+						if (no_seed == seed)
+						{
+							row[i] = FLT_MAX;
+							continue;
+						}
+						/* all whole numbers below 2^24, so exact */
+						int dx = (index & mask) - (seed & mask);
+						int dy = ((index >> shift) & mask) - ((seed >> shift) & mask);
+						int dz = (index >> (2 * shift)) - (seed >> (2 * shift));
+						row[i] = float(dx * dx + dy * dy + dz * dz);
+						labels[i] = seed;
+					}
+					distanceTransform1D(&row[0], &labels[0], size, &v[0], &z[0], &d[0], &l[0]);
+					for (int i = 0; i < size; ++i)
+					{
+						/* seeds stay their own nearest, and keep their triangle */
+						const size_t index = start + i * stride[axis];
+						if (row[i] < FLT_MAX && nearest[index] >= 0) nearest[index] = labels[i];
+					}
+				}
+			}
+		}
+	}
+
+	void writeRaw(const std::string &fileName, int size, float maxDist, const std::vector<signed char> &voxels)
+	{
+		FILE *fp = fopen(fileName.c_str(), "wb");
+		if (NULL == fp) throw core::FatalException("failed to save voxel");
+
+		engine::VoxelFileHeader header;
+		header.magic = VOXEL_FILE_MAGIC;
+		header.version = VOXEL_FILE_VERSION_RAW;
+		header.grid_size = (unsigned int)size;
+		header.max_dist = maxDist;
+
+		bool ok = 1 == fwrite(&header, sizeof(header), 1, fp);
+		ok = ok && voxels.size() == fwrite(&voxels[0], 1, voxels.size(), fp);
+		fclose(fp);
+		if (!ok) throw core::FatalException("failed to save voxel");
+	}
+
+	void writePrecomputed(const std::string &fileName, int size, float maxDist, const std::vector<signed char> &voxels)
+	{
+		engine::VoxelGrid grid(size);
+		grid.max_dist = maxDist;
+		const signed char *src = &voxels[0];
+		for (int z = 0; z < size; ++z)
+		{
+			for (int y = 0; y < size; ++y)
+				for (int x = 0; x < size; ++x)
+					grid.setDistance(x, y, z, *src++);
+			if (z > 0 && 0 == (z & 7)) grid.compactBrickLayer((z >> 3) - 1);
+		}
+		grid.compact();
+		engine::saveVoxelGrid(grid, fileName);
+	}
+
+	Options parseOptions(int argc, char *argv[])
+	{
+		Options options;
+		tools::Arguments args(argc, argv);
+		while (args.next())
+		{
+			const std::string arg = args.getName();
+			const char *value = args.getValue();
+
+			if      ("-mesh" == arg)    options.meshFile = value;
+			else if ("-out" == arg)     options.voxelFile = value;
+			else if ("-grid" == arg)    options.gridSize = atoi(value);
+			else if ("-padding" == arg) options.padding = float(atof(value));
+			else if ("-band" == arg)    options.band = float(atof(value));
+			else if ("-maxdist" == arg) options.maxDist = float(atof(value));
+			else if ("-threads" == arg) options.maxThreads = atoi(value);
+			else if ("-raw" == arg)     options.raw = 0 != atoi(value);
+			else throw core::FatalException("unknown option " + arg);
+		}
+
+		if (options.meshFile.empty() || options.voxelFile.empty())
+			throw core::FatalException("need both -mesh and -out");
+		if (options.gridSize < 8 || options.gridSize > 512 || 0 != (options.gridSize & (options.gridSize - 1)))
+			throw core::FatalException("grid size must be a power of two within 8 - 512");
+		if (options.band < 1.0f)
+			throw core::FatalException("band must be at least one voxel");
+		if (options.padding < 0.0f)
+			throw core::FatalException("padding can't be negative");
+		if (options.maxDist <= 0.0f)
+			options.maxDist = float(options.gridSize) / 2;
+		if (options.maxThreads <= 0)
+			options.maxThreads = omp_get_num_procs();
+		return options;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try {
+		Options options = parseOptions(argc, argv);
+		omp_set_num_threads(options.maxThreads);
+		const int size = options.gridSize;
+		const size_t cells = size_t(size) * size * size;
+
+		double start = getTime();
+		Mesh mesh = loadMesh(options.meshFile);
+		if (0 == mesh.getTriangleCount()) throw core::FatalException("mesh has no triangles");
+		fitMesh(mesh, size, options.padding);
+		printf("mesh: %s, %d vertices, %d triangles\n", options.meshFile.c_str(),
+			int(mesh.positions.size()), int(mesh.getTriangleCount()));
+
+		/* the votes go into the voxels, and the distances replace them in place */
+		double stage = getTime();
+		std::vector<signed char> voxels(cells, 0);
+		{
+			BVH bvh(mesh);
+			computeInsideVotes(bvh, size, voxels);
+		}
+		printf("%-12s %8.3f s\n", "sign", getTime() - stage);
+
+		stage = getTime();
+		std::vector<int> nearest(cells, no_seed);
+		computeNarrowBand(mesh, size, options.band, nearest);
+		printf("%-12s %8.3f s\n", "band", getTime() - stage);
+
+		stage = getTime();
+		computeFarField(size, nearest);
+		printf("%-12s %8.3f s\n", "far field", getTime() - stage);
+
+		/* exact distances to the closest triangles, quantized like the exported ones */
+		stage = getTime();
+		const float scale = 256.0f / options.maxDist;
+		int inside = 0;
+#pragma omp parallel for reduction(+:inside)
+		for (int z = 0; z < size; ++z)
+		{
+			size_t index = size_t(z) * size * size;
+			for (int y = 0; y < size; ++y)
+				for (int x = 0; x < size; ++x, ++index)
+				{
+					const int triangle = getSeedTriangle(nearest, index);
+					assert(triangle >= 0);
+					const Vector3 p(x, y, z);
+					Vector3 d = p - closestPointOnTriangle(p, mesh.getVertex(triangle, 0), mesh.getVertex(triangle, 1), mesh.getVertex(triangle, 2));
+					float dist = math::length(d);
+					if (voxels[index] >= 2)
+					{
+						dist = -dist;
+						inside++;
+					}
+					voxels[index] = (signed char)math::clamp(floorf(dist * scale + 0.5f), -127.0f, 127.0f);
+				}
+		}
+		std::vector<int>().swap(nearest);
+		printf("%-12s %8.3f s\n", "distances", getTime() - stage);
+
+		stage = getTime();
+		if (options.raw) writeRaw(options.voxelFile, size, options.maxDist, voxels);
+		else writePrecomputed(options.voxelFile, size, options.maxDist, voxels);
+		printf("%-12s %8.3f s\n", "write", getTime() - stage);
+
+		printf("%s: %d^3, %.1f%% inside, %.3f s total on %d threads\n", options.voxelFile.c_str(),
+			size, 100.0 * inside / cells, getTime() - start, options.maxThreads);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "voxelize: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}